@@ -0,0 +1,245 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+#include "Vec4f.hpp"
+#include "Camera.hpp"
+#include "Sphere.hpp"
+
+// Microbenchmarks of the host camera and ray math, with the 12 byte Vec
+// shared with the kernel and with the SIMD Vec4f.
+//
+// Usage: VecBench [iterations]
+
+
+static const unsigned int kWidth = 800;
+static const unsigned int kHeight = 600;
+static const float kFov = 0.785398f;
+
+// Keeps the results alive
+static volatile float sink;
+
+template <typename F>
+static void Run(const char *name, const unsigned int iterations, const size_t opsPerIteration, F f) {
+	// Warm up the caches first
+	float checksum = f();
+
+	auto startTime = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < iterations; ++i)
+		checksum += f();
+	auto endTime = std::chrono::steady_clock::now();
+
+	sink = checksum;
+
+	const double ns = std::chrono::duration_cast<std::chrono::duration<double, std::nano>>(endTime - startTime).count();
+	printf("%-32s %8.3f ns/op\n", name, ns / (static_cast<double>(iterations) * opsPerIteration));
+}
+
+//------------------------------------------------------------------------------
+// Camera set up, as RayTracingConfig::SetUpCamera()
+
+static Camera SetUpCamera(const Vec& orig, const Vec& target) {
+	Camera cam;
+	cam.orig = orig;
+	cam.target = target;
+
+	cam.dir = cam.target - cam.orig;
+	cam.dir.norm();
+
+	const Vec up(0.f, 1.f, 0.f);
+	cam.x = cam.dir.cross(up);
+	cam.x.norm();
+	cam.x = cam.x * (kWidth * kFov / kHeight);
+
+	cam.y = cam.x.cross(cam.dir);
+	cam.y.norm();
+	cam.y = cam.y * kFov;
+
+	return cam;
+}
+
+static Camera SetUpCamera4f(const Vec& orig, const Vec& target) {
+	const Vec4f o(orig);
+	const Vec4f dir = (Vec4f(target) - o).normalized();
+	const Vec4f x = dir.cross(Vec4f(0.f, 1.f, 0.f)).normalized() * (kWidth * kFov / kHeight);
+	const Vec4f y = x.cross(dir).normalized() * kFov;
+
+	Camera cam;
+	cam.orig = orig;
+	cam.target = target;
+	dir.Store(&cam.dir);
+	x.Store(&cam.x);
+	y.Store(&cam.y);
+
+	return cam;
+}
+
+//------------------------------------------------------------------------------
+// Primary rays through the pixel centers, as GeneratePrimaryRay() of the kernel
+
+static float PrimaryRays(const Camera& cam, std::vector<Vec> *dirs) {
+	const float invWidth = 1.f / kWidth;
+	const float invHeight = 1.f / kHeight;
+
+	float sum = 0.f;
+	for (unsigned int y = 0; y < kHeight; ++y) {
+		const float kcy = (y + .5f) * invHeight - .5f;
+		const Vec row = cam.dir.madd(cam.y, kcy);
+
+		for (unsigned int x = 0; x < kWidth; ++x) {
+			const float kcx = (x + .5f) * invWidth - .5f;
+			Vec rdir = row.madd(cam.x, kcx);
+			rdir.norm();
+
+			(*dirs)[y * kWidth + x] = rdir;
+			sum += rdir.z;
+		}
+	}
+
+	return sum;
+}
+
+static float PrimaryRays4f(const Camera& cam, std::vector<Vec4f> *dirs) {
+	const float invWidth = 1.f / kWidth;
+	const float invHeight = 1.f / kHeight;
+	const Vec4f camDir(cam.dir), camX(cam.x), camY(cam.y);
+
+	float sum = 0.f;
+	for (unsigned int y = 0; y < kHeight; ++y) {
+		const float kcy = (y + .5f) * invHeight - .5f;
+		const Vec4f row = camDir.madd(camY, kcy);
+
+		for (unsigned int x = 0; x < kWidth; ++x) {
+			const float kcx = (x + .5f) * invWidth - .5f;
+			const Vec4f rdir = row.madd(camX, kcx).normalized();
+
+			(*dirs)[y * kWidth + x] = rdir;
+			sum += rdir.Z();
+		}
+	}
+
+	return sum;
+}
+
+//------------------------------------------------------------------------------
+// Closest sphere of each primary ray, as SphereIntersectMin() of the kernel
+
+static float Intersect(const Vec& o, const std::vector<Vec>& dirs, const std::vector<Sphere>& spheres) {
+	float sum = 0.f;
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		const Vec& d = dirs[i];
+		float closest = 1e20f;
+
+		for (size_t s = 0; s < spheres.size(); ++s) {
+			const Vec op = spheres[s].p - o;
+			const float b = op.dot(d);
+			float det = b * b - op.dot(op) + spheres[s].rad * spheres[s].rad;
+			if (det < 0.f)
+				continue;
+
+			det = std::sqrt(det);
+			const float t = (b - det > 0.01f) ? (b - det) : (b + det);
+			if ((t > 0.01f) && (t < closest))
+				closest = t;
+		}
+
+		sum += closest;
+	}
+
+	return sum;
+}
+
+static float Intersect4f(const Vec& origin, const std::vector<Vec4f>& dirs, const std::vector<Sphere>& spheres) {
+	// Unpacked once, as the kernel stages them
+	std::vector<Vec4f> centers(spheres.size());
+	for (size_t s = 0; s < spheres.size(); ++s)
+		centers[s] = Vec4f(spheres[s].p);
+
+	const Vec4f o(origin);
+	float sum = 0.f;
+	for (size_t i = 0; i < dirs.size(); ++i) {
+		const Vec4f& d = dirs[i];
+		float closest = 1e20f;
+
+		for (size_t s = 0; s < spheres.size(); ++s) {
+			const Vec4f op = centers[s] - o;
+			const float b = op.dot(d);
+			float det = b * b - op.dot(op) + spheres[s].rad * spheres[s].rad;
+			if (det < 0.f)
+				continue;
+
+			det = std::sqrt(det);
+			const float t = (b - det > 0.01f) ? (b - det) : (b + det);
+			if ((t > 0.01f) && (t < closest))
+				closest = t;
+		}
+
+		sum += closest;
+	}
+
+	return sum;
+}
+
+//------------------------------------------------------------------------------
+
+int main(int argc, char *argv[]) {
+	const unsigned int iterations = (argc > 1) ? std::max(1, atoi(argv[1])) : 20;
+
+#if defined(VEC4F_SSE) && defined(__FMA__)
+	printf("Vec4f: SSE + FMA\n");
+#elif defined(VEC4F_SSE)
+	printf("Vec4f: SSE\n");
+#elif defined(VEC4F_NEON)
+	printf("Vec4f: NEON\n");
+#else
+	printf("Vec4f: scalar\n");
+#endif
+
+	// Cornell box of Scene/cornell.scn
+	std::vector<Sphere> spheres;
+	spheres.push_back(Sphere(1e4f, Vec(1e4f + 1.f, 40.8f, 81.6f), Vec(), Vec(.75f, .25f, .25f), DIFFuse));
+	spheres.push_back(Sphere(1e4f, Vec(-1e4f + 99.f, 40.8f, 81.6f), Vec(), Vec(.25f, .25f, .75f), DIFFuse));
+	spheres.push_back(Sphere(1e4f, Vec(50.f, 40.8f, 1e4f), Vec(), Vec(.75f, .75f, .75f), DIFFuse));
+	spheres.push_back(Sphere(1e4f, Vec(50.f, 40.8f, -1e4f + 270.f), Vec(), Vec(), DIFFuse));
+	spheres.push_back(Sphere(1e4f, Vec(50.f, 1e4f, 81.6f), Vec(), Vec(.75f, .75f, .75f), DIFFuse));
+	spheres.push_back(Sphere(1e4f, Vec(50.f, -1e4f + 81.6f, 81.6f), Vec(), Vec(.75f, .75f, .75f), DIFFuse));
+	spheres.push_back(Sphere(16.5f, Vec(27.f, 16.5f, 47.f), Vec(), Vec(.9f, .9f, .9f), SPECular));
+	spheres.push_back(Sphere(16.5f, Vec(73.f, 16.5f, 78.f), Vec(), Vec(.9f, .9f, .9f), REFRactive));
+	spheres.push_back(Sphere(7.f, Vec(50.f, 81.6f - 15.f, 81.6f), Vec(12.f, 12.f, 12.f), Vec(), DIFFuse));
+
+	const Vec orig(50.f, 45.f, 205.6f);
+	const Vec target(50.f, 45.f - 0.042612f, 204.6f);
+
+	const size_t cameraOps = 100000;
+	Run("camera set up (Vec)", iterations, cameraOps, [&]() {
+		float sum = 0.f;
+		for (size_t i = 0; i < cameraOps; ++i)
+			sum += SetUpCamera(orig, target + Vec(0.f, 0.f, i * 1e-6f)).y.y;
+		return sum;
+	});
+	Run("camera set up (Vec4f)", iterations, cameraOps, [&]() {
+		float sum = 0.f;
+		for (size_t i = 0; i < cameraOps; ++i)
+			sum += SetUpCamera4f(orig, target + Vec(0.f, 0.f, i * 1e-6f)).y.y;
+		return sum;
+	});
+
+	const Camera cam = SetUpCamera(orig, target);
+	std::vector<Vec> dirs(kWidth * kHeight);
+	std::vector<Vec4f> dirs4f(kWidth * kHeight);
+
+	Run("primary rays (Vec)", iterations, dirs.size(), [&]() { return PrimaryRays(cam, &dirs); });
+	Run("primary rays (Vec4f)", iterations, dirs.size(), [&]() { return PrimaryRays4f(cam, &dirs4f); });
+
+	const size_t intersectOps = dirs.size() * spheres.size();
+	Run("ray / sphere (Vec)", iterations, intersectOps, [&]() { return Intersect(cam.orig, dirs, spheres); });
+	Run("ray / sphere (Vec4f)", iterations, intersectOps, [&]() { return Intersect4f(cam.orig, dirs4f, spheres); });
+
+	return EXIT_SUCCESS;
+}
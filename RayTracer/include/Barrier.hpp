@@ -5,6 +5,7 @@
 #include <mutex>
 #include <condition_variable>
 #include <stdexcept>
+#include <chrono>
 
 class Barrier {
 
@@ -42,6 +43,46 @@ public:
 
     }
 
+    // Like wait(), but gives up after the timeout: the caller then no longer
+    // counts as arrived. Returns false on timeout.
+    template <class Rep, class Period>
+    bool wait_for(const std::chrono::duration<Rep, Period>& timeout) {
+
+        std::unique_lock<std::mutex> lock(mtx);
+
+        unsigned int gen = generation;
+
+        if (--count == 0) {
+
+            ++generation;
+            count = threshold;
+            cond.notify_all();
+            return true;
+        }
+
+        if (cond.wait_for(lock, timeout, [&]() { return gen != generation; }))
+            return true;
+
+        ++count;
+        return false;
+    }
+
+    // Removes a participant that has not arrived in the current generation,
+    // releasing the others if they were only waiting for it
+    void leave() {
+
+        std::unique_lock<std::mutex> lock(mtx);
+
+        --threshold;
+
+        if (--count == 0) {
+
+            ++generation;
+            count = threshold;
+            cond.notify_all();
+        }
+    }
+
 
 
 private:
@@ -0,0 +1,11 @@
+#ifndef _BLUENOISE_HPP_
+#define _BLUENOISE_HPP_
+
+#include <vector>
+
+// Tileable size x size blue noise mask made with the void-and-cluster
+// method (Ulichney 1993). Each value is the rank of the pixel in the
+// dithering order, mapped to [0, 1).
+std::vector<float> MakeBlueNoiseTile(const unsigned int size, const unsigned int seed = 1);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef _CAMERAPATH_HPP_
+#define _CAMERAPATH_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+#include "Camera.hpp"
+#include "Sphere.hpp"
+
+// Keyframes of an animation, read from a text file:
+//   camera <frame> <orig x y z> <target x y z>
+//   sphere <frame> <sphere index> <position x y z>
+// Lines starting with '#' are comments. The camera and each moved sphere
+// are linearly interpolated between their own keyframes, and held before
+// the first / after the last one.
+class CameraPath {
+
+public:
+	bool Load(const std::string& fileName, const unsigned int sceneSphereCount);
+
+	// Last keyframe + 1
+	unsigned int GetFrameCount() const;
+
+	// Sets the user defined values of the camera (orig, target)
+	void GetCamera(const unsigned int frame, Camera *camera) const;
+
+	// Moves the spheres having keyframes, the other ones are left as they are
+	void GetSpheres(const unsigned int frame, Sphere *spheres) const;
+	bool HasSphereKeys() const;
+
+private:
+	struct Key {
+		unsigned int frame;
+		Vec a, b;	/* camera orig and target, or sphere position */
+	};
+
+	static void Interpolate(const std::vector<Key>& keys, const unsigned int frame, Vec *a, Vec *b);
+
+	std::vector<Key> cameraKeys;
+	std::vector<std::vector<Key> > sphereKeys;	/* per sphere */
+	unsigned int frameCount{ 0 };
+};
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef _CHECKPOINT_HPP_
+#define _CHECKPOINT_HPP_
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "Vec.hpp"
+#include "Sphere.hpp"
+#include "Camera.hpp"
+
+/* Identifies the render a checkpoint belongs to */
+struct CheckpointKey {
+	uint64_t sceneHash;
+	float camera[6];	/* orig, target */
+	unsigned int width;
+	unsigned int height;
+
+	bool operator==(const CheckpointKey& other) const;
+	bool operator!=(const CheckpointKey& other) const;
+};
+
+/* Full-frame snapshot of the accumulation state of all the devices */
+struct CheckpointData {
+	CheckpointKey key;
+	unsigned int currentSample;
+	std::vector<Vec> colors;			/* width * height */
+	std::vector<unsigned int> seeds;	/* 2 * width * height */
+};
+
+// FNV-1a, hash can chain several buffers
+uint64_t HashBytes(const void *data, const size_t size, uint64_t hash = 14695981039346656037ull);
+uint64_t HashScene(const Sphere *spheres, const unsigned int sphereCount);
+CheckpointKey MakeCheckpointKey(const Sphere *spheres, const unsigned int sphereCount,
+	const Camera *camera, const unsigned int width, const unsigned int height);
+
+bool SaveCheckpoint(const std::string& fileName, const CheckpointData& data);
+bool LoadCheckpoint(const std::string& fileName, const CheckpointKey& key, CheckpointData *data);
+
+
+// Writes checkpoints on a background thread. Only the most recent snapshot
+// is kept if the writer is still busy with the previous one.
+class CheckpointWriter {
+
+public:
+	explicit CheckpointWriter(const std::string& checkpointFileName);
+	~CheckpointWriter();
+
+	// Takes the ownership of data
+	void Submit(CheckpointData *data);
+
+	const std::string& GetFileName() const;
+
+private:
+	static void WriterThread(CheckpointWriter *writer);
+
+	std::string fileName;
+
+	std::thread *writerThread{ nullptr };
+	std::mutex mtx;
+	std::condition_variable cond;
+
+	CheckpointData *pending{ nullptr };
+	bool stop{ false };
+};
+
+
+#endif
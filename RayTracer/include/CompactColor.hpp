@@ -0,0 +1,15 @@
+#ifndef _COMPACTCOLOR_HPP_
+#define _COMPACTCOLOR_HPP_
+
+#include <cstdint>
+
+#include "Vec.hpp"
+
+// Sum of the samples of a pixel in 64 bits, same layout as the compact
+// accumulation of the kernel (PARAM_ACCUMULATION_COMPACT): 19 bit mantissas
+// for r, g and b in bits 0-56 sharing the exponent in bits 57-63 (biased by
+// 64, 0 for black). Rounding to nearest, the negative values become 0.
+uint64_t PackCompactColor(const Vec &sum);
+Vec UnpackCompactColor(const uint64_t packed);
+
+#endif
@@ -3,6 +3,7 @@
 #define _COMPUTINGITEM_HPP_
 
 #include <string>
+#include <cstdint>
 
 #define __CL_ENABLE_EXCEPTIONS
 
@@ -10,48 +11,126 @@
 #include <CL/cl.hpp>
 
 #include <thread>
+#include <mutex>
+#include <vector>
 #include "Barrier.hpp"
 
 #include "Sphere.hpp"
 #include "Camera.hpp"
+#include "PlatformContext.hpp"
+#include "RenderOptions.hpp"
+#include "Reprojection.hpp"
+#include "Denoise.hpp"
+#include "MetricsServer.hpp"
 
 class ComputingUnit {
 
 public:
 
-	ComputingUnit(const cl::Device& dev, const std::string& kernelFileName,
+	ComputingUnit(PlatformContext *sharedContext, const cl::Device& dev,
+			const std::string& kernelFileName,
+			const RenderOptions& options,
 			const unsigned int forceGPUWorkSize,
-			Camera* camera, Sphere* spheres,
 			const unsigned int sceneSphereCount,
-			Barrier* startBarrier, Barrier* endBarrier);
+			Barrier* startBarrier, Barrier* endBarrier,
+			const int numaNode = -1);
 	~ComputingUnit();
 
-	void SetArgs(const unsigned int count);
+	// count is the number of samples per pixel accumulated so far
+	void SetArgs(const unsigned int count, const unsigned int samples = 1,
+		const unsigned int scale = 1);
 	void SetWorkLoad(const unsigned int offset, const unsigned int amount,
 		const unsigned int screenWidth,	const unsigned int screenHeght,
 		unsigned int *screenPixels);
 
-	void UpdateCameraBuffer(Camera *camera);
-	void UpdateSceneBuffer(Sphere *spheres);
+	// The screen of SetWorkLoad() is the crop window at (x, y) of a frame of
+	// frameWidth x frameHeight, whose projection the rays follow. The whole
+	// frame by default.
+	void SetCropWindow(const unsigned int frameWidth, const unsigned int frameHeight,
+		const unsigned int x, const unsigned int y);
+
+	// Frame buffer the next pixel readbacks go to. A buffer covering only the
+	// pixels [targetOffset, targetOffset + targetCount) of the frame can be
+	// given as well (targetCount = 0: the whole frame). With nullptr, the
+	// passes are neither read back nor denoised.
+	void SetPixelTarget(unsigned int *screenPixels, const unsigned int targetOffset = 0,
+		const unsigned int targetCount = 0);
+
+	// The next passes only read back the pixels of the last rendered pass,
+	// without launching the kernel
+	void SetReadbackOnly(const bool readback);
 
 	void ResetPerformance();
 
+	// Blocking copies of the accumulation state, used for checkpoints and re-balancing.
+	// seedsOut can be nullptr when only the colors are needed. The colors are
+	// averages: the compact accumulation keeps sums on the device, converted
+	// with samples per pixel, or with the per pixel counts of the reprojection
+	// (written first).
+	void ReadAccumulation(Vec *accumulation, unsigned int *seedsOut, const size_t count,
+		const unsigned int samples);
+	void WriteAccumulation(const Vec *accumulation, const unsigned int *seedsIn, const size_t count,
+		const unsigned int samples);
+
+	// Per pixel history of the reprojection mode. firstHitsOut can be nullptr.
+	void ReadReprojectionState(float *sampleCountsOut, FirstHit *firstHitsOut, const size_t count);
+	void WriteReprojectionState(const float *sampleCountsIn, const float *expectedDepthsIn, const size_t count);
+	// Drops the history of all the pixels of the unit (blocking)
+	void ClearReprojectionState();
+
+	// First hit features of the denoiser
+	void ReadFeatures(Feature *featuresOut, const size_t count);
+
 	void Finish();
 
 	const std::string& GetDeviceName() const;
+	PlatformContext *GetPlatformContext() const;
 	double GetPerformance() const;
 	unsigned int GetWorkOffset() const;
 	size_t GetWorkAmount() const;
 
+	// Live statistics, readable from any thread
+	DeviceMetrics& GetMetrics();
+
+	// Failover. A unit fails on an OpenCL error of its thread, or when the
+	// main thread gives up waiting for its pass. It then leaves both
+	// barriers for good and its thread stops at the end of the pass.
+	void BeginPass();
+	bool GiveUp(const std::string& reason);		// false if the pass was done
+	bool IsFailed();
+	std::string GetFailure();
+	// The thread has returned: the unit can be deleted without blocking
+	bool IsThreadDone();
+	// Target of a readback queued by a failed unit: it may still be written
+	// at any time and must never be reused nor freed
+	unsigned int *GetPendingPixelTarget();
+
+	// The thread returns at the next start barrier instead of rendering
+	void Stop();
+
 private:
 
 	// Thread binding function
 	static void RenderThread(ComputingUnit *computingItem);
 
+	// Called by the render thread: false if the unit was given up
+	bool EndPass();
+	void Fail(const std::string& reason);
+	bool IsStopping();
+
 	std::string ReadSources(const std::string& fileName);
+	SceneStorage ChooseSceneStorage(const cl::Device& dev) const;
+	bool CanStageSpheres(const cl::Device& dev) const;
+	// After the build: the staged spheres fit next to the local memory of the kernel
+	bool CanLaunchStaged(const cl::Device& dev, const unsigned int forceGPUWorkSize) const;
+	void BuildKernels(const cl::Device& dev, const std::string& src);
+	std::string GetBuildOptions() const;
 	void SetKernelArgs();
 
+	size_t GetAccumulationSize() const;	/* bytes per pixel */
+	size_t GetLaunchSize() const;
 	void ExecuteKernel();
+	void ExecuteDenoise();
 	void FinishExecuteKernel();
 
 	void ReadPixelBuffer();
@@ -59,35 +138,83 @@ private:
 
 	std::string deviceName;
 
+	RenderOptions renderOptions;
+	SceneStorage sceneStorage;	// never SCENE_STORAGE_AUTO once chosen
+	bool localStaging;
+
+	PlatformContext *platformContext;
+
+	// Host CPUs of the NUMA node the unit is bound to (empty if not bound)
+	std::vector<unsigned int> numaCpus;
+
 	cl::Context context;
 	cl::CommandQueue queue;
 	cl::Kernel kernel;
+	cl::Kernel denoiseKernel;
 	size_t workGroupSize;
 
+	// Persistent threads mode only: work-groups launched per pass, and the
+	// counter they take their pixels from
+	size_t persistentGroupCount{ 0 };
+	cl::Buffer workCounterBuffer;
+
 	// Thread and barrier for CL kernel
 	std::thread *renderThread;
 	Barrier *threadStartBarrier;
 	Barrier *threadEndBarrier;
 	
 
-	unsigned int workOffset;
-	unsigned int workAmount;
+	unsigned int workOffset{ 0 };
+	unsigned int workAmount{ 0 };	// 0 until the first SetWorkLoad()
+
+	bool readbackOnly{ false };
+
+	// Pixels covered by the readback target
+	unsigned int pixelTargetOffset{ 0 };
+	unsigned int pixelTargetCount{ 0 };
 
 	// Kernel args
 	unsigned int sphereCount;
 	unsigned int width;
 	unsigned int height;
+	unsigned int frameWidth{ 0 };	// 0: same as width / height
+	unsigned int frameHeight{ 0 };
+	unsigned int cropX{ 0 };
+	unsigned int cropY{ 0 };
 	unsigned int currentSample;
+	unsigned int samplesPerLaunch{ 1 };
+	unsigned int previewScale{ 1 };	// 1 = full resolution
 
 	// Buffers
 	cl::Buffer colorBuffer;
 	cl::Buffer pixelBuffer;
 	cl::Buffer seedBuffer;
-	cl::Buffer sphereBuffer;
-	cl::Buffer cameraBuffer;
+	cl::Image2D sphereImage;	// shared by the platform, image storage only
+	cl::Buffer instanceBuffer;	// shared by the platform
+	cl::Buffer instanceNodeBuffer;	// shared by the platform
+	cl::Buffer prototypeSphereBuffer;	// shared by the platform
+	unsigned int instanceCount;
+	cl::Buffer meshBuffer;		// shared by the platform
+	cl::Buffer meshVertexBuffer;	// shared by the platform
+	cl::Buffer meshIndexBuffer;	// shared by the platform
+	cl::Buffer meshNodeBuffer;	// shared by the platform
+	cl::Buffer blueNoiseBuffer;	// shared by the platform
+	unsigned int meshCount;
+
+	// Reprojection mode only
+	cl::Buffer firstHitBuffer;
+	cl::Buffer sampleCountBuffer;
+	cl::Buffer expectedDepthBuffer;
+
+	// Denoise mode only. The filter runs on the device unless the host
+	// does it (tiled mode).
+	bool deviceDenoise;
+	cl::Buffer featureBuffer;
+	cl::Buffer denoiseBuffers[2];
 
 	// raw 
 	Vec *colors {nullptr};
+	uint64_t *compactColors {nullptr};	// compact accumulation only
 	unsigned int *pixels {nullptr};
 	unsigned int *seeds {nullptr};
 
@@ -96,6 +223,18 @@ private:
 	double exeUnitCount;
 	double exeTime;
 
+	DeviceMetrics metrics;
+
+	std::mutex stateMutex;
+	bool failed{ false };
+	bool passDone{ false };
+	bool stopping{ false };
+	bool threadDone{ false };
+	std::string failure;
+	unsigned int *pendingPixels{ nullptr };	// target of a readback not known to be complete
+
+	static const unsigned int kPersistentGroupsPerComputeUnit;
+
 };
 
 
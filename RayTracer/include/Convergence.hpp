@@ -0,0 +1,53 @@
+#ifndef _CONVERGENCE_HPP_
+#define _CONVERGENCE_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+
+// Error of a rendered image against a reference of the same size, over the
+// three channels of every pixel
+struct ImageError {
+	double rmse;	/* root mean squared error */
+	double relMSE;	/* mean of (c - r)^2 / (r^2 + kRelMSEEpsilon) */
+};
+
+ImageError ComputeImageError(const Vec *colors, const Vec *reference, const size_t pixelCount);
+
+// Error recorded once the rendering time reaches a checkpoint
+struct ConvergenceCheckpoint {
+	float seconds;
+	unsigned int samples;	/* samples per pixel */
+	ImageError error;
+};
+
+// Rendering time needed to get below an error threshold, if it was reached
+struct ConvergenceThreshold {
+	float relMSE;
+	bool reached;
+	float seconds;
+	unsigned int samples;
+};
+
+struct ConvergenceReport {
+	std::string scene;
+	std::string reference;
+	std::string sampler;
+	std::string accumulation;
+	unsigned int width;
+	unsigned int height;
+	std::vector<std::string> devices;
+
+	std::vector<ConvergenceCheckpoint> checkpoints;
+	std::vector<ConvergenceThreshold> thresholds;
+
+	float seconds;			/* total rendering time, without the error measurements */
+	unsigned int samples;
+	ImageError error;		/* at the end */
+};
+
+// Writes the report as a JSON object
+bool WriteConvergenceReport(const std::string& fileName, const ConvergenceReport& report);
+
+#endif
@@ -0,0 +1,29 @@
+#ifndef _DENOISE_HPP_
+#define _DENOISE_HPP_
+
+#include <vector>
+
+#include "Vec.hpp"
+
+/* Surface seen by the primary rays of a pixel, averaged over its samples
+ * (same layout as the kernel). depth is 0 if the rays missed, < 0 before
+ * the first sample. */
+struct Feature {
+	Vec albedo;
+	Vec normal;	/* facing the camera */
+	float depth;
+};
+
+// Edge-avoiding a-trous filter of the accumulated colors, guided by the
+// features, with the same weights as DenoiseGPU() in the kernel. The color
+// sigma is halved at each iteration. The rows are split between threadCount
+// host threads.
+void DenoiseATrous(const unsigned int width, const unsigned int height,
+	const unsigned int iterations, const float colorSigma,
+	const std::vector<Vec>& colors, const std::vector<Feature>& features,
+	const unsigned int threadCount, std::vector<Vec> *result);
+
+// Gamma corrected 8 bit RGB pixel, same conversion as the kernel
+unsigned int ColorToPixel(const Vec& color);
+
+#endif
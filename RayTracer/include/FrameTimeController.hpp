@@ -0,0 +1,37 @@
+#ifndef _FRAMETIMECONTROLLER_HPP_
+#define _FRAMETIMECONTROLLER_HPP_
+
+// Feedback control of the interactive frame time. The time per sample is
+// measured over the last frames, and the samples per pass and the passes
+// per displayed frame are chosen so that a frame takes about the target
+// time: cheap scenes run several large passes per frame, costly ones a
+// single pass of one sample.
+class FrameTimeController {
+
+public:
+	FrameTimeController(const float target = 1.f / 30.f, const unsigned int maxPassSamples = 16);
+
+	// The measurements do not hold anymore (image size, devices)
+	void Reset();
+
+	// Records a frame of the given duration and sample count per pixel, and
+	// chooses the settings of the next frame
+	void Update(const float frameTime, const unsigned int samples);
+
+	unsigned int GetSamplesPerLaunch() const;
+	unsigned int GetPassesPerFrame() const;
+	float GetSecondsPerSample() const;	/* 0 before the first frame */
+
+private:
+	float targetTime;
+	unsigned int maxSamplesPerLaunch;
+
+	float secondsPerSample{ 0.f };
+	unsigned int samplesPerLaunch{ 1 };
+	unsigned int passesPerFrame{ 1 };
+
+	static const float kSmoothing;
+	static const float kHysteresis;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef _IMAGEIO_HPP_
+#define _IMAGEIO_HPP_
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+
+// Images are stored bottom-up as in the frame buffer (first row is the
+// bottom one). Pixels are packed as R | G << 8 | B << 16.
+
+bool WriteImagePPM(const std::string& fileName, const unsigned int *pixels,
+	const unsigned int width, const unsigned int height);
+bool WriteImagePNG(const std::string& fileName, const unsigned int *pixels,
+	const unsigned int width, const unsigned int height);
+bool WriteImagePFM(const std::string& fileName, const Vec *colors,
+	const unsigned int width, const unsigned int height);
+
+// Reads an RGB .pfm file (either byte order) into colors, bottom-up as written
+bool ReadImagePFM(const std::string& fileName, std::vector<Vec> *colors,
+	unsigned int *width, unsigned int *height);
+
+// Replaces the first run of '#' in pattern with the zero padded index
+// (frame_####.png -> frame_0042.png). Without '#' the index is appended
+// before the extension.
+std::string MakeSequenceFileName(const std::string& pattern, const unsigned int index);
+
+// True if the file extension requires the floating point accumulation (.pfm)
+bool IsFloatImageFile(const std::string& fileName);
+
+// Picks the encoder from the file extension (.png, .ppm or .pfm)
+bool WriteImage(const std::string& fileName, const unsigned int *pixels, const Vec *colors,
+	const unsigned int width, const unsigned int height);
+
+// Image file written band by band, for images too large to be kept in
+// memory. PPM files are filled from the top band down and PFM files from
+// the bottom band up (see IsTopDown()), as both formats store their rows.
+class ScanlineImageFile {
+
+public:
+	ScanlineImageFile();
+	~ScanlineImageFile();
+
+	// .ppm or .pfm
+	bool Open(const std::string& fileName, const unsigned int w, const unsigned int h);
+	bool Close();
+
+	bool IsTopDown() const;
+	bool IsFloat() const;
+
+	// Appends the next band. It is stored bottom-up like the frame buffer,
+	// colors is only used by PFM files.
+	bool WriteBand(const unsigned int *pixels, const Vec *colors, const unsigned int rows);
+
+private:
+	FILE *file{ nullptr };
+	bool isFloat{ false };
+	unsigned int width{ 0 };
+	unsigned int height{ 0 };
+	unsigned int rowsWritten{ 0 };
+};
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef _IMAGEWRITER_HPP_
+#define _IMAGEWRITER_HPP_
+
+#include <string>
+#include <vector>
+#include <deque>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+
+#include "Vec.hpp"
+
+struct ImageFrame {
+	std::string fileName;
+	unsigned int width{ 0 };
+	unsigned int height{ 0 };
+
+	std::vector<unsigned int> pixels;	/* tone mapped frame */
+	std::vector<Vec> colors;			/* accumulation, only filled for float formats */
+};
+
+
+// Encodes frames on a background thread. Frames are recycled through a
+// pool, so the render loop can read back directly into them instead of
+// copying the displayed frame buffer.
+class ImageWriter {
+
+public:
+	explicit ImageWriter(const size_t maxQueuedFrames);
+	~ImageWriter();
+
+	// Returns a frame sized for width x height, or nullptr (and counts a
+	// dropped frame) if the writer is too far behind
+	ImageFrame *Acquire(const unsigned int width, const unsigned int height);
+
+	// Queues an acquired frame for encoding
+	void Submit(ImageFrame *frame);
+	// Gives an acquired frame back without encoding it
+	void Release(ImageFrame *frame);
+	// Drops an acquired frame for good, without freeing it: a failed device
+	// may still read back into its pixels
+	void Retire(ImageFrame *frame);
+
+	unsigned int GetDroppedFrames() const;
+	unsigned int GetWrittenFrames() const;
+
+private:
+	static void WriterThread(ImageWriter *writer);
+
+	const size_t queueCapacity;
+
+	std::thread *writerThread{ nullptr };
+	std::mutex mtx;
+	std::condition_variable cond;
+
+	std::deque<ImageFrame *> queue;
+	std::vector<ImageFrame *> freeFrames;
+	std::vector<ImageFrame *> retiredFrames;	/* never deleted */
+	size_t framesInUse{ 0 };	/* acquired, queued or being encoded */
+	bool stop{ false };
+
+	std::atomic<unsigned int> droppedFrames{ 0 };
+	std::atomic<unsigned int> writtenFrames{ 0 };
+};
+
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef _INSTANCE_HPP_
+#define _INSTANCE_HPP_
+
+#include "Vec.hpp"
+
+/* Copy of a prototype sphere group, world = local * scale + translate (same layout as the kernel) */
+struct Instance {
+	Vec translate;
+	float scale;
+	Vec boundCenter;	/* world space bounding sphere of the copy */
+	float boundRadius;
+	unsigned int firstSphere;	/* spheres of the prototype in the prototype sphere buffer */
+	unsigned int sphereCount;
+};
+
+#endif
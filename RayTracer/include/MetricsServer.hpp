@@ -0,0 +1,57 @@
+#ifndef _METRICSSERVER_HPP_
+#define _METRICSSERVER_HPP_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <thread>
+#include <atomic>
+
+// Statistics of a computing unit. Written by its render thread (and by
+// the main thread for the workload), read by the metrics server: plain
+// atomics, so a scrape never blocks the rendering.
+struct DeviceMetrics {
+	std::atomic<uint64_t> samples{ 0 };					/* pixel samples rendered */
+	std::atomic<uint64_t> passes{ 0 };
+	std::atomic<uint64_t> kernelNanoseconds{ 0 };
+	std::atomic<uint64_t> queueWaitNanoseconds{ 0 };	/* from enqueued to started */
+	std::atomic<uint64_t> bytesRead{ 0 };				/* device to host */
+	std::atomic<uint64_t> bytesWritten{ 0 };			/* host to device */
+
+	std::atomic<uint64_t> memoryBytes{ 0 };				/* buffers of the unit */
+	std::atomic<uint64_t> workAmount{ 0 };				/* pixels */
+	std::atomic<uint64_t> samplesPerPixel{ 0 };
+	std::atomic<double> samplesPerSecond{ 0.0 };		/* of the last pass */
+	std::atomic<double> performanceShare{ 0.0 };		/* of the performance index split */
+};
+
+// Serves the metrics of the devices in the Prometheus text format, over
+// HTTP on 127.0.0.1:<port> or on a Unix socket, from its own thread
+class MetricsServer {
+
+public:
+	// address: a port number, or the path of the Unix socket
+	MetricsServer(const std::string& address, const std::vector<std::string>& deviceNames,
+		const std::vector<const DeviceMetrics *>& devices);
+	~MetricsServer();
+
+	bool IsRunning() const;
+
+	std::string FormatMetrics() const;
+
+private:
+	static void ServerThread(MetricsServer *server);
+	void Serve(const int connection) const;
+
+	std::string address;
+	std::vector<std::string> deviceLabels;	/* escaped */
+	std::vector<const DeviceMetrics *> deviceMetrics;
+
+	int listenSocket{ -1 };
+	std::thread *serverThread{ nullptr };
+	std::atomic<bool> stop{ false };
+};
+
+
+#endif
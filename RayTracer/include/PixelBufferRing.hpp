@@ -0,0 +1,54 @@
+#ifndef _PIXELBUFFERRING_HPP_
+#define _PIXELBUFFERRING_HPP_
+
+#include <vector>
+
+// Ring of persistently mapped pixel buffer objects feeding a texture. The
+// devices read back straight into the mapped buffer of the current slot,
+// the upload to the texture is then done by the GL driver asynchronously.
+// Requires GL_ARB_buffer_storage (available on Mesa llvmpipe).
+class PixelBufferRing {
+
+public:
+	PixelBufferRing(const unsigned int w, const unsigned int h, const unsigned int slotCount = 3);
+	~PixelBufferRing();
+
+	// Must be called with a current GL context
+	static bool IsSupported();
+
+	unsigned int GetWidth() const;
+	unsigned int GetHeight() const;
+
+	// Mapped memory of the next slot, after the GPU is done reading it
+	unsigned int *BeginFrame();
+
+	// Updates the texture with the frame. If the frame is not the mapped
+	// memory returned by BeginFrame(), it is uploaded from client memory,
+	// unless it is the mapped memory of an earlier slot (already uploaded).
+	void EndFrame(const unsigned int *framePixels);
+
+	// Replaces the buffer of the current slot by a new one. The old buffer
+	// stays mapped for good: a failed device may still read back into it.
+	void RetireSlot();
+
+	// Draws the texture over the whole viewport (orthographic projection
+	// from (0, 0) to (width - 1, height - 1))
+	void Draw() const;
+
+private:
+	void MapSlot(const size_t slot);
+
+	unsigned int width;
+	unsigned int height;
+
+	unsigned int texture{ 0 };
+	std::vector<unsigned int> buffers;
+	std::vector<unsigned int *> mappedPixels;
+	std::vector<void *> fences;
+	std::vector<unsigned int> retiredBuffers;	/* never unmapped nor deleted */
+
+	size_t currentSlot{ 0 };
+};
+
+
+#endif
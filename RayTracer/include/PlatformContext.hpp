@@ -0,0 +1,110 @@
+#ifndef _PLATFORMCONTEXT_HPP_
+#define _PLATFORMCONTEXT_HPP_
+
+#include <string>
+#include <vector>
+
+#define __CL_ENABLE_EXCEPTIONS
+
+#include <CL/cl.hpp>
+
+#include "Sphere.hpp"
+#include "Camera.hpp"
+#include "Instance.hpp"
+#include "TriangleMesh.hpp"
+
+// OpenCL context shared by all the selected devices of a platform, together
+// with the read-only buffers (scene and camera) the devices can share
+class PlatformContext {
+
+public:
+	PlatformContext(const cl::Platform& platform, const std::vector<cl::Device>& devices,
+		Camera *camera, Sphere *spheres, const unsigned int sceneSphereCount,
+		const std::vector<Sphere>& prototypeSpheres, const std::vector<Instance>& instances,
+		const std::vector<MeshBVHNode>& instanceNodes, const std::vector<Mesh>& meshes, const std::vector<MappedMesh *>& meshFiles);
+
+	const std::string& GetPlatformName() const;
+	const cl::Context& GetContext() const;
+	const std::vector<cl::Device>& GetDevices() const;
+
+	const cl::Buffer& GetCameraBuffer() const;
+	const cl::Buffer& GetSceneBuffer() const;
+
+	// The top level spheres as RGBA float texels (3 per sphere, up to
+	// kSphereImageRowSpheres spheres per row), created on first use
+	const cl::Image2D& GetSphereImage();
+	unsigned int GetSphereImageWidth() const;
+	unsigned int GetSphereImageHeight() const;
+
+	// kBlueNoiseSize x kBlueNoiseSize tileable blue noise mask of the
+	// blue noise sampler, created on first use
+	const cl::Buffer& GetBlueNoiseBuffer();
+
+	// Bytes of all the buffers the kernel can read from constant memory
+	// (camera, spheres, instances, prototype spheres and mesh table)
+	size_t GetConstantSceneSize() const;
+
+	// Instanced geometry, never updated. The buffers hold one dummy element
+	// when the scene has no instance.
+	const cl::Buffer& GetInstanceBuffer() const;
+	const cl::Buffer& GetInstanceNodeBuffer() const;	/* BVH over the instances */
+	const cl::Buffer& GetPrototypeSphereBuffer() const;
+	unsigned int GetInstanceCount() const;
+
+	// Triangle meshes, same convention
+	const cl::Buffer& GetMeshBuffer() const;
+	const cl::Buffer& GetMeshVertexBuffer() const;
+	const cl::Buffer& GetMeshIndexBuffer() const;
+	const cl::Buffer& GetMeshNodeBuffer() const;
+	unsigned int GetMeshCount() const;
+
+	// Blocking uploads, visible to all the devices of the context once they return
+	void UpdateCameraBuffer(Camera *camera);
+	void UpdateSceneBuffer(Sphere *spheres);
+
+	// Animation: uploads the camera and spheres of the next frame to spare
+	// buffers without waiting, while the devices render the current frame.
+	// Both must stay valid until SwapFrameBuffers(), which makes them the
+	// current buffers once the devices are done with the current frame.
+	void StageFrame(const Camera *camera, const Sphere *spheres);
+	void SwapFrameBuffers();
+
+	static const unsigned int kSphereImageRowSpheres;
+	static const unsigned int kBlueNoiseSize;
+
+private:
+	void WriteSphereImage(const Sphere *spheres);
+
+	std::string platformName;
+
+	cl::Context context;
+	std::vector<cl::Device> contextDevices;
+	cl::CommandQueue uploadQueue;
+
+	unsigned int sphereCount;
+	size_t constantSceneSize;
+
+	cl::Buffer sphereBuffer;
+	cl::Buffer cameraBuffer;
+	const Sphere *sceneSpheres;
+	cl::Image2D sphereImage;
+	cl::Buffer blueNoiseBuffer;
+
+	cl::Buffer stagedSphereBuffer;
+	cl::Buffer stagedCameraBuffer;
+	const Sphere *stagedSpheres{ nullptr };
+
+	unsigned int instanceCount;
+	cl::Buffer instanceBuffer;
+	cl::Buffer instanceNodeBuffer;
+	cl::Buffer prototypeSphereBuffer;
+
+	unsigned int meshCount;
+	cl::Buffer meshBuffer;
+	cl::Buffer meshVertexBuffer;
+	cl::Buffer meshIndexBuffer;
+	cl::Buffer meshNodeBuffer;
+};
+
+
+#endif
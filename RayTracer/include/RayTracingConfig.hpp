@@ -14,8 +14,17 @@
 
 #include <chrono>
 #include <thread>
+#include <functional>
 
 #include "ComputingUnit.hpp"
+#include "Checkpoint.hpp"
+#include "ImageWriter.hpp"
+#include "MetricsServer.hpp"
+#include "RenderOptions.hpp"
+#include "Instance.hpp"
+#include "SceneData.hpp"
+#include "TriangleMesh.hpp"
+#include "FrameTimeController.hpp"
 
 #include "Barrier.hpp"
 
@@ -24,7 +33,12 @@ class RayTracingConfig {
 public:
 	RayTracingConfig(const std::string& sceneFileName, const unsigned int w,
 		const unsigned int h, const bool useCPUs, const bool useGPUs,
-		const unsigned int forceGPUWorkSize);
+		const unsigned int forceGPUWorkSize,
+		const RenderOptions& renderOptions = RenderOptions());
+	RayTracingConfig(const SceneData& scene, const unsigned int w,
+		const unsigned int h, const bool useCPUs, const bool useGPUs,
+		const unsigned int forceGPUWorkSize,
+		const RenderOptions& renderOptions = RenderOptions());
 
 	~RayTracingConfig();
 
@@ -34,6 +48,44 @@ public:
 
 	void Execute();
 
+	// Headless rendering of options.tiledOutput, one band of rows at a time:
+	// only the band being rendered is kept in host and device memory.
+	bool RenderTiled();
+
+	// Headless rendering of the camera path of options.animationFile. The
+	// devices, programs and buffers are kept from one frame to the next, and
+	// the next frame is uploaded while the current one is rendered.
+	bool RenderAnimation();
+
+	// Headless progressive rendering measuring the error against
+	// options.convergenceReference, written to options.convergenceReport.
+	// The error measurements are not counted in the rendering time.
+	bool RenderConvergence();
+
+	// Progressive rendering of up to maxSamples more samples per pixel, for
+	// up to maxSeconds (0 for no limit), continuing the accumulation.
+	// progress is called after each pass with the samples per pixel and the
+	// seconds so far, and stops the rendering by returning false. The image
+	// is read back straight into target and the accumulated colors into
+	// colors, each can be nullptr (only the crop window is written while
+	// cropping). Returns the samples per pixel accumulated. Throws
+	// std::invalid_argument without any limit nor progress.
+	unsigned int RenderProgressive(const unsigned int maxSamples, const float maxSeconds,
+		unsigned int *target, Vec *colors, const std::function<bool(unsigned int, float)>& progress);
+
+	// Only the w x h pixels at (x, y) from the top left corner of the image
+	// are rendered from now on, with the projection of the whole frame. The
+	// other pixels keep the last frame. An empty window renders the whole
+	// frame again. Restarts the accumulation.
+	void SetCropWindow(const unsigned int x, const unsigned int y,
+		const unsigned int w, const unsigned int h);
+	bool IsCropping() const;
+	void GetCropWindow(unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h) const;
+
+	// Called on camera input: switches to the reduced resolution preview
+	void BeginInteraction();
+	unsigned int GetPreviewScale() const;
+
 
 	const bool IsProfiling() const;
 	const std::vector<ComputingUnit *>& GetComputingItem() const;
@@ -44,34 +96,132 @@ public:
 
 	void RestartWorkloadProcedure();
 
+	unsigned int GetDroppedFrames() const;
+
+	// Readback target of the next pass instead of the internal buffer, for
+	// instance mapped GL memory. Reset by ReInit(true).
+	void SetExternalRenderTarget(unsigned int *target);
+	// True if a failed device may still read back into the target: its
+	// owner must not reuse it nor free it
+	bool IsPixelTargetRetired(const unsigned int *target) const;
+
+	const RenderOptions& GetOptions() const;
+
 	unsigned int selectedDevice;
 	char captionBuffer[512];
 
 	unsigned int width{ kDefaultWidth };
 	unsigned int height{ kDefaultHeight };
-	unsigned int currentSample{ 0 };
-	unsigned int *pixels{ nullptr };
+	unsigned int currentSample{ 0 };	/* samples per pixel accumulated */
+	unsigned int *pixels{ nullptr };	/* last complete frame, for display */
 
 	Camera *camera{ nullptr };
 	Sphere *spheres{ nullptr };
 	unsigned int sphereCount;
+
+	// Instanced sphere groups, the prototype spheres are in prototype space
+	std::vector<Sphere> prototypeSpheres;
+	std::vector<Instance> instances;	/* in the leaf order of instanceNodes */
+	std::vector<MeshBVHNode> instanceNodes;	/* BVH over the instance bounds */
+
+	// Triangle meshes, mapped from their converted files
+	std::vector<Mesh> meshes;
+	std::vector<MappedMesh *> meshFiles;
+	uint64_t meshGeometryHash{ 0 };	/* vertices, indices and BVH of all the mesh files */
 	int currentSphere;
 
 private:
+	// Shared by the constructors, and the clean up of the destructor
+	void Init(const SceneData& scene, const bool useCPUs, const bool useGPUs,
+		const unsigned int forceGPUWorkSize);
+	void Release();
+
 	void SetUpOpenCL(const bool useCPUs, const bool useGPUs,
 		const unsigned int forceGPUWorkSize);
 
-	void ReadSceneFile(const std::string& fileName);
+	// Copies the scene and maps its meshes, false (with the error on stderr) if it is invalid
+	bool LoadScene(const SceneData& scene);
+
+	bool IsHeadless() const;
+
+	// Clips and sets the crop window, false if the whole frame is rendered
+	bool ApplyCropWindow(unsigned int x, unsigned int y, unsigned int w, unsigned int h);
+	// Copies the pixels read back from the crop window into a frame buffer
+	void ComposeCropWindow(unsigned int *frame) const;
+	// Accumulated colors at their place in a whole frame buffer (only the
+	// crop window is written while cropping)
+	void GatherFrameColors(Vec *colors);
+
+	// Include / exclude filters on the platform name and vendor
+	bool IsPlatformSelected(const cl::Platform& platform) const;
+
+	// One sub-device per NUMA node, or an empty list if the device can not be
+	// split. nodes gets the NUMA node of each sub-device.
+	std::vector<cl::Device> SplitByNumaNode(cl::Device& device, std::vector<int> *nodes);
 
 	void CheckDeviceWorkload();
 	void UpdateDeviceWorkload(bool calculateNewLoad);
 
-	void UpdateCamera();
+	// Splits the pixels [rangeOffset, rangeOffset + rangeAmount) according to the performance indices
+	void AssignWorkload(const unsigned int rangeOffset, const unsigned int rangeAmount);
 
-	void ExecuteKernels();
+	// Runs the render threads for one pass, the main thread can work in
+	// between. FinishPass() gives up the devices not done within the pass
+	// timeout and returns false if any device failed (see RemoveFailedUnits()).
+	void StartPass();
+	bool FinishPass();
 
+	// Moves the pixel range of the failed devices to the others, restarting
+	// the accumulation (currentSample = 0). Throws when no device is left.
+	bool RemoveFailedUnits();
+	// The readback target of a failed device is never reused: renderPixels
+	// and cropPixels are replaced here, the other targets by their owners
+	void RetirePixelTarget(unsigned int *target);
+
+	// Computes the camera vectors from orig and target
+	void SetUpCamera(Camera *cam) const;
+	void UpdateCamera();
+
+	// One pass of all the devices. Without readBack the pixels are left on
+	// the devices, unless a frame dump is due. Returns false if a device
+	// failed: the accumulation then restarts on the other devices.
+	bool ExecuteKernels(const bool readBack = true);
+
+	// Reads back the pixels of the last pass, without rendering
+	void ReadBackFrame();
+
+	void ExecutePreview();
+	void UpdatePreviewSettings(const float passTime);
+
+	// Accumulation state of the rendered pixels (the crop window or the
+	// whole frame), gathered from / scattered to all the devices.
+	// seeds can be nullptr when gathering only the colors. The colors are
+	// averages over currentSample samples (see ComputingUnit::ReadAccumulation).
+	void GatherAccumulation(Vec *accumulation, unsigned int *seeds);
+	void ScatterAccumulation(const Vec *accumulation, const unsigned int *seeds);
+
+	// Per pixel sample counts and first hits of the reprojection mode
+	void GatherReprojectionState(float *sampleCounts, FirstHit *firstHits);
+	void ScatterReprojectionState(const float *sampleCounts, const float *expectedDepths);
+	void ReprojectHistory();
+	// currentSample = 0, and the per pixel sample counts of the reprojection
+	// mode as well: the kernel divides by them rather than currentSample
+	void RestartAccumulation();
+
+	CheckpointKey GetCheckpointKey() const;
+	void ResumeFromCheckpoint();
+	void CheckCheckpoint();
+
+	std::vector<PlatformContext *> platformContexts;
 	std::vector<ComputingUnit *> computingUnits;
 	std::vector<double> computingUnitsPerfIndex;
+	std::vector<ComputingUnit *> failedUnits;	// deleted by Release() once their thread is done
+	std::vector<const unsigned int *> retiredPixelTargets;	// never freed: written by failedUnits
+	std::vector<std::vector<unsigned int> *> retiredBands;	// never deleted: written by failedUnits
+
+	// Pixel range of the last AssignWorkload()
+	unsigned int workRangeOffset{ 0 };
+	unsigned int workRangeAmount{ 0 };
 	Barrier *threadStartBarrier{ nullptr };
 	Barrier *threadEndBarrier{ nullptr };
 
@@ -79,9 +229,39 @@ private:
 	std::chrono::system_clock::time_point timeFirstWorkloadUpdate;
 	bool workLoadProfilingFlag;
 
-	static const std::string kDefaultKernelPath;
+	RenderOptions options;
+	std::string sceneFile;
+	CheckpointWriter *checkpointWriter{ nullptr };
+	std::chrono::system_clock::time_point timeLastCheckpoint;
+
+	// Readback target of the passes. pixels points to a writer frame
+	// instead after a frame dump, until the next pass completes.
+	unsigned int *renderPixels{ nullptr };
+	unsigned int *externalRenderPixels{ nullptr };
+
+	// Crop window, from the top left corner of the image. The devices only
+	// know its renderWidth x renderHeight pixels, read back into cropPixels.
+	unsigned int cropX{ 0 };
+	unsigned int cropY{ 0 };
+	unsigned int renderWidth{ 0 };
+	unsigned int renderHeight{ 0 };
+	unsigned int *cropPixels{ nullptr };
+	ImageWriter *imageWriter{ nullptr };
+	MetricsServer *metricsServer{ nullptr };
+
+	// Samples per pixel and per pass, and preview state
+	unsigned int samplesPerLaunch{ 1 };
+	unsigned int previewScale{ 1 };
+	unsigned int lastPreviewScale{ 2 };
+	bool isInteracting{ false };
+	std::chrono::system_clock::time_point timeLastInteraction;
+	FrameTimeController frameTimeController;
+
 	static const unsigned int kDefaultWidth;
 	static const unsigned int kDefaultHeight;
+	static const unsigned int kMaxPreviewScale;
+	static const unsigned int kMaxSamplesPerLaunch;
+	static const unsigned int kMaxNumaNodes;	// node ids probed in the system topology
 
 };
 
@@ -0,0 +1,127 @@
+#ifndef _RENDEROPTIONS_HPP_
+#define _RENDEROPTIONS_HPP_
+
+#include <string>
+#include <vector>
+
+/* Memory the kernel reads the scene geometry from */
+enum SceneStorage {
+	SCENE_STORAGE_AUTO,		/* constant memory when the scene fits, global memory otherwise */
+	SCENE_STORAGE_CONSTANT,
+	SCENE_STORAGE_GLOBAL,
+	SCENE_STORAGE_IMAGE		/* top level spheres in an image, the rest in global memory */
+};
+
+/* Sample sequences of the camera, BSDF and light dimensions */
+enum SamplerType {
+	SAMPLER_RANDOM,		/* per-pixel random number generator */
+	SAMPLER_SOBOL,		/* Owen scrambled Sobol' points, scrambled per pixel */
+	SAMPLER_BLUE_NOISE	/* Owen scrambled Sobol' points shifted by a blue noise tile */
+};
+
+/* Storage of the accumulated radiance on the devices */
+enum AccumulationFormat {
+	ACCUMULATION_FLOAT,		/* 12 bytes per pixel, running average */
+	ACCUMULATION_COMPACT	/* 8 bytes per pixel, sum with 19 bit mantissas and a shared exponent */
+};
+
+struct RenderOptions {
+
+	/* Source of the rendering kernel, relative to the working directory */
+	std::string kernelPath{ "../RayTracer/kernel/rendering_kernel.cl" };
+
+	/* OpenCL platforms to use / skip, matched against the name or vendor (case insensitive) */
+	std::vector<std::string> platformInclude;	/* all platforms if empty */
+	std::vector<std::string> platformExclude;
+
+	/* Split CPU devices into one sub-device per NUMA node */
+	bool numaSplit{ false };
+
+	/* Scene storage of all the devices (each device falls back when it is not usable) */
+	SceneStorage sceneStorage{ SCENE_STORAGE_AUTO };
+
+	/* Copy the top level spheres to local memory once per work-group (devices
+	 * without enough local memory read them from the scene storage) */
+	bool localStaging{ false };
+
+	/* Launch only enough work-groups to fill each device, which take batches
+	 * of pixels from an atomic counter until the pass is done */
+	bool persistentThreads{ false };
+
+	SamplerType sampler{ SAMPLER_RANDOM };
+
+	AccumulationFormat accumulation{ ACCUMULATION_FLOAT };
+
+	/* Keep the samples across camera moves by reprojecting the accumulation */
+	bool reprojection{ false };
+	float reprojectionMaxHistory{ 64.f };	/* samples kept per pixel after a move */
+
+	/* Reduced resolution rendering while the camera is moving (0 disables it) */
+	float previewFrameTime{ 1.f / 30.f };	/* target seconds per preview pass */
+	float previewSettleTime{ 0.3f };		/* seconds without input before full resolution */
+
+	/* Checkpointing (disabled when the file name is empty) */
+	std::string checkpointFile;
+	float checkpointInterval{ 300.f };	/* seconds between two checkpoints */
+	bool resume{ false };				/* reload checkpointFile at start-up */
+
+	/* Periodic frame dumps (disabled when the file name is empty) */
+	std::string dumpFile;				/* .png, .ppm or .pfm, '#' is replaced by the pass */
+	unsigned int dumpInterval{ 100 };	/* passes between two dumps */
+	unsigned int dumpQueueSize{ 4 };	/* frames queued before dropping */
+
+	/* Edge-avoiding a-trous filter of the displayed / written image, guided by
+	 * the albedo, normal and depth of the first hits. Runs on the devices, or
+	 * on host threads over each band in tiled mode. */
+	bool denoise{ false };
+	unsigned int denoiseIterations{ 5 };	/* tap spacing doubles at each iteration */
+	float denoiseColorSigma{ 0.5f };		/* halved at each iteration */
+
+	/* Seconds a device has to finish a pass before it is given up and its
+	 * pixels are moved to the other devices (0, the default, waits forever:
+	 * a single long pass must not take down the only device) */
+	float passTimeout{ 0.f };
+
+	/* Target seconds per displayed frame of the interactive mode: the samples
+	 * per pass and the passes run between two readbacks follow it */
+	float frameTime{ 1.f / 30.f };
+
+	/* Prometheus metrics of the devices, served on 127.0.0.1:<port> when the
+	 * address is a number, on a Unix socket otherwise (disabled when empty) */
+	std::string metricsAddress;
+
+	/* Crop window of w x h pixels at (x, y) from the top left corner of the
+	 * image (the whole frame when empty). Only its pixels are rendered, with
+	 * the projection of the whole frame, so that they can be composited back.
+	 * Not used by the headless modes nor with the reprojection. */
+	unsigned int cropX{ 0 };
+	unsigned int cropY{ 0 };
+	unsigned int cropWidth{ 0 };
+	unsigned int cropHeight{ 0 };
+
+	/* Read back into persistently mapped GL pixel buffers when available */
+	bool pboDisplay{ true };
+
+	/* Headless rendering of a camera path (disabled when the file name is empty),
+	 * each frame to animationSamples samples per pixel */
+	std::string animationFile;
+	std::string animationOutput{ "frame_####.ppm" };	/* '#' is replaced by the frame */
+	unsigned int animationSamples{ 64 };
+
+	/* Headless measurement of the convergence against a reference image of
+	 * the same scene and size, e.g. rendered with --tiled at a high sample
+	 * count (disabled when the report file name is empty). The error is
+	 * recorded at the rendering times of convergenceTimes, with the time to
+	 * get below each relMSE of convergenceThresholds. */
+	std::string convergenceReport;		/* .json */
+	std::string convergenceReference;	/* .pfm */
+	std::vector<float> convergenceTimes{ 1.f, 2.f, 5.f, 10.f, 30.f };	/* seconds */
+	std::vector<float> convergenceThresholds{ 0.1f, 0.03f, 0.01f, 0.003f };
+
+	/* Headless rendering band by band into a .ppm / .pfm file (disabled when empty) */
+	std::string tiledOutput;
+	unsigned int tileRows{ 256 };		/* rows per band */
+	unsigned int tileSamples{ 256 };	/* samples per pixel of each band */
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef _RENDERER_HPP_
+#define _RENDERER_HPP_
+
+#include <functional>
+#include <vector>
+
+#include "Vec.hpp"
+#include "Sphere.hpp"
+#include "SceneData.hpp"
+#include "RenderOptions.hpp"
+
+class RayTracingConfig;
+
+/* Stop condition of Renderer::Render(), 0 for no limit */
+struct RenderBudget {
+	unsigned int samples{ 0 };	/* samples per pixel added by the call */
+	float seconds{ 0.f };
+};
+
+/* Devices and options of a Renderer. The headless modes of the options
+ * (tiled, animation and convergence) are not used. */
+struct RendererSettings {
+	bool useCPUs{ true };
+	bool useGPUs{ true };
+	unsigned int forceGPUWorkSize{ 0 };	/* 0 for the suggested size */
+	RenderOptions options;
+};
+
+// Called after each pass with the samples per pixel accumulated and the
+// seconds spent in Render(), returns false to stop the rendering
+typedef std::function<bool(unsigned int samples, float seconds)> RenderProgressCallback;
+
+// Entry point of the rendering library. Each renderer has its own devices,
+// render threads and buffers, so that several of them can run side by side
+// (each one used from a single thread at a time). Errors are thrown as
+// std::runtime_error or cl::Error, invalid arguments as std::invalid_argument.
+class Renderer {
+
+public:
+	Renderer(const SceneData& scene, const unsigned int w, const unsigned int h,
+		const RendererSettings& settings = RendererSettings());
+	~Renderer();
+
+	Renderer(const Renderer&) = delete;
+	Renderer& operator=(const Renderer&) = delete;
+
+	unsigned int GetWidth() const;
+	unsigned int GetHeight() const;
+	unsigned int GetSampleCount() const;	/* samples per pixel accumulated */
+
+	// The accumulation restarts (or is reprojected, with the reprojection option)
+	void SetCamera(const Vec& orig, const Vec& target);
+	// Same sphere count as the scene, the accumulation restarts
+	void SetSpheres(const std::vector<Sphere>& spheres);
+	void Reset();
+
+	// Continues the accumulation until the budget is spent (with no budget,
+	// until progress returns false, which is then required). The last pass is read back straight into
+	// pixels (width * height, 0x00BBGGRR, bottom row first) and the
+	// accumulated radiance into colors, each can be nullptr. With a crop
+	// window (see RenderOptions), only its pixels are written. Returns the
+	// samples per pixel accumulated. With a pass timeout, a device given up
+	// may still write pixels later on: keep them alive as long as the Renderer.
+	unsigned int Render(const RenderBudget& budget, unsigned int *pixels, Vec *colors = nullptr,
+		const RenderProgressCallback& progress = RenderProgressCallback());
+
+private:
+	RayTracingConfig *config{ nullptr };
+};
+
+#endif
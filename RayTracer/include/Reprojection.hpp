@@ -0,0 +1,28 @@
+#ifndef _REPROJECTION_HPP_
+#define _REPROJECTION_HPP_
+
+#include <vector>
+
+#include "Vec.hpp"
+#include "Camera.hpp"
+
+/* First hit of the primary ray, depth is 0 if it missed (same layout as the kernel) */
+struct FirstHit {
+	Vec p;
+	float depth;
+};
+
+// Moves the accumulated history of each pixel to the pixel its first hit
+// projects to with the new camera. The nearest hit wins when several land
+// on the same pixel. Pixels receiving no history get a zero count.
+// expectedDepths is the depth the kernel has to find at each pixel to keep
+// the history (0 = nothing to check).
+void ReprojectAccumulation(const Camera& newCamera,
+	const unsigned int width, const unsigned int height,
+	const float maxHistory,
+	const std::vector<Vec>& colors, const std::vector<float>& sampleCounts,
+	const std::vector<FirstHit>& firstHits,
+	std::vector<Vec> *newColors, std::vector<float> *newSampleCounts,
+	std::vector<float> *expectedDepths);
+
+#endif
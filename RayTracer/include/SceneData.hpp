@@ -0,0 +1,45 @@
+#ifndef _SCENEDATA_HPP_
+#define _SCENEDATA_HPP_
+
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+#include "Sphere.hpp"
+
+/* Group of spheres in prototype space, copied by the instances. Prototype
+ * spheres can not be light sources. */
+struct ScenePrototype {
+	std::vector<Sphere> spheres;
+};
+
+/* Copy of a prototype, world = local * scale + translate */
+struct SceneInstance {
+	unsigned int prototype;		/* index in SceneData::prototypes */
+	Vec translate;
+	float scale;
+};
+
+/* Triangle mesh of an OBJ file, converted and mapped on load (see LoadObjMesh()) */
+struct SceneMesh {
+	std::string objFileName;
+	Vec c;			/* color */
+	Refl refl;		/* reflection type */
+};
+
+/* Scene description, read from a .scn file or filled in by the caller */
+struct SceneData {
+	Vec cameraOrig;
+	Vec cameraTarget;
+
+	std::vector<Sphere> spheres;	/* top level spheres, the lights are among them */
+	std::vector<ScenePrototype> prototypes;
+	std::vector<SceneInstance> instances;
+	std::vector<SceneMesh> meshes;
+};
+
+// Parses a .scn file, the mesh file names are made relative to its
+// directory. Returns false (with the error on stderr) on failure.
+bool ReadSceneFile(const std::string& fileName, SceneData *scene);
+
+#endif
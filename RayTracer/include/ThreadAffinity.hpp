@@ -0,0 +1,17 @@
+#ifndef _THREADAFFINITY_HPP_
+#define _THREADAFFINITY_HPP_
+
+#include <vector>
+#include <functional>
+
+// Logical CPUs of a NUMA node, false if the topology is not available
+bool GetNumaNodeCpus(const unsigned int node, std::vector<unsigned int> *cpus);
+
+// Restricts the calling thread to the given logical CPUs
+bool PinCurrentThread(const std::vector<unsigned int>& cpus);
+
+// Runs func on a temporary thread pinned to cpus, so the memory it first
+// touches is allocated on their NUMA node. Runs on the caller when cpus is empty.
+void RunPinned(const std::vector<unsigned int>& cpus, const std::function<void()>& func);
+
+#endif
@@ -0,0 +1,91 @@
+#ifndef _TRIANGLEMESH_HPP_
+#define _TRIANGLEMESH_HPP_
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Vec.hpp"
+#include "Sphere.hpp"
+
+/* BVH node of a mesh (same layout as the kernel). Leaves have count > 0
+ * triangles starting at leftFirst, inner nodes have their two children at
+ * leftFirst and leftFirst + 1. */
+struct MeshBVHNode {
+	float bmin[3];
+	unsigned int leftFirst;
+	float bmax[3];
+	unsigned int count;
+};
+
+/* Bounds of a primitive given to BuildBVH() */
+struct BVHPrimitive {
+	float bmin[3];
+	float bmax[3];
+	float centroid[3];
+};
+
+// Binned SAH BVH over the primitives, the boxes grown by padding. order
+// gets the primitives in leaf order: a leaf covers order[leftFirst] to
+// order[leftFirst + count - 1]. At most 48 levels deep (the kernel
+// traversal stack holds 64 nodes).
+void BuildBVH(const std::vector<BVHPrimitive>& primitives, const float *padding,
+	std::vector<MeshBVHNode> *nodes, std::vector<uint32_t> *order);
+
+/* Mesh table entry (same layout as the kernel). Vertices are quantized on
+ * 16 bits: position = boundMin + q * quantScale. */
+struct Mesh {
+	Vec boundMin;
+	Vec quantScale;
+	Vec c;			/* color */
+	enum Refl refl;	/* reflection type */
+	unsigned int firstVertex;	/* offsets in the buffers shared by all the meshes */
+	unsigned int firstTriangle;
+	unsigned int firstNode;
+};
+
+// Read-only memory mapping of a converted mesh file: quantized vertices
+// (3 x uint16), 32-bit indices in BVH leaf order and the BVH nodes, ready
+// to be uploaded as is.
+class MappedMesh {
+
+public:
+	MappedMesh();
+	~MappedMesh();
+
+	bool Open(const std::string& fileName);
+	void Close();
+
+	unsigned int GetVertexCount() const;
+	unsigned int GetTriangleCount() const;
+	unsigned int GetNodeCount() const;
+	Vec GetBoundMin() const;
+	Vec GetQuantScale() const;
+
+	const uint16_t *GetVertices() const;	/* 3 * vertex count */
+	const uint32_t *GetIndices() const;		/* 3 * triangle count */
+	const MeshBVHNode *GetNodes() const;
+
+	// Device memory of the mesh
+	size_t GetDeviceSize() const;
+
+private:
+	const unsigned char *data{ nullptr };
+	size_t dataSize{ 0 };
+
+#ifdef _WIN32
+	void *fileHandle{ nullptr };
+	void *mappingHandle{ nullptr };
+#endif
+};
+
+// Converts the vertices and faces of an OBJ file (polygons are split in
+// fans, everything else is ignored) and builds the BVH
+bool ConvertObjToMesh(const std::string& objFileName, const std::string& meshFileName);
+
+// Maps the converted file of an OBJ file (<obj>.rtmesh), converting it
+// first if it is missing or older than the OBJ file
+bool LoadObjMesh(const std::string& objFileName, MappedMesh *mesh);
+
+#endif
@@ -1,28 +1,43 @@
-
 #ifndef _VEC_HPP_
 #define	_VEC_HPP_
 
+#include <cmath>
+#include <type_traits>
+
+// Same layout as the Vec of the kernel (3 floats, no padding): it is copied
+// as is into the OpenCL buffers, so it must stay trivially copyable. See
+// Vec4f.hpp for the 16-byte SIMD variant of the host math.
 class Vec {
 
 public:
-	Vec();
-	Vec(float a, float b, float c);
-	
-	Vec& operator=(const Vec & other);	//copy assignment
+	constexpr Vec() : x(0.f), y(0.f), z(0.f) {}
+	constexpr Vec(float a, float b, float c) : x(a), y(b), z(c) {}
+
+	constexpr Vec operator+(const Vec & v) const { return Vec(x + v.x, y + v.y, z + v.z); }
+	constexpr Vec operator-(const Vec & v) const { return Vec(x - v.x, y - v.y, z - v.z); }
+	constexpr Vec operator*(float val) const { return Vec(x * val, y * val, z * val); }
 
-	Vec operator+(const Vec & v) const;
-	Vec operator-(const Vec & v) const;
-	Vec operator*(float val) const;
+	Vec& operator+=(const Vec & v) { x += v.x; y += v.y; z += v.z; return *this; }
+	Vec& operator-=(const Vec & v) { x -= v.x; y -= v.y; z -= v.z; return *this; }
+	Vec& operator*=(float val) { x *= val; y *= val; z *= val; return *this; }
 
-	Vec mult(const Vec & v) const;
-	Vec& norm();
-	float dot (const Vec & v) const;
-	Vec cross(const Vec & v) const;
+	constexpr Vec mult(const Vec & v) const { return Vec(x * v.x, y * v.y, z * v.z); }
+	constexpr float dot(const Vec & v) const { return x * v.x + y * v.y + z * v.z; }
+	constexpr Vec cross(const Vec & v) const { return Vec(y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x); }
 
-	void clear();
+	// this + v * s, one multiply-add per component
+	constexpr Vec madd(const Vec & v, float s) const { return Vec(x + v.x * s, y + v.y * s, z + v.z * s); }
+
+	float length() const { return std::sqrt(dot(*this)); }
+	Vec& norm() { return *this *= 1.f / length(); }
+
+	void clear() { x = y = z = 0.f; }
 
 
 	float x, y, z; // for position, or color (r,g,b)
 };
 
-#endif
\ No newline at end of file
+static_assert(sizeof(Vec) == 3 * sizeof(float), "Vec must match the kernel layout");
+static_assert(std::is_trivially_copyable<Vec>::value, "Vec is copied with memcpy into the OpenCL buffers");
+
+#endif
@@ -0,0 +1,150 @@
+#ifndef _VEC4F_HPP_
+#define _VEC4F_HPP_
+
+#include <cmath>
+#include <type_traits>
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 1))
+#define VEC4F_SSE
+#include <xmmintrin.h>
+#if defined(__FMA__)
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define VEC4F_NEON
+#include <arm_neon.h>
+#endif
+
+#include "Vec.hpp"
+
+// 16-byte aligned x, y, z (w is kept at 0) for the host math working on
+// many vectors at once, on SSE or NEON when available. Loaded from / stored
+// to the 12 byte Vec shared with the kernel.
+struct alignas(16) Vec4f {
+
+#if defined(VEC4F_SSE)
+	__m128 v;
+
+	Vec4f() : v(_mm_setzero_ps()) {}
+	explicit Vec4f(const __m128 m) : v(m) {}
+	Vec4f(float a, float b, float c) : v(_mm_set_ps(0.f, c, b, a)) {}
+	explicit Vec4f(const Vec& a) : v(_mm_set_ps(0.f, a.z, a.y, a.x)) {}
+
+	float X() const { return _mm_cvtss_f32(v); }
+	float Y() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 1, 1, 1))); }
+	float Z() const { return _mm_cvtss_f32(_mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 2, 2, 2))); }
+
+	Vec4f operator+(const Vec4f& a) const { return Vec4f(_mm_add_ps(v, a.v)); }
+	Vec4f operator-(const Vec4f& a) const { return Vec4f(_mm_sub_ps(v, a.v)); }
+	Vec4f operator*(const float s) const { return Vec4f(_mm_mul_ps(v, _mm_set1_ps(s))); }
+	Vec4f mult(const Vec4f& a) const { return Vec4f(_mm_mul_ps(v, a.v)); }
+
+	// this + a * s
+	Vec4f madd(const Vec4f& a, const float s) const {
+#if defined(__FMA__)
+		return Vec4f(_mm_fmadd_ps(a.v, _mm_set1_ps(s), v));
+#else
+		return Vec4f(_mm_add_ps(v, _mm_mul_ps(a.v, _mm_set1_ps(s))));
+#endif
+	}
+
+	float dot(const Vec4f& a) const {
+		const __m128 m = _mm_mul_ps(v, a.v);
+		const __m128 s = _mm_add_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+		return _mm_cvtss_f32(_mm_add_ss(s, _mm_movehl_ps(s, s)));
+	}
+
+	Vec4f cross(const Vec4f& a) const {
+		// (y, z, x) * (a.z, a.x, a.y) - (z, x, y) * (a.y, a.z, a.x)
+		const __m128 l = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 2, 1)), _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 1, 0, 2)));
+		const __m128 r = _mm_mul_ps(_mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 0, 2)), _mm_shuffle_ps(a.v, a.v, _MM_SHUFFLE(3, 0, 2, 1)));
+		return Vec4f(_mm_sub_ps(l, r));
+	}
+
+	void Store(Vec *a) const {
+		alignas(16) float f[4];
+		_mm_store_ps(f, v);
+		*a = Vec(f[0], f[1], f[2]);
+	}
+
+#elif defined(VEC4F_NEON)
+	float32x4_t v;
+
+	Vec4f() : v(vdupq_n_f32(0.f)) {}
+	explicit Vec4f(const float32x4_t m) : v(m) {}
+	Vec4f(float a, float b, float c) { const float f[4] = { a, b, c, 0.f }; v = vld1q_f32(f); }
+	explicit Vec4f(const Vec& a) { const float f[4] = { a.x, a.y, a.z, 0.f }; v = vld1q_f32(f); }
+
+	float X() const { return vgetq_lane_f32(v, 0); }
+	float Y() const { return vgetq_lane_f32(v, 1); }
+	float Z() const { return vgetq_lane_f32(v, 2); }
+
+	Vec4f operator+(const Vec4f& a) const { return Vec4f(vaddq_f32(v, a.v)); }
+	Vec4f operator-(const Vec4f& a) const { return Vec4f(vsubq_f32(v, a.v)); }
+	Vec4f operator*(const float s) const { return Vec4f(vmulq_n_f32(v, s)); }
+	Vec4f mult(const Vec4f& a) const { return Vec4f(vmulq_f32(v, a.v)); }
+
+	// this + a * s
+	Vec4f madd(const Vec4f& a, const float s) const {
+#if defined(__aarch64__)
+		return Vec4f(vfmaq_n_f32(v, a.v, s));
+#else
+		return Vec4f(vmlaq_n_f32(v, a.v, s));
+#endif
+	}
+
+	float dot(const Vec4f& a) const {
+		const float32x4_t m = vmulq_f32(v, a.v);
+#if defined(__aarch64__)
+		return vaddvq_f32(m);
+#else
+		const float32x2_t s = vadd_f32(vget_low_f32(m), vget_high_f32(m));
+		return vget_lane_f32(vpadd_f32(s, s), 0);
+#endif
+	}
+
+	Vec4f cross(const Vec4f& a) const {
+		return Vec4f(Y() * a.Z() - Z() * a.Y(), Z() * a.X() - X() * a.Z(), X() * a.Y() - Y() * a.X());
+	}
+
+	void Store(Vec *a) const {
+		*a = Vec(X(), Y(), Z());
+	}
+
+#else
+	float v[4];
+
+	Vec4f() : v{ 0.f, 0.f, 0.f, 0.f } {}
+	Vec4f(float a, float b, float c) : v{ a, b, c, 0.f } {}
+	explicit Vec4f(const Vec& a) : v{ a.x, a.y, a.z, 0.f } {}
+
+	float X() const { return v[0]; }
+	float Y() const { return v[1]; }
+	float Z() const { return v[2]; }
+
+	Vec4f operator+(const Vec4f& a) const { return Vec4f(v[0] + a.v[0], v[1] + a.v[1], v[2] + a.v[2]); }
+	Vec4f operator-(const Vec4f& a) const { return Vec4f(v[0] - a.v[0], v[1] - a.v[1], v[2] - a.v[2]); }
+	Vec4f operator*(const float s) const { return Vec4f(v[0] * s, v[1] * s, v[2] * s); }
+	Vec4f mult(const Vec4f& a) const { return Vec4f(v[0] * a.v[0], v[1] * a.v[1], v[2] * a.v[2]); }
+
+	// this + a * s
+	Vec4f madd(const Vec4f& a, const float s) const { return Vec4f(v[0] + a.v[0] * s, v[1] + a.v[1] * s, v[2] + a.v[2] * s); }
+
+	float dot(const Vec4f& a) const { return v[0] * a.v[0] + v[1] * a.v[1] + v[2] * a.v[2]; }
+
+	Vec4f cross(const Vec4f& a) const {
+		return Vec4f(v[1] * a.v[2] - v[2] * a.v[1], v[2] * a.v[0] - v[0] * a.v[2], v[0] * a.v[1] - v[1] * a.v[0]);
+	}
+
+	void Store(Vec *a) const {
+		*a = Vec(v[0], v[1], v[2]);
+	}
+#endif
+
+	Vec4f normalized() const { return *this * (1.f / std::sqrt(dot(*this))); }
+};
+
+static_assert(sizeof(Vec4f) == 16, "Vec4f is one SIMD register");
+static_assert(std::is_trivially_copyable<Vec4f>::value, "Vec4f is stored in plain arrays");
+
+#endif
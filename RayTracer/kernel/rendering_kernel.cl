@@ -7,6 +7,36 @@
 #define OCL_CONSTANT_BUFFER __constant
 #endif
 
+/* Storage of the scene geometry, chosen by the host from the scene size:
+ * __constant by default, __global when the scene does not fit the constant
+ * memory of the device (restrict lets the compiler use the read-only data
+ * cache) and an image for the top level spheres with PARAM_SCENE_IMAGE. */
+#if defined(PARAM_SCENE_GLOBAL) || defined(PARAM_SCENE_IMAGE)
+#define SCENE_BUFFER __global
+#define SCENE_RESTRICT restrict
+#else
+#define SCENE_BUFFER OCL_CONSTANT_BUFFER
+#define SCENE_RESTRICT
+#endif
+
+/* With PARAM_LOCAL_STAGING, each work-group copies the top level spheres
+ * to local memory at the start of the kernel and reads them from there */
+#if defined(PARAM_LOCAL_STAGING)
+#define SPHERE_BUFFER __local
+#elif !defined(PARAM_SCENE_IMAGE)
+#define SPHERE_BUFFER SCENE_BUFFER
+#endif
+
+/* Images can not be stored in a struct, the sphere image is passed along
+ * with the scene */
+#ifndef SPHERE_BUFFER
+#define SCENE_PARAM const Scene *scene, __read_only image2d_t sphereImage
+#define SCENE_ARG scene, sphereImage
+#else
+#define SCENE_PARAM const Scene *scene
+#define SCENE_ARG scene
+#endif
+
 //------------------------------------------------------------------------------
 // vec.h
 
@@ -50,6 +80,29 @@ typedef struct {
 	Vec o, d;
 } Ray;
 
+/* First hit of the primary ray, depth is 0 if it missed */
+typedef struct {
+	Vec p;
+	float depth;
+} FirstHit;
+
+/* Relative depth difference above which a reprojected history is rejected */
+#define REPROJECTION_DEPTH_TOLERANCE 0.05f
+
+/* Surface seen by the primary ray, guiding the denoiser. depth is 0 if the
+ * ray missed, the buffer holds the average over the samples of the pixel
+ * (depth < 0 before the first one). */
+typedef struct {
+	Vec albedo;
+	Vec normal; /* facing the camera */
+	float depth;
+} Feature;
+
+/* Edge-stopping functions of the a-trous filter (same as Denoise.cpp) */
+#define DENOISE_NORMAL_POWER 32.f
+#define DENOISE_DEPTH_SIGMA 0.02f /* relative depth change per pixel */
+#define DENOISE_ALBEDO_SIGMA 0.1f
+
 #define rinit(r, a, b) { vassign((r).o, a); vassign((r).d, b); }
 #define rassign(a, b) { vassign((a).o, (b).o); vassign((a).d, (b).d); }
 
@@ -63,6 +116,58 @@ typedef struct {
 	enum Refl refl; /* reflection type (DIFFuse, SPECular, REFRactive) */
 } Sphere;
 
+/* Copy of a prototype sphere group, world = local * scale + translate */
+typedef struct {
+	Vec translate;
+	float scale;
+	Vec boundCenter; /* world space bounding sphere of the copy */
+	float boundRadius;
+	unsigned int firstSphere, sphereCount; /* in the prototype sphere buffer */
+} Instance;
+
+/* Indexed triangle mesh, vertices are quantized on 16 bits:
+ * position = boundMin + q * quantScale */
+typedef struct {
+	Vec boundMin;
+	Vec quantScale;
+	Vec c; /* color */
+	enum Refl refl;
+	unsigned int firstVertex, firstTriangle, firstNode; /* in the shared mesh buffers */
+} Mesh;
+
+typedef struct {
+	float bmin[3];
+	unsigned int leftFirst; /* first triangle of a leaf, first child otherwise */
+	float bmax[3];
+	unsigned int count; /* triangles of a leaf, 0 otherwise */
+} MeshBVHNode;
+
+#define MESH_STACK_SIZE 64
+
+/* All the geometry buffers */
+typedef struct {
+#ifdef SPHERE_BUFFER
+	SPHERE_BUFFER const Sphere *spheres;
+#endif
+	unsigned int sphereCount;
+	SCENE_BUFFER const Instance *instances; /* in the leaf order of instanceNodes */
+	unsigned int instanceCount;
+	__global const MeshBVHNode *instanceNodes; /* BVH over the instance bounds */
+	SCENE_BUFFER const Sphere *prototypeSpheres;
+	SCENE_BUFFER const Mesh *meshes;
+	unsigned int meshCount;
+	__global const ushort *meshVertices;
+	__global const unsigned int *meshIndices;
+	__global const MeshBVHNode *meshNodes;
+} Scene;
+
+/* Surface found by Intersect() */
+typedef struct {
+	Vec normal; /* unit normal, pointing out of the surface */
+	Vec e, c; /* emission, color */
+	enum Refl refl;
+} SurfaceHit;
+
 //------------------------------------------------------------------------------
 // simplernd.h
 
@@ -84,32 +189,218 @@ static float GetRandom(unsigned int *seed0, unsigned int *seed1) {
 
 //------------------------------------------------------------------------------
 
-static float SphereIntersect(
-	OCL_CONSTANT_BUFFER const Sphere *s,
-	const Ray *r) { /* returns distance, 0 if nohit */
+/* Source of the random numbers of a path. The random sampler is the
+ * multiply-with-carry generator above. With PARAM_SAMPLER_SOBOL, each
+ * dimension is a shuffled and Owen scrambled 2D Sobol sequence indexed by
+ * the sample of the pixel (Burley 2020, "Practical Hash-based Owen
+ * Scrambling"). With PARAM_SAMPLER_BLUE_NOISE, all the pixels share the
+ * same scrambling and the points are rotated by a blue noise tile instead,
+ * spreading the error as blue noise. */
+typedef struct {
+	unsigned int seed0, seed1; /* random sampler state */
+	unsigned int bounce; /* dimensions are numbered per bounce */
+#ifdef PARAM_SAMPLER_SOBOL
+	unsigned int pixelSeed;
+	unsigned int index; /* sample of the pixel */
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+	__global const float *blueNoise; /* BLUE_NOISE_SIZE x BLUE_NOISE_SIZE tile */
+	int x, y;
+#endif
+#endif
+} Sampler;
+
+/* Dimensions of a bounce */
+#define SAMPLER_CAMERA 0 /* pixel jitter (2D), first bounce only */
+#define SAMPLER_BSDF 1 /* diffuse direction (2D) */
+#define SAMPLER_REFRACTION 2 /* reflection / refraction choice (1D) */
+#define SAMPLER_LIGHT 3 /* point on the light i: SAMPLER_LIGHT + i (2D) */
+
+#ifdef PARAM_SAMPLER_SOBOL
+static unsigned int ReverseBits(unsigned int x) {
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+	x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+static unsigned int HashUInt(unsigned int x) {
+	x ^= x >> 16;
+	x *= 0x7feb352du;
+	x ^= x >> 15;
+	x *= 0x846ca68bu;
+	x ^= x >> 16;
+	return x;
+}
+
+static unsigned int HashCombine(const unsigned int seed, const unsigned int v) {
+	return seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+static unsigned int NestedUniformScramble(unsigned int x, const unsigned int seed) {
+	/* Laine-Karras permutation on the reversed bits */
+	x = ReverseBits(x);
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return ReverseBits(x);
+}
+
+/* Second dimension of the Sobol sequence (the first is ReverseBits) */
+static unsigned int Sobol1(unsigned int index) {
+	unsigned int result = 0;
+	unsigned int v = 1u << 31;
+	for (; index; index >>= 1, v ^= v >> 1) {
+		if (index & 1)
+			result ^= v;
+	}
+
+	return result;
+}
+
+/* [0, 1) with 24 bits */
+static float UIntToUnitFloat(const unsigned int x) {
+	return (x >> 8) * (1.f / 16777216.f);
+}
+
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+static float BlueNoiseRotate(const Sampler *s, const unsigned int hash, const float u) {
+	/* A different toroidal shift of the tile for each dimension */
+	const int tx = (s->x + (hash & 0xffff)) % BLUE_NOISE_SIZE;
+	const int ty = (s->y + (hash >> 16)) % BLUE_NOISE_SIZE;
+	const float r = u + s->blueNoise[ty * BLUE_NOISE_SIZE + tx];
+	return (r >= 1.f) ? (r - 1.f) : r;
+}
+#endif
+#endif
+
+static void SamplerGet2D(Sampler *s, const unsigned int dimension, float *u0, float *u1) {
+#ifdef PARAM_SAMPLER_SOBOL
+	const unsigned int dimensionHash = HashUInt((s->bounce << 16) + dimension);
+	const unsigned int seed = HashCombine(s->pixelSeed, dimensionHash);
+	const unsigned int index = NestedUniformScramble(s->index, seed);
+
+	*u0 = UIntToUnitFloat(NestedUniformScramble(ReverseBits(index), HashCombine(seed, 0)));
+	*u1 = UIntToUnitFloat(NestedUniformScramble(Sobol1(index), HashCombine(seed, 1)));
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+	*u0 = BlueNoiseRotate(s, dimensionHash, *u0);
+	*u1 = BlueNoiseRotate(s, HashUInt(dimensionHash), *u1);
+#endif
+#else
+	*u0 = GetRandom(&s->seed0, &s->seed1);
+	*u1 = GetRandom(&s->seed0, &s->seed1);
+#endif
+}
+
+static float SamplerGet1D(Sampler *s, const unsigned int dimension) {
+#ifdef PARAM_SAMPLER_SOBOL
+	float u0, u1;
+	SamplerGet2D(s, dimension, &u0, &u1);
+	return u0;
+#else
+	return GetRandom(&s->seed0, &s->seed1);
+#endif
+}
+
+
+/* returns distance, 0 if no hit farther than minT */
+static float SphereIntersectMin(
+	const Vec *center, const float rad,
+	const Ray *r,
+	const float minT) {
 	Vec op; /* Solve t^2*d.d + 2*t*(o-p).d + (o-p).(o-p)-R^2 = 0 */
-	vsub(op, s->p, r->o);
+	vsub(op, *center, r->o);
 
 	float b = vdot(op, r->d);
-	float det = b * b - vdot(op, op) + s->rad * s->rad;
+	float det = b * b - vdot(op, op) + rad * rad;
 	if (det < 0.f)
 		return 0.f;
 	else
 		det = sqrt(det);
 
 	float t = b - det;
-	if (t >  EPSILON)
+	if (t >  minT)
 		return t;
 	else {
 		t = b + det;
 
-		if (t >  EPSILON)
+		if (t >  minT)
 			return t;
 		else
 			return 0.f;
 	}
 }
 
+static float SphereIntersect(
+	const Sphere *s,
+	const Ray *r) { /* returns distance, 0 if nohit */
+	return SphereIntersectMin(&s->p, s->rad, r, EPSILON);
+}
+
+#ifdef PARAM_SCENE_IMAGE
+/* Each sphere is stored in 3 RGBA texels: (rad, p), (e, c.x), (c.y, c.z, refl, 0) */
+static void ReadSphereImage(
+	__read_only image2d_t sphereImage,
+	const unsigned int index,
+	Sphere *s) {
+	const sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+	const int x = 3 * (index % SCENE_IMAGE_SPHERES_PER_ROW);
+	const int y = index / SCENE_IMAGE_SPHERES_PER_ROW;
+
+	const float4 t0 = read_imagef(sphereImage, sampler, (int2)(x, y));
+	const float4 t1 = read_imagef(sphereImage, sampler, (int2)(x + 1, y));
+	const float4 t2 = read_imagef(sphereImage, sampler, (int2)(x + 2, y));
+
+	s->rad = t0.x;
+	vinit(s->p, t0.y, t0.z, t0.w);
+	vinit(s->e, t1.x, t1.y, t1.z);
+	vinit(s->c, t1.w, t2.x, t2.y);
+	s->refl = (enum Refl)((int)t2.z);
+}
+#endif
+
+/* Copies a top level sphere */
+static void FetchSphere(
+	SCENE_PARAM,
+	const unsigned int index,
+	Sphere *s) {
+#ifdef SPHERE_BUFFER
+	*s = scene->spheres[index];
+#else
+	ReadSphereImage(sphereImage, index, s);
+#endif
+}
+
+/* Returns 1 if the ray may hit the instance closer than maxt */
+static int InstanceBoundIntersect(
+	SCENE_BUFFER const Instance *inst,
+	const Ray *r,
+	const float maxt) {
+	Vec op;
+	vsub(op, inst->boundCenter, r->o);
+
+	const float b = vdot(op, r->d);
+	const float det = b * b - vdot(op, op) + inst->boundRadius * inst->boundRadius;
+	if (det < 0.f)
+		return 0;
+
+	const float sdet = sqrt(det);
+	return (b + sdet > EPSILON) && (b - sdet < maxt);
+}
+
+/* The ray in the prototype space of the instance. The direction is kept
+ * normalized: prototype space distances are world distances / scale. */
+static void InstanceRay(
+	SCENE_BUFFER const Instance *inst,
+	const Ray *r,
+	Ray *localRay) {
+	vsub(localRay->o, r->o, inst->translate);
+	vsmul(localRay->o, 1.f / inst->scale, localRay->o);
+	vassign(localRay->d, r->d);
+}
+
 static void UniformSampleSphere(const float u1, const float u2, Vec *v) {
 	const float zz = 1.f - 2.f * u1;
 	const float r = sqrt(max(0.f, 1.f - zz * zz));
@@ -120,65 +411,319 @@ static void UniformSampleSphere(const float u1, const float u2, Vec *v) {
 	vinit(*v, xx, yy, zz);
 }
 
+static void MeshVertex(
+	SCENE_BUFFER const Mesh *mesh,
+	__global const ushort *vertices,
+	const unsigned int index,
+	Vec *p) {
+	__global const ushort *q = &vertices[3 * (mesh->firstVertex + index)];
+	vinit(*p,
+			mesh->boundMin.x + q[0] * mesh->quantScale.x,
+			mesh->boundMin.y + q[1] * mesh->quantScale.y,
+			mesh->boundMin.z + q[2] * mesh->quantScale.z);
+}
+
+static float TriangleIntersect(
+	const Vec *v0, const Vec *v1, const Vec *v2,
+	const Ray *r) { /* returns distance, 0 if nohit (Moller-Trumbore) */
+	Vec e1, e2, pv, tv, qv;
+	vsub(e1, *v1, *v0);
+	vsub(e2, *v2, *v0);
+
+	vxcross(pv, r->d, e2);
+	const float det = vdot(e1, pv);
+	if (det == 0.f)
+		return 0.f;
+	const float invDet = 1.f / det;
+
+	vsub(tv, r->o, *v0);
+	const float u = vdot(tv, pv) * invDet;
+	if ((u < 0.f) || (u > 1.f))
+		return 0.f;
+
+	vxcross(qv, tv, e1);
+	const float v = vdot(r->d, qv) * invDet;
+	if ((v < 0.f) || (u + v > 1.f))
+		return 0.f;
+
+	const float t = vdot(e2, qv) * invDet;
+	return (t > EPSILON) ? t : 0.f;
+}
+
+static int BoxIntersect(
+	__global const MeshBVHNode *node,
+	const Ray *r, const Vec *invD,
+	const float maxt) {
+	float t0 = 0.f;
+	float t1 = maxt;
+
+	float ta = (node->bmin[0] - r->o.x) * invD->x;
+	float tb = (node->bmax[0] - r->o.x) * invD->x;
+	t0 = fmax(t0, fmin(ta, tb));
+	t1 = fmin(t1, fmax(ta, tb));
+
+	ta = (node->bmin[1] - r->o.y) * invD->y;
+	tb = (node->bmax[1] - r->o.y) * invD->y;
+	t0 = fmax(t0, fmin(ta, tb));
+	t1 = fmin(t1, fmax(ta, tb));
+
+	ta = (node->bmin[2] - r->o.z) * invD->z;
+	tb = (node->bmax[2] - r->o.z) * invD->z;
+	t0 = fmax(t0, fmin(ta, tb));
+	t1 = fmin(t1, fmax(ta, tb));
+
+	return (t0 <= t1);
+}
+
+/* Closest triangle of the mesh nearer than *t, or the first one found if
+ * anyHit is set. Updates *t and *triangle (index in the shared buffer). */
+static int MeshIntersect(
+	const Scene *scene,
+	SCENE_BUFFER const Mesh *mesh,
+	const Ray *r,
+	const int anyHit,
+	float *t,
+	unsigned int *triangle) {
+	Vec invD;
+	vinit(invD, 1.f / r->d.x, 1.f / r->d.y, 1.f / r->d.z);
+
+	unsigned int stack[MESH_STACK_SIZE];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	int found = 0;
+	while (sp > 0) {
+		__global const MeshBVHNode *node = &scene->meshNodes[mesh->firstNode + stack[--sp]];
+		if (!BoxIntersect(node, r, &invD, *t))
+			continue;
+
+		if (node->count == 0) {
+			stack[sp++] = node->leftFirst;
+			stack[sp++] = node->leftFirst + 1;
+			continue;
+		}
+
+		unsigned int i;
+		for (i = mesh->firstTriangle + node->leftFirst; i < mesh->firstTriangle + node->leftFirst + node->count; ++i) {
+			__global const unsigned int *tri = &scene->meshIndices[3 * i];
+			Vec v0, v1, v2;
+			MeshVertex(mesh, scene->meshVertices, tri[0], &v0);
+			MeshVertex(mesh, scene->meshVertices, tri[1], &v1);
+			MeshVertex(mesh, scene->meshVertices, tri[2], &v2);
+
+			const float d = TriangleIntersect(&v0, &v1, &v2, r);
+			if ((d != 0.f) && (d < *t)) {
+				*t = d;
+				*triangle = i;
+				found = 1;
+
+				if (anyHit)
+					return 1;
+			}
+		}
+	}
+
+	return found;
+}
+
+/* Closest prototype sphere of the instances nearer than *t, or the first one
+ * found if anyHit is set, through the BVH over the instance bounds. Updates
+ * *t, *sphere (index in the prototype buffer) and *instance. */
+static int InstancesIntersect(
+	const Scene *scene,
+	const Ray *r,
+	const int anyHit,
+	float *t,
+	unsigned int *sphere,
+	int *instance) {
+	if (scene->instanceCount == 0)
+		return 0;
+
+	Vec invD;
+	vinit(invD, 1.f / r->d.x, 1.f / r->d.y, 1.f / r->d.z);
+
+	unsigned int stack[MESH_STACK_SIZE];
+	int sp = 0;
+	stack[sp++] = 0;
+
+	int found = 0;
+	while (sp > 0) {
+		__global const MeshBVHNode *node = &scene->instanceNodes[stack[--sp]];
+		if (!BoxIntersect(node, r, &invD, *t))
+			continue;
+
+		if (node->count == 0) {
+			stack[sp++] = node->leftFirst;
+			stack[sp++] = node->leftFirst + 1;
+			continue;
+		}
+
+		unsigned int i;
+		for (i = node->leftFirst; i < node->leftFirst + node->count; ++i) {
+			SCENE_BUFFER const Instance *inst = &scene->instances[i];
+			if (!InstanceBoundIntersect(inst, r, *t))
+				continue;
+
+			Ray localRay;
+			InstanceRay(inst, r, &localRay);
+			const float minT = EPSILON / inst->scale;
+
+			unsigned int j;
+			for (j = inst->firstSphere; j < inst->firstSphere + inst->sphereCount; ++j) {
+				SCENE_BUFFER const Sphere *ps = &scene->prototypeSpheres[j];
+				const Vec center = ps->p;
+				const float d = SphereIntersectMin(&center, ps->rad, &localRay, minT) * inst->scale;
+				if ((d != 0.f) && (d < *t)) {
+					*t = d;
+					*sphere = j;
+					*instance = i;
+					found = 1;
+
+					if (anyHit)
+						return 1;
+				}
+			}
+		}
+	}
+
+	return found;
+}
+
 static int Intersect(
-	OCL_CONSTANT_BUFFER const Sphere *spheres,
-	const unsigned int sphereCount,
+	SCENE_PARAM,
 	const Ray *r,
 	float *t,
-	unsigned int *id) {
+	SurfaceHit *hit) {
 	float inf = (*t) = 1e20f;
 
+	unsigned int id = 0;
+	int hitInstance = -1;
+
 	unsigned int i = 0;
-	for (i = 0; i < sphereCount; ++i) {
-		const float d = SphereIntersect(&spheres[i], r);
+	for (i = 0; i < scene->sphereCount; ++i) {
+		Sphere s;
+		FetchSphere(SCENE_ARG, i, &s);
+
+		const float d = SphereIntersect(&s, r);
 		if ((d != 0.f) && (d < *t)) {
 			*t = d;
-			*id = i;
+			id = i;
 		}
 	}
 
-	return (*t < inf);
+	InstancesIntersect(scene, r, 0, t, &id, &hitInstance);
+
+	int hitMesh = -1;
+	unsigned int triangle = 0;
+	for (i = 0; i < scene->meshCount; ++i) {
+		if (MeshIntersect(scene, &scene->meshes[i], r, 0, t, &triangle))
+			hitMesh = i;
+	}
+
+	if (*t >= inf)
+		return 0;
+
+	if (hitMesh >= 0) {
+		SCENE_BUFFER const Mesh *mesh = &scene->meshes[hitMesh];
+		__global const unsigned int *tri = &scene->meshIndices[3 * triangle];
+		Vec v0, v1, v2;
+		MeshVertex(mesh, scene->meshVertices, tri[0], &v0);
+		MeshVertex(mesh, scene->meshVertices, tri[1], &v1);
+		MeshVertex(mesh, scene->meshVertices, tri[2], &v2);
+
+		/* Counter-clockwise faces point outwards */
+		Vec e1, e2;
+		vsub(e1, v1, v0);
+		vsub(e2, v2, v0);
+		vxcross(hit->normal, e1, e2);
+		vnorm(hit->normal);
+
+		vclr(hit->e);
+		vassign(hit->c, mesh->c);
+		hit->refl = mesh->refl;
+		return 1;
+	}
+
+	Sphere s;
+	Vec center;
+	if (hitInstance < 0) {
+		FetchSphere(SCENE_ARG, id, &s);
+		vassign(center, s.p);
+	} else {
+		SCENE_BUFFER const Instance *inst = &scene->instances[hitInstance];
+		s = scene->prototypeSpheres[id];
+		vsmul(center, inst->scale, s.p);
+		vadd(center, center, inst->translate);
+	}
+
+	Vec hitPoint;
+	vsmul(hitPoint, *t, r->d);
+	vadd(hitPoint, r->o, hitPoint);
+	vsub(hit->normal, hitPoint, center);
+	vnorm(hit->normal);
+
+	vassign(hit->e, s.e);
+	vassign(hit->c, s.c);
+	hit->refl = s.refl;
+	return 1;
 }
 
 static int IntersectP(
-	OCL_CONSTANT_BUFFER const Sphere *spheres,
-	const unsigned int sphereCount,
+	SCENE_PARAM,
 	const Ray *r,
 	const float maxt) {
 	unsigned int i = 0;
-	for (i = 0; i < sphereCount; ++i) {
-		const float d = SphereIntersect(&spheres[i], r);
+	for (i = 0; i < scene->sphereCount; ++i) {
+		Sphere s;
+		FetchSphere(SCENE_ARG, i, &s);
+
+		const float d = SphereIntersect(&s, r);
 		if ((d != 0.f) && (d < maxt))
 			return 1;
 	}
 
+	float instanceT = maxt;
+	unsigned int instanceSphere;
+	int instance;
+	if (InstancesIntersect(scene, r, 1, &instanceT, &instanceSphere, &instance))
+		return 1;
+
+	for (i = 0; i < scene->meshCount; ++i) {
+		float t = maxt;
+		unsigned int triangle;
+		if (MeshIntersect(scene, &scene->meshes[i], r, 1, &t, &triangle))
+			return 1;
+	}
+
 	return 0;
 }
 
 static void SampleLights(
-	OCL_CONSTANT_BUFFER const Sphere *spheres,
-	const unsigned int sphereCount,
-	unsigned int *seed0, unsigned int *seed1,
+	SCENE_PARAM,
+	Sampler *sampler,
 	const Vec *hitPoint,
 	const Vec *normal,
 	Vec *result) {
 	vclr(*result);
 
-	/* For each light */
+	/* For each light (only top level spheres are lights) */
 	unsigned int i;
-	for (i = 0; i < sphereCount; i++) {
-		OCL_CONSTANT_BUFFER const Sphere *light = &spheres[i];
-		if (!viszero(light->e)) {
+	for (i = 0; i < scene->sphereCount; i++) {
+		Sphere light;
+		FetchSphere(SCENE_ARG, i, &light);
+		if (!viszero(light.e)) {
 			/* It is a light source */
 			Ray shadowRay;
 			shadowRay.o = *hitPoint;
 
 			/* Choose a point over the light source */
 			Vec unitSpherePoint;
-			UniformSampleSphere(GetRandom(seed0, seed1), GetRandom(seed0, seed1), &unitSpherePoint);
+			float u0, u1;
+			SamplerGet2D(sampler, SAMPLER_LIGHT + i, &u0, &u1);
+			UniformSampleSphere(u0, u1, &unitSpherePoint);
 			Vec spherePoint;
-			vsmul(spherePoint, light->rad, unitSpherePoint);
-			vadd(spherePoint, spherePoint, light->p);
+			vsmul(spherePoint, light.rad, unitSpherePoint);
+			vadd(spherePoint, spherePoint, light.p);
 
 			/* Build the shadow ray direction */
 			vsub(shadowRay.d, spherePoint, *hitPoint);
@@ -194,9 +739,9 @@ static void SampleLights(
 
 			/* Check if the light is visible */
 			const float wi = vdot(shadowRay.d, *normal);
-			if ((wi > 0.f) && (!IntersectP(spheres, sphereCount, &shadowRay, len - EPSILON))) {
-				Vec c; vassign(c, light->e);
-				const float s = (4.f * FLOAT_PI * light->rad * light->rad) * wi * wo / (len *len);
+			if ((wi > 0.f) && (!IntersectP(SCENE_ARG, &shadowRay, len - EPSILON))) {
+				Vec c; vassign(c, light.e);
+				const float s = (4.f * FLOAT_PI * light.rad * light.rad) * wi * wo / (len *len);
 				vsmul(c, s, c);
 				vadd(*result, *result, c);
 			}
@@ -205,18 +750,22 @@ static void SampleLights(
 }
 
 static void Radiance(
-	OCL_CONSTANT_BUFFER const Sphere *spheres,
-	const unsigned int sphereCount,
+	SCENE_PARAM,
 	const Ray *startRay,
-	unsigned int *seed0, unsigned int *seed1,
-	Vec *result) {
+	Sampler *sampler,
+	Vec *result, Feature *first) {
 	Ray currentRay; rassign(currentRay, *startRay);
+	vclr(first->albedo);
+	vclr(first->normal);
+	first->depth = 0.f; /* 0 if the primary ray misses */
 	Vec rad; vinit(rad, 0.f, 0.f, 0.f);
 	Vec throughput; vinit(throughput, 1.f, 1.f, 1.f);
 
 	unsigned int depth = 0;
 	int specularBounce = 1;
 	for (;; ++depth) {
+		sampler->bounce = depth;
+
 		// Removed Russian Roulette in order to improve execution on SIMT
 		if (depth > 6) {
 			*result = rad;
@@ -224,21 +773,18 @@ static void Radiance(
 		}
 
 		float t; /* distance to intersection */
-		unsigned int id = 0; /* id of intersected object */
-		if (!Intersect(spheres, sphereCount, &currentRay, &t, &id)) {
+		SurfaceHit obj; /* the hit object */
+		if (!Intersect(SCENE_ARG, &currentRay, &t, &obj)) {
 			*result = rad; /* if miss, return */
 			return;
 		}
 
-		OCL_CONSTANT_BUFFER const Sphere *obj = &spheres[id]; /* the hit object */
-
 		Vec hitPoint;
 		vsmul(hitPoint, t, currentRay.d);
 		vadd(hitPoint, currentRay.o, hitPoint);
 
 		Vec normal;
-		vsub(normal, hitPoint, obj->p);
-		vnorm(normal);
+		vassign(normal, obj.normal);
 
 		const float dp = vdot(normal, currentRay.d);
 		Vec nl;
@@ -246,8 +792,14 @@ static void Radiance(
 		const float invSignDP = -1.f * sign(dp);
 		vsmul(nl, invSignDP, normal);
 
+		if (depth == 0) {
+			vassign(first->albedo, obj.c);
+			vassign(first->normal, nl);
+			first->depth = t;
+		}
+
 		/* Add emitted light */
-		Vec eCol; vassign(eCol, obj->e);
+		Vec eCol; vassign(eCol, obj.e);
 		if (!viszero(eCol)) {
 			if (specularBounce) {
 				vsmul(eCol, fabs(dp), eCol);
@@ -259,14 +811,14 @@ static void Radiance(
 			return;
 		}
 
-		if (obj->refl == DIFF) { /* Ideal DIFFUSE reflection */
+		if (obj.refl == DIFF) { /* Ideal DIFFUSE reflection */
 			specularBounce = 0;
-			vmul(throughput, throughput, obj->c);
+			vmul(throughput, throughput, obj.c);
 
 			/* Direct lighting component */
 
 			Vec Ld;
-			SampleLights(spheres, sphereCount, seed0, seed1, &hitPoint, &nl, &Ld);
+			SampleLights(SCENE_ARG, sampler, &hitPoint, &nl, &Ld);
 			vmul(Ld, throughput, Ld);
 			vadd(rad, rad, Ld);
 
@@ -274,8 +826,9 @@ static void Radiance(
 
 			/* Diffuse component */
 
-			float r1 = 2.f * FLOAT_PI * GetRandom(seed0, seed1);
-			float r2 = GetRandom(seed0, seed1);
+			float r1, r2;
+			SamplerGet2D(sampler, SAMPLER_BSDF, &r1, &r2);
+			r1 *= 2.f * FLOAT_PI;
 			float r2s = sqrt(r2);
 
 			Vec w; vassign(w, nl);
@@ -302,14 +855,14 @@ static void Radiance(
 			currentRay.o = hitPoint;
 			currentRay.d = newDir;
 			continue;
-		} else if (obj->refl == SPEC) { /* Ideal SPECULAR reflection */
+		} else if (obj.refl == SPEC) { /* Ideal SPECULAR reflection */
 			specularBounce = 1;
 
 			Vec newDir;
 			vsmul(newDir,  2.f * vdot(normal, currentRay.d), normal);
 			vsub(newDir, currentRay.d, newDir);
 
-			vmul(throughput, throughput, obj->c);
+			vmul(throughput, throughput, obj.c);
 
 			rinit(currentRay, hitPoint, newDir);
 			continue;
@@ -330,7 +883,7 @@ static void Radiance(
 			float cos2t = 1.f - nnt * nnt * (1.f - ddn * ddn);
 
 			if (cos2t < 0.f)  { /* Total internal reflection */
-				vmul(throughput, throughput, obj->c);
+				vmul(throughput, throughput, obj.c);
 
 				rassign(currentRay, reflRay);
 				continue;
@@ -355,15 +908,15 @@ static void Radiance(
 			float RP = Re / P;
 			float TP = Tr / (1.f - P);
 
-			if (GetRandom(seed0, seed1) < P) { /* R.R. */
+			if (SamplerGet1D(sampler, SAMPLER_REFRACTION) < P) { /* R.R. */
 				vsmul(throughput, RP, throughput);
-				vmul(throughput, throughput, obj->c);
+				vmul(throughput, throughput, obj.c);
 
 				rassign(currentRay, reflRay);
 				continue;
 			} else {
 				vsmul(throughput, TP, throughput);
-				vmul(throughput, throughput, obj->c);
+				vmul(throughput, throughput, obj.c);
 
 				rinit(currentRay, hitPoint, transDir);
 				continue;
@@ -373,14 +926,19 @@ static void Radiance(
 }
 
 static void GeneratePrimaryRay(OCL_CONSTANT_BUFFER const Camera *camera,
-		unsigned int *seed0, unsigned int *seed1,
-		const int width, const int height, const int x, const int y, Ray *ray) {
+		Sampler *sampler,
+		const int width, const int height, const int x, const int y,
+		const int scale, Ray *ray) {
 	const float invWidth = 1.f / width;
 	const float invHeight = 1.f / height;
-	const float r1 = GetRandom(seed0, seed1) - .5f;
-	const float r2 = GetRandom(seed0, seed1) - .5f;
-	const float kcx = (x + r1) * invWidth - .5f;
-	const float kcy = (y + r2) * invHeight - .5f;
+	/* Jitter over the whole scale x scale block starting at (x, y) */
+	float r1, r2;
+	sampler->bounce = 0;
+	SamplerGet2D(sampler, SAMPLER_CAMERA, &r1, &r2);
+	r1 -= .5f;
+	r2 -= .5f;
+	const float kcx = (x + .5f * (scale - 1) + r1 * scale) * invWidth - .5f;
+	const float kcy = (y + .5f * (scale - 1) + r2 * scale) * invHeight - .5f;
 
 	Vec rdir;
 	vinit(rdir,
@@ -396,47 +954,511 @@ static void GeneratePrimaryRay(OCL_CONSTANT_BUFFER const Camera *camera,
 	rinit(*ray, rorig, rdir);
 }
 
-__kernel void RadianceGPU(
-    __global Vec *colors, __global unsigned int *seedsInput,
-	OCL_CONSTANT_BUFFER const Sphere *sphere, OCL_CONSTANT_BUFFER const Camera *camera,
-	const unsigned int sphereCount,
+/* Accumulated radiance of a pixel: the running average in a Vec, or with
+ * PARAM_ACCUMULATION_COMPACT the sum of the samples in 64 bits (two thirds
+ * of the memory and bandwidth), divided by the sample count when it is read
+ * back. The sum is stored as 3 mantissas of 19 bits sharing a 7 bit
+ * exponent: the error of each store is relative to the sum, and only
+ * accumulates over the passes as a random walk. */
+#ifdef PARAM_ACCUMULATION_COMPACT
+#define ACCUMULATION_BUFFER __global ulong
+#define COMPACT_MANTISSA_BITS 19
+#define COMPACT_MANTISSA_MASK 0x7FFFFUL
+#define COMPACT_EXPONENT_BIAS 64
+
+/* Rounds v * scale to one of the two nearest integers, with a probability
+ * given by the distance to the other one (u in [0, 1)), so that the sum is
+ * not biased by the rounding */
+static ulong PackMantissa(const float v, const float scale, const float u) {
+	/* v * scale + u would round u away near 2^19, compare it to the exact
+	 * fraction instead */
+	const float m = max(v * scale, 0.f);
+	const float down = floor(m);
+	return (ulong)min(down + ((u < m - down) ? 1.f : 0.f), (float)COMPACT_MANTISSA_MASK);
+}
+
+static void LoadAccumulation(const ACCUMULATION_BUFFER *colors, const unsigned int index, Vec *c) {
+	const ulong packed = colors[index];
+	const int e = (int)(packed >> (3 * COMPACT_MANTISSA_BITS));
+	const float scale = (e == 0) ? 0.f : ldexp(1.f, e - COMPACT_EXPONENT_BIAS - COMPACT_MANTISSA_BITS);
+	vinit(*c, (packed & COMPACT_MANTISSA_MASK) * scale,
+			((packed >> COMPACT_MANTISSA_BITS) & COMPACT_MANTISSA_MASK) * scale,
+			((packed >> (2 * COMPACT_MANTISSA_BITS)) & COMPACT_MANTISSA_MASK) * scale);
+}
+
+static void StoreAccumulation(ACCUMULATION_BUFFER *colors, const unsigned int index, const Vec *c,
+		Sampler *sampler) {
+	const float maxc = max(c->x, max(c->y, c->z));
+	if (!(maxc > 0.f)) {
+		colors[index] = 0;
+		return;
+	}
+
+	/* The largest channel sets the exponent: maxc < 2^e */
+	int e;
+	frexp(maxc, &e);
+	e = clamp(e + COMPACT_EXPONENT_BIAS, 1, 127);
+	const float scale = ldexp(1.f, COMPACT_MANTISSA_BITS + COMPACT_EXPONENT_BIAS - e);
+
+	/* The random sampler state is there with any sampler */
+	const ulong r = PackMantissa(c->x, scale, GetRandom(&sampler->seed0, &sampler->seed1));
+	const ulong g = PackMantissa(c->y, scale, GetRandom(&sampler->seed0, &sampler->seed1));
+	const ulong b = PackMantissa(c->z, scale, GetRandom(&sampler->seed0, &sampler->seed1));
+	colors[index] = r | (g << COMPACT_MANTISSA_BITS) | (b << (2 * COMPACT_MANTISSA_BITS)) |
+			((ulong)e << (3 * COMPACT_MANTISSA_BITS));
+}
+#else
+#define ACCUMULATION_BUFFER __global Vec
+
+static void LoadAccumulation(const ACCUMULATION_BUFFER *colors, const unsigned int index, Vec *c) {
+	vassign(*c, colors[index]);
+}
+
+static void StoreAccumulation(ACCUMULATION_BUFFER *colors, const unsigned int index, const Vec *c,
+		Sampler *sampler) {
+	colors[index] = *c;
+}
+#endif
+
+/* Maps a work-item to the pixel (or preview block) it renders. With
+ * previewScale > 1 each work-item renders a previewScale x previewScale
+ * block and accumulates in its first pixel owned by the device. Returns 0
+ * if the work-item has nothing to do. */
+static int MapWorkItem(const unsigned int gid,
+		const unsigned int width, const unsigned int height,
+		const unsigned int workOffset, const unsigned int workAmount,
+		const unsigned int previewScale,
+		int *scrX, int *scrY, unsigned int *index) {
+	if (previewScale <= 1) {
+		if (gid >= workAmount)
+			return 0;
+
+		*scrX = (workOffset + gid) % width;
+		*scrY = (workOffset + gid) / width;
+		*index = gid;
+		return 1;
+	}
+
+	const unsigned int blocksPerRow = (width + previewScale - 1) / previewScale;
+	const unsigned int firstBlockRow = (workOffset / width) / previewScale;
+	const unsigned int x0 = (gid % blocksPerRow) * previewScale;
+	const unsigned int y0 = (firstBlockRow + gid / blocksPerRow) * previewScale;
+	const unsigned int workEnd = workOffset + workAmount;
+
+	unsigned int y;
+	for (y = y0; (y < y0 + previewScale) && (y < height); ++y) {
+		const unsigned int lo = y * width + x0;
+		const unsigned int hi = lo + min(previewScale, width - x0);
+		if ((hi > workOffset) && (lo < workEnd)) {
+			*scrX = x0;
+			*scrY = y0;
+			*index = max(lo, workOffset) - workOffset;
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/* Writes the pixel, or upsamples the preview block (nearest) */
+static void WritePixels(__global int *pixels, const int value,
+		const unsigned int width, const unsigned int height,
+		const unsigned int workOffset, const unsigned int workAmount,
+		const unsigned int previewScale,
+		const int scrX, const int scrY, const unsigned int index) {
+	if (previewScale <= 1) {
+		pixels[index] = value;
+		return;
+	}
+
+	const unsigned int workEnd = workOffset + workAmount;
+	unsigned int y, x;
+	for (y = scrY; (y < scrY + previewScale) && (y < height); ++y) {
+		for (x = scrX; (x < scrX + previewScale) && (x < width); ++x) {
+			const unsigned int i = y * width + x;
+			if ((i >= workOffset) && (i < workEnd))
+				pixels[i - workOffset] = value;
+		}
+	}
+}
+
+/* Renders the work-item gid of the pass (see MapWorkItem) */
+static void RenderWorkItem(const unsigned int gid,
+	SCENE_PARAM,
+	OCL_CONSTANT_BUFFER const Camera *camera,
+	ACCUMULATION_BUFFER *colors, __global unsigned int *seedsInput,
+	__global int *pixels,
 	const unsigned int width, const unsigned int height,
 	const unsigned int currentSample,
-	__global int *pixels,
 	const unsigned int workOffset,
-	const unsigned int workAmount) {
-	const int gid = get_global_id(0);
+	const unsigned int workAmount,
+	const unsigned int samplesPerLaunch,
+	const unsigned int previewScale,
+	const unsigned int frameWidth, const unsigned int frameHeight,
+	const unsigned int cropX, const unsigned int cropY
+#ifdef PARAM_REPROJECTION
+	, __global FirstHit *firstHits,
+	__global float *sampleCounts,
+	__global float *expectedDepths
+#endif
+#ifdef PARAM_DENOISE
+	, __global Feature *features
+#endif
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+	, __global const float *blueNoise
+#endif
+	) {
 	// Check if we have to do something
-	if (gid >= workAmount)
+	int scrX, scrY;
+	unsigned int index;
+	if (!MapWorkItem(gid, width, height, workOffset, workAmount, previewScale, &scrX, &scrY, &index))
 		return;
 
-	const int scrX = (workOffset + gid) % width;
-	const int scrY = (workOffset + gid) / width;
+	/* width x height is the crop window at (cropX, cropY) of the frame, the
+	 * rays and the samples follow the whole frame */
+	const int frameX = cropX + scrX;
+	const int frameY = cropY + scrY;
 
 	/*move seed to local store */
-	unsigned int seed0 = seedsInput[2 * gid];
-	unsigned int seed1 = seedsInput[2 * gid + 1];
+	Sampler sampler;
+	sampler.seed0 = seedsInput[2 * index];
+	sampler.seed1 = seedsInput[2 * index + 1];
+#ifdef PARAM_SAMPLER_SOBOL
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+	sampler.pixelSeed = 0;
+	sampler.blueNoise = blueNoise;
+	sampler.x = frameX;
+	sampler.y = frameY;
+#else
+	sampler.pixelSeed = HashUInt(frameY * frameWidth + frameX);
+#endif
+#endif
 
 	Ray ray;
-	GeneratePrimaryRay(camera, &seed0, &seed1, width, height, scrX, scrY, &ray);
+	Vec r; vclr(r);
+#ifdef PARAM_DENOISE
+	Feature featureSum;
+	vclr(featureSum.albedo);
+	vclr(featureSum.normal);
+	featureSum.depth = 0.f;
+#endif
+	Feature first;
+	unsigned int s;
+	for (s = 0; s < samplesPerLaunch; ++s) {
+#ifdef PARAM_SAMPLER_SOBOL
+		sampler.index = currentSample + s;
+#endif
+		GeneratePrimaryRay(camera, &sampler, frameWidth, frameHeight, frameX, frameY, previewScale, &ray);
+
+		Vec l;
+		Radiance(SCENE_ARG, &ray, &sampler, &l, &first);
+		vadd(r, r, l);
 
-	Vec r;
-	Radiance(sphere, sphereCount, &ray, &seed0, &seed1, &r);
+#ifdef PARAM_DENOISE
+		vadd(featureSum.albedo, featureSum.albedo, first.albedo);
+		vadd(featureSum.normal, featureSum.normal, first.normal);
+		featureSum.depth += first.depth;
+#endif
+	}
 
-	if (currentSample == 0) {
-		vassign(colors[gid], r);
+#ifdef PARAM_REPROJECTION
+	/* The history comes from a previous camera position: drop it if the
+	 * first hit does not match the depth it was reprojected with */
+	float sampleCount = sampleCounts[index];
+	const float expectedDepth = expectedDepths[index];
+	if (expectedDepth > 0.f) {
+		if (fabs(first.depth - expectedDepth) > REPROJECTION_DEPTH_TOLERANCE * expectedDepth)
+			sampleCount = 0.f;
+		expectedDepths[index] = 0.f;
+	}
+
+	vsmul(firstHits[index].p, first.depth, ray.d);
+	vadd(firstHits[index].p, firstHits[index].p, ray.o);
+	firstHits[index].depth = first.depth;
+
+	sampleCounts[index] = sampleCount + samplesPerLaunch;
+#else
+	const float sampleCount = currentSample;
+#endif
+
+	/* currentSample is the number of samples per pixel accumulated so far */
+	Vec color;
+#ifdef PARAM_ACCUMULATION_COMPACT
+	if (sampleCount != 0.f) {
+		LoadAccumulation(colors, index, &color);
+		vadd(r, r, color);
+	}
+	StoreAccumulation(colors, index, &r, &sampler);
+	vsmul(color, 1.f / (sampleCount + samplesPerLaunch), r);
+#else
+	if (sampleCount == 0.f) {
+		vsmul(color, 1.f / samplesPerLaunch, r);
 	} else {
-		const float k1 = currentSample;
-		const float k2 = 1.f / (currentSample + 1.f);
-		colors[gid].x = (colors[gid].x * k1  + r.x) * k2;
-		colors[gid].y = (colors[gid].y * k1  + r.y) * k2;
-		colors[gid].z = (colors[gid].z * k1  + r.z) * k2;
+		LoadAccumulation(colors, index, &color);
+		const float k1 = sampleCount;
+		const float k2 = 1.f / (sampleCount + samplesPerLaunch);
+		color.x = (color.x * k1  + r.x) * k2;
+		color.y = (color.y * k1  + r.y) * k2;
+		color.z = (color.z * k1  + r.z) * k2;
 	}
+	StoreAccumulation(colors, index, &color, &sampler);
+#endif
+
+#ifdef PARAM_DENOISE
+	/* Same running average as the colors, restarted when there is no history */
+	const float fk1 = (features[index].depth < 0.f) ? 0.f : sampleCount;
+	const float fk2 = 1.f / (fk1 + samplesPerLaunch);
+	vsmul(features[index].albedo, fk1, features[index].albedo);
+	vadd(features[index].albedo, features[index].albedo, featureSum.albedo);
+	vsmul(features[index].albedo, fk2, features[index].albedo);
+	vsmul(features[index].normal, fk1, features[index].normal);
+	vadd(features[index].normal, features[index].normal, featureSum.normal);
+	vsmul(features[index].normal, fk2, features[index].normal);
+	features[index].depth = (features[index].depth * fk1 + featureSum.depth) * fk2;
+#endif
+
+	const int pixel = toInt(color.x) |
+			(toInt(color.y) << 8) |
+			(toInt(color.z) << 16);
+	WritePixels(pixels, pixel, width, height, workOffset, workAmount, previewScale, scrX, scrY, index);
+
+	seedsInput[2 * index] = sampler.seed0;
+	seedsInput[2 * index + 1] = sampler.seed1;
+}
+
+__kernel void RadianceGPU(
+    ACCUMULATION_BUFFER *colors, __global unsigned int *seedsInput,
+#ifdef PARAM_SCENE_IMAGE
+	__read_only image2d_t sphereImage,
+#else
+	SCENE_BUFFER const Sphere *SCENE_RESTRICT sphere,
+#endif
+	OCL_CONSTANT_BUFFER const Camera *camera,
+	const unsigned int sphereCount,
+	const unsigned int width, const unsigned int height,
+	const unsigned int currentSample,
+	__global int *pixels,
+	const unsigned int workOffset,
+	const unsigned int workAmount,
+	const unsigned int samplesPerLaunch,
+	const unsigned int previewScale,
+	SCENE_BUFFER const Instance *SCENE_RESTRICT instances,
+	const unsigned int instanceCount,
+	SCENE_BUFFER const Sphere *SCENE_RESTRICT prototypeSpheres,
+	SCENE_BUFFER const Mesh *SCENE_RESTRICT meshes,
+	const unsigned int meshCount,
+	__global const ushort *meshVertices,
+	__global const unsigned int *meshIndices,
+	__global const MeshBVHNode *meshNodes,
+	const unsigned int frameWidth, const unsigned int frameHeight,
+	const unsigned int cropX, const unsigned int cropY,
+	__global const MeshBVHNode *instanceNodes
+#ifdef PARAM_REPROJECTION
+	, __global FirstHit *firstHits,
+	__global float *sampleCounts,
+	__global float *expectedDepths
+#endif
+#ifdef PARAM_DENOISE
+	, __global Feature *features
+#endif
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+	, __global const float *blueNoise
+#endif
+#ifdef PARAM_LOCAL_STAGING
+	, __local Sphere *localSpheres
+#endif
+#ifdef PARAM_PERSISTENT_THREADS
+	, __global volatile unsigned int *workCounter,
+	const unsigned int launchSize
+#endif
+	) {
+#ifdef PARAM_PERSISTENT_THREADS
+	__local unsigned int batchStart;
+#endif
+
+#ifdef PARAM_LOCAL_STAGING
+	/* Done before any work-item returns, all of them must reach the barrier */
+	unsigned int i;
+	for (i = get_local_id(0); i < sphereCount; i += get_local_size(0)) {
+#ifdef PARAM_SCENE_IMAGE
+		Sphere s;
+		ReadSphereImage(sphereImage, i, &s);
+		localSpheres[i] = s;
+#else
+		localSpheres[i] = sphere[i];
+#endif
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
+	Scene sceneData;
+#if defined(PARAM_LOCAL_STAGING)
+	sceneData.spheres = localSpheres;
+#elif !defined(PARAM_SCENE_IMAGE)
+	sceneData.spheres = sphere;
+#endif
+	sceneData.sphereCount = sphereCount;
+	sceneData.instances = instances;
+	sceneData.instanceCount = instanceCount;
+	sceneData.instanceNodes = instanceNodes;
+	sceneData.prototypeSpheres = prototypeSpheres;
+	sceneData.meshes = meshes;
+	sceneData.meshCount = meshCount;
+	sceneData.meshVertices = meshVertices;
+	sceneData.meshIndices = meshIndices;
+	sceneData.meshNodes = meshNodes;
+	const Scene *scene = &sceneData;
+
+#ifdef PARAM_PERSISTENT_THREADS
+	/* Only enough work-groups to fill the device are launched: each one takes
+	 * the next batch of work-items from the counter until the pass is done,
+	 * so that a group stuck on costly pixels does not hold the others. The
+	 * exit test is uniform across the group, as the barriers require. */
+	for (;;) {
+		if (get_local_id(0) == 0)
+			batchStart = atomic_add(workCounter, (unsigned int)get_local_size(0));
+		barrier(CLK_LOCAL_MEM_FENCE);
+		const unsigned int batch = batchStart;
+		/* All the work-items have read it before it is written again */
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		if (batch >= launchSize)
+			break;
+
+		const unsigned int gid = batch + get_local_id(0);
+#else
+	{
+		const unsigned int gid = get_global_id(0);
+#endif
+		RenderWorkItem(gid, SCENE_ARG, camera, colors, seedsInput, pixels,
+			width, height, currentSample, workOffset, workAmount, samplesPerLaunch, previewScale,
+			frameWidth, frameHeight, cropX, cropY
+#ifdef PARAM_REPROJECTION
+			, firstHits, sampleCounts, expectedDepths
+#endif
+#ifdef PARAM_DENOISE
+			, features
+#endif
+#ifdef PARAM_SAMPLER_BLUE_NOISE
+			, blueNoise
+#endif
+			);
+	}
+}
+
+#ifdef PARAM_DENOISE
+#ifdef PARAM_ACCUMULATION_COMPACT
+/* Samples per pixel of the compact accumulation read by DenoiseGPU */
+#ifdef PARAM_REPROJECTION
+#define DENOISE_SAMPLE_COUNT(i) sampleCounts[i]
+#else
+#define DENOISE_SAMPLE_COUNT(i) accumulatedSamples
+#endif
+
+static void LoadAccumulationMean(const ACCUMULATION_BUFFER *colors, const unsigned int index,
+		const float samples, Vec *c) {
+	LoadAccumulation(colors, index, c);
+	vsmul(*c, (samples > 0.f) ? (1.f / samples) : 0.f, *c);
+}
+#endif
+
+/* One iteration of the edge-avoiding a-trous filter (Dammertz et al. 2010)
+ * over the pixels of the device: 5x5 B3 spline taps spaced by step pixels,
+ * weighted by the color, normal, depth and albedo differences. Pixels out
+ * of the range of the device are skipped. The last iteration writes the
+ * pixels as well. With the compact accumulation, the first iteration reads
+ * it instead of input, divided by the samples per pixel (accumulatedSamples,
+ * or sampleCounts with the reprojection). */
+__kernel void DenoiseGPU(
+	__global const Vec *input, __global Vec *output,
+	__global const Feature *features,
+	const unsigned int width, const unsigned int height,
+	const unsigned int workOffset, const unsigned int workAmount,
+	const unsigned int step, const float colorPhi,
+	__global int *pixels, const unsigned int writePixels
+#ifdef PARAM_ACCUMULATION_COMPACT
+	, const ACCUMULATION_BUFFER *accumulation,
+	const unsigned int fromAccumulation,
+	const float accumulatedSamples
+#ifdef PARAM_REPROJECTION
+	, __global const float *sampleCounts
+#endif
+#endif
+	) {
+	const unsigned int index = get_global_id(0);
+	if (index >= workAmount)
+		return;
+
+	const unsigned int workEnd = workOffset + workAmount;
+	const int px = (workOffset + index) % width;
+	const int py = (workOffset + index) / width;
+
+	Vec cp;
+#ifdef PARAM_ACCUMULATION_COMPACT
+	if (fromAccumulation)
+		LoadAccumulationMean(accumulation, index, DENOISE_SAMPLE_COUNT(index), &cp);
+	else
+#endif
+		vassign(cp, input[index]);
+	const Feature fp = features[index];
+	const float kernelWeights[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+	Vec sum; vclr(sum);
+	float weightSum = 0.f;
+	int dy, dx;
+	for (dy = -2; dy <= 2; ++dy) {
+		const int qy = py + dy * (int)step;
+		if ((qy < 0) || (qy >= (int)height))
+			continue;
+
+		for (dx = -2; dx <= 2; ++dx) {
+			const int qx = px + dx * (int)step;
+			if ((qx < 0) || (qx >= (int)width))
+				continue;
+
+			const unsigned int q = qy * width + qx;
+			if ((q < workOffset) || (q >= workEnd))
+				continue;
+
+			Vec cq;
+#ifdef PARAM_ACCUMULATION_COMPACT
+			if (fromAccumulation)
+				LoadAccumulationMean(accumulation, q - workOffset, DENOISE_SAMPLE_COUNT(q - workOffset), &cq);
+			else
+#endif
+				vassign(cq, input[q - workOffset]);
+			const Feature fq = features[q - workOffset];
+
+			Vec d;
+			vsub(d, cp, cq);
+			const float wColor = exp(-vdot(d, d) / colorPhi);
+
+			const float wNormal = pow(max(0.f, vdot(fp.normal, fq.normal)), DENOISE_NORMAL_POWER);
 
-	pixels[gid] = toInt(colors[gid].x) |
-			(toInt(colors[gid].y) << 8) |
-			(toInt(colors[gid].z) << 16);
+			const float dist = (float)(step * max(abs(dx), abs(dy)));
+			const float wDepth = exp(-fabs(fp.depth - fq.depth) / (DENOISE_DEPTH_SIGMA * dist * fp.depth + 1e-4f));
 
-	seedsInput[2 * gid] = seed0;
-	seedsInput[2 * gid + 1] = seed1;
+			vsub(d, fp.albedo, fq.albedo);
+			const float wAlbedo = exp(-vdot(d, d) / (DENOISE_ALBEDO_SIGMA * DENOISE_ALBEDO_SIGMA));
+
+			const float w = kernelWeights[abs(dx)] * kernelWeights[abs(dy)] *
+					wColor * wNormal * wDepth * wAlbedo;
+			Vec c;
+			vsmul(c, w, cq);
+			vadd(sum, sum, c);
+			weightSum += w;
+		}
+	}
+
+	Vec result;
+	if (weightSum > 0.f) {
+		vsmul(result, 1.f / weightSum, sum);
+	} else {
+		vassign(result, cp);
+	}
+	output[index] = result;
+
+	if (writePixels)
+		pixels[index] = toInt(result.x) | (toInt(result.y) << 8) | (toInt(result.z) << 16);
 }
+#endif
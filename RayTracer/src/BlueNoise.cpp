@@ -0,0 +1,132 @@
+#include <cmath>
+#include <random>
+#include <algorithm>
+
+#include "BlueNoise.hpp"
+
+
+namespace {
+
+// Binary pattern with the gaussian energy of its ones at every pixel
+class EnergyField {
+
+public:
+	EnergyField(const unsigned int s, const float sigma) : size(s), kernel(s * s), energy(s * s, 0.f), pattern(s * s, 0) {
+		// Toroidal distances, so the tile wraps without seams
+		for (unsigned int y = 0; y < size; ++y) {
+			for (unsigned int x = 0; x < size; ++x) {
+				const float dx = static_cast<float>(std::min(x, size - x));
+				const float dy = static_cast<float>(std::min(y, size - y));
+				kernel[y * size + x] = std::exp(-(dx * dx + dy * dy) / (2.f * sigma * sigma));
+			}
+		}
+	}
+
+	void Set(const unsigned int p, const unsigned char value) {
+		if (pattern[p] == value)
+			return;
+
+		pattern[p] = value;
+		const float sign = value ? 1.f : -1.f;
+		const unsigned int px = p % size;
+		const unsigned int py = p / size;
+		for (unsigned int y = 0; y < size; ++y) {
+			const unsigned int ky = ((y + size - py) % size) * size;
+			for (unsigned int x = 0; x < size; ++x)
+				energy[y * size + x] += sign * kernel[ky + (x + size - px) % size];
+		}
+	}
+
+	bool Get(const unsigned int p) const {
+		return pattern[p] != 0;
+	}
+
+	// The one with the highest energy
+	unsigned int TightestCluster() const {
+		unsigned int best = 0;
+		float bestEnergy = -1e30f;
+		for (unsigned int p = 0; p < pattern.size(); ++p) {
+			if (pattern[p] && (energy[p] > bestEnergy)) {
+				bestEnergy = energy[p];
+				best = p;
+			}
+		}
+
+		return best;
+	}
+
+	// The zero with the lowest energy
+	unsigned int LargestVoid() const {
+		unsigned int best = 0;
+		float bestEnergy = 1e30f;
+		for (unsigned int p = 0; p < pattern.size(); ++p) {
+			if (!pattern[p] && (energy[p] < bestEnergy)) {
+				bestEnergy = energy[p];
+				best = p;
+			}
+		}
+
+		return best;
+	}
+
+private:
+	unsigned int size;
+	std::vector<float> kernel;
+	std::vector<float> energy;
+	std::vector<unsigned char> pattern;
+};
+
+}
+
+std::vector<float> MakeBlueNoiseTile(const unsigned int size, const unsigned int seed) {
+	const unsigned int pixelCount = size * size;
+	const float sigma = 1.5f;
+
+	// Initial pattern: 10% random ones, then the tightest cluster is moved
+	// to the largest void until it does not move anymore
+	EnergyField initial(size, sigma);
+	std::mt19937 rng(seed);
+	const unsigned int initialOnes = std::max(1u, pixelCount / 10);
+	for (unsigned int ones = 0; ones < initialOnes; ) {
+		const unsigned int p = rng() % pixelCount;
+		if (!initial.Get(p)) {
+			initial.Set(p, 1);
+			++ones;
+		}
+	}
+
+	for (unsigned int i = 0; i < pixelCount; ++i) {
+		const unsigned int cluster = initial.TightestCluster();
+		initial.Set(cluster, 0);
+		const unsigned int hole = initial.LargestVoid();
+		initial.Set(hole, 1);
+		if (hole == cluster)
+			break;
+	}
+
+	std::vector<unsigned int> rank(pixelCount, 0);
+
+	// Ranks of the initial ones: removed from the tightest cluster down
+	EnergyField field = initial;
+	for (unsigned int ones = initialOnes; ones > 0; --ones) {
+		const unsigned int cluster = field.TightestCluster();
+		field.Set(cluster, 0);
+		rank[cluster] = ones - 1;
+	}
+
+	// Ranks of the other pixels: filled into the largest void up. With the
+	// energy of the ones, the largest void is also the tightest cluster of
+	// the zeros, so both halves of the original method are the same loop.
+	field = initial;
+	for (unsigned int ones = initialOnes; ones < pixelCount; ++ones) {
+		const unsigned int hole = field.LargestVoid();
+		field.Set(hole, 1);
+		rank[hole] = ones;
+	}
+
+	std::vector<float> tile(pixelCount);
+	for (unsigned int p = 0; p < pixelCount; ++p)
+		tile[p] = (rank[p] + .5f) / pixelCount;
+
+	return tile;
+}
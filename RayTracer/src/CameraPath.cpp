@@ -0,0 +1,123 @@
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+
+#include "CameraPath.hpp"
+
+
+bool CameraPath::Load(const std::string& fileName, const unsigned int sceneSphereCount) {
+	FILE *f = fopen(fileName.c_str(), "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open camera path: %s\n", fileName.c_str());
+		return false;
+	}
+
+	cameraKeys.clear();
+	sphereKeys.assign(sceneSphereCount, std::vector<Key>());
+	frameCount = 0;
+
+	char keyword[32];
+	int line = 0;
+	while (fscanf(f, "%31s", keyword) == 1) {
+		++line;
+		Key key;
+
+		if (keyword[0] == '#') {
+			int ch;
+			while (((ch = fgetc(f)) != '\n') && (ch != EOF))
+				;
+			continue;
+		} else if (strcmp(keyword, "camera") == 0) {
+			const int c = fscanf(f, "%u  %f %f %f  %f %f %f\n", &key.frame,
+				&key.a.x, &key.a.y, &key.a.z, &key.b.x, &key.b.y, &key.b.z);
+			if (c != 7) {
+				fprintf(stderr, "Failed to read camera key #%d of %s: %d\n", line, fileName.c_str(), c);
+				fclose(f);
+				return false;
+			}
+
+			cameraKeys.push_back(key);
+		} else if (strcmp(keyword, "sphere") == 0) {
+			unsigned int index;
+			const int c = fscanf(f, "%u %u  %f %f %f\n", &key.frame, &index, &key.a.x, &key.a.y, &key.a.z);
+			if ((c != 5) || (index >= sceneSphereCount)) {
+				fprintf(stderr, "Failed to read sphere key #%d of %s: %d\n", line, fileName.c_str(), c);
+				fclose(f);
+				return false;
+			}
+
+			sphereKeys[index].push_back(key);
+		} else {
+			fprintf(stderr, "Unknown keyword in %s: %s\n", fileName.c_str(), keyword);
+			fclose(f);
+			return false;
+		}
+
+		frameCount = std::max(frameCount, key.frame + 1);
+	}
+	fclose(f);
+
+	if (cameraKeys.empty()) {
+		fprintf(stderr, "No camera key in %s\n", fileName.c_str());
+		return false;
+	}
+
+	auto byFrame = [](const Key& k0, const Key& k1) { return k0.frame < k1.frame; };
+	std::stable_sort(cameraKeys.begin(), cameraKeys.end(), byFrame);
+	for (size_t i = 0; i < sphereKeys.size(); ++i)
+		std::stable_sort(sphereKeys[i].begin(), sphereKeys[i].end(), byFrame);
+
+	fprintf(stderr, "Camera path: %u frames, %d camera keys\n", frameCount, (int)cameraKeys.size());
+
+	return true;
+}
+
+unsigned int CameraPath::GetFrameCount() const {
+	return frameCount;
+}
+
+void CameraPath::Interpolate(const std::vector<Key>& keys, const unsigned int frame, Vec *a, Vec *b) {
+	if (frame <= keys.front().frame) {
+		*a = keys.front().a;
+		*b = keys.front().b;
+		return;
+	}
+
+	for (size_t i = 1; i < keys.size(); ++i) {
+		if (frame <= keys[i].frame) {
+			const Key& k0 = keys[i - 1];
+			const Key& k1 = keys[i];
+			const float t = static_cast<float>(frame - k0.frame) / static_cast<float>(k1.frame - k0.frame);
+
+			*a = k0.a + (k1.a - k0.a) * t;
+			*b = k0.b + (k1.b - k0.b) * t;
+			return;
+		}
+	}
+
+	*a = keys.back().a;
+	*b = keys.back().b;
+}
+
+void CameraPath::GetCamera(const unsigned int frame, Camera *camera) const {
+	Interpolate(cameraKeys, frame, &camera->orig, &camera->target);
+}
+
+void CameraPath::GetSpheres(const unsigned int frame, Sphere *spheres) const {
+	for (size_t i = 0; i < sphereKeys.size(); ++i) {
+		if (sphereKeys[i].empty())
+			continue;
+
+		Vec unused;
+		Interpolate(sphereKeys[i], frame, &spheres[i].p, &unused);
+	}
+}
+
+bool CameraPath::HasSphereKeys() const {
+	for (size_t i = 0; i < sphereKeys.size(); ++i) {
+		if (!sphereKeys[i].empty())
+			return true;
+	}
+
+	return false;
+}
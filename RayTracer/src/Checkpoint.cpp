@@ -0,0 +1,195 @@
+#include <cstdio>
+#include <cstring>
+
+#include <iostream>
+
+#include "Checkpoint.hpp"
+
+
+static const char kCheckpointMagic[4] = { 'R', 'T', 'C', 'P' };
+static const unsigned int kCheckpointVersion = 1;
+
+
+bool CheckpointKey::operator==(const CheckpointKey& other) const {
+	return (sceneHash == other.sceneHash) && (width == other.width) && (height == other.height) &&
+		(memcmp(camera, other.camera, sizeof(camera)) == 0);
+}
+
+bool CheckpointKey::operator!=(const CheckpointKey& other) const {
+	return !(*this == other);
+}
+
+
+uint64_t HashBytes(const void *data, const size_t size, uint64_t hash) {
+	// FNV-1a
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+
+	return hash;
+}
+
+uint64_t HashScene(const Sphere *spheres, const unsigned int sphereCount) {
+	return HashBytes(spheres, sizeof(Sphere) * sphereCount);
+}
+
+CheckpointKey MakeCheckpointKey(const Sphere *spheres, const unsigned int sphereCount,
+	const Camera *camera, const unsigned int width, const unsigned int height) {
+
+	CheckpointKey key;
+	memset(&key, 0, sizeof(key));
+
+	key.sceneHash = HashScene(spheres, sphereCount);
+	key.camera[0] = camera->orig.x;
+	key.camera[1] = camera->orig.y;
+	key.camera[2] = camera->orig.z;
+	key.camera[3] = camera->target.x;
+	key.camera[4] = camera->target.y;
+	key.camera[5] = camera->target.z;
+	key.width = width;
+	key.height = height;
+
+	return key;
+}
+
+
+bool SaveCheckpoint(const std::string& fileName, const CheckpointData& data) {
+	const size_t pixelCount = data.key.width * data.key.height;
+	if ((data.colors.size() != pixelCount) || (data.seeds.size() != 2 * pixelCount))
+		return false;
+
+	// Write to a temporary file first, then rename it over the old checkpoint
+	const std::string tmpFileName = fileName + ".tmp";
+
+	FILE *f = fopen(tmpFileName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open checkpoint file: %s\n", tmpFileName.c_str());
+		return false;
+	}
+
+	bool ok = (fwrite(kCheckpointMagic, sizeof(kCheckpointMagic), 1, f) == 1) &&
+		(fwrite(&kCheckpointVersion, sizeof(kCheckpointVersion), 1, f) == 1) &&
+		(fwrite(&data.key, sizeof(data.key), 1, f) == 1) &&
+		(fwrite(&data.currentSample, sizeof(data.currentSample), 1, f) == 1) &&
+		(fwrite(data.colors.data(), sizeof(Vec), pixelCount, f) == pixelCount) &&
+		(fwrite(data.seeds.data(), sizeof(unsigned int), 2 * pixelCount, f) == 2 * pixelCount);
+
+	ok = (fclose(f) == 0) && ok;
+	if (!ok) {
+		fprintf(stderr, "Failed to write checkpoint file: %s\n", tmpFileName.c_str());
+		remove(tmpFileName.c_str());
+		return false;
+	}
+
+#ifdef _WIN32
+	// rename() does not replace an existing file on Windows
+	remove(fileName.c_str());
+#endif
+
+	if (rename(tmpFileName.c_str(), fileName.c_str()) != 0) {
+		fprintf(stderr, "Failed to rename checkpoint file: %s\n", tmpFileName.c_str());
+		return false;
+	}
+
+	return true;
+}
+
+bool LoadCheckpoint(const std::string& fileName, const CheckpointKey& key, CheckpointData *data) {
+	FILE *f = fopen(fileName.c_str(), "rb");
+	if (!f) {
+		fprintf(stderr, "No checkpoint to resume from: %s\n", fileName.c_str());
+		return false;
+	}
+
+	char magic[4];
+	unsigned int version;
+	bool ok = (fread(magic, sizeof(magic), 1, f) == 1) && (memcmp(magic, kCheckpointMagic, sizeof(magic)) == 0) &&
+		(fread(&version, sizeof(version), 1, f) == 1) && (version == kCheckpointVersion) &&
+		(fread(&data->key, sizeof(data->key), 1, f) == 1);
+
+	if (!ok) {
+		fprintf(stderr, "Invalid checkpoint file: %s\n", fileName.c_str());
+		fclose(f);
+		return false;
+	}
+
+	if (data->key != key) {
+		fprintf(stderr, "Checkpoint %s belongs to a different scene, camera or resolution\n", fileName.c_str());
+		fclose(f);
+		return false;
+	}
+
+	const size_t pixelCount = key.width * key.height;
+	data->colors.resize(pixelCount);
+	data->seeds.resize(2 * pixelCount);
+
+	ok = (fread(&data->currentSample, sizeof(data->currentSample), 1, f) == 1) &&
+		(fread(data->colors.data(), sizeof(Vec), pixelCount, f) == pixelCount) &&
+		(fread(data->seeds.data(), sizeof(unsigned int), 2 * pixelCount, f) == 2 * pixelCount);
+
+	fclose(f);
+
+	if (!ok)
+		fprintf(stderr, "Truncated checkpoint file: %s\n", fileName.c_str());
+
+	return ok;
+}
+
+
+CheckpointWriter::CheckpointWriter(const std::string& checkpointFileName) :
+	fileName(checkpointFileName) {
+
+	writerThread = new std::thread(CheckpointWriter::WriterThread, this);
+}
+
+CheckpointWriter::~CheckpointWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cond.notify_all();
+
+	// The pending checkpoint (if any) is flushed before the thread exits
+	writerThread->join();
+	delete writerThread;
+}
+
+void CheckpointWriter::Submit(CheckpointData *data) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (pending)
+			delete pending;
+
+		pending = data;
+	}
+	cond.notify_all();
+}
+
+const std::string& CheckpointWriter::GetFileName() const {
+	return fileName;
+}
+
+void CheckpointWriter::WriterThread(CheckpointWriter *writer) {
+	while (true) {
+		CheckpointData *data = nullptr;
+
+		{
+			std::unique_lock<std::mutex> lock(writer->mtx);
+			while (!writer->pending && !writer->stop)
+				writer->cond.wait(lock);
+
+			if (!writer->pending)
+				return;
+
+			data = writer->pending;
+			writer->pending = nullptr;
+		}
+
+		if (SaveCheckpoint(writer->fileName, *data))
+			std::cerr << "Checkpoint saved: " << writer->fileName << " (pass " << data->currentSample << ")" << std::endl;
+
+		delete data;
+	}
+}
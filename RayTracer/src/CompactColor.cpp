@@ -0,0 +1,43 @@
+#include <algorithm>
+#include <cmath>
+
+#include "CompactColor.hpp"
+
+
+static const int kMantissaBits = 19;
+static const uint64_t kMantissaMask = (1u << kMantissaBits) - 1;
+static const int kExponentBias = 64;
+
+
+static uint64_t PackMantissa(const float v, const float scale) {
+	const float m = std::floor(std::max(v * scale, 0.f) + .5f);
+	return static_cast<uint64_t>(std::min(m, static_cast<float>(kMantissaMask)));
+}
+
+uint64_t PackCompactColor(const Vec &sum) {
+	const float maxc = std::max(sum.x, std::max(sum.y, sum.z));
+	if (!(maxc > 0.f))
+		return 0;
+
+	// The largest channel sets the exponent: maxc < 2^e
+	int e;
+	std::frexp(maxc, &e);
+	e = std::min(std::max(e + kExponentBias, 1), 127);
+	const float scale = std::ldexp(1.f, kMantissaBits + kExponentBias - e);
+
+	return PackMantissa(sum.x, scale) |
+		(PackMantissa(sum.y, scale) << kMantissaBits) |
+		(PackMantissa(sum.z, scale) << (2 * kMantissaBits)) |
+		(static_cast<uint64_t>(e) << (3 * kMantissaBits));
+}
+
+Vec UnpackCompactColor(const uint64_t packed) {
+	const int e = static_cast<int>(packed >> (3 * kMantissaBits));
+	if (e == 0)
+		return Vec();
+
+	const float scale = std::ldexp(1.f, e - kExponentBias - kMantissaBits);
+	return Vec((packed & kMantissaMask) * scale,
+		((packed >> kMantissaBits) & kMantissaMask) * scale,
+		((packed >> (2 * kMantissaBits)) & kMantissaMask) * scale);
+}
@@ -1,37 +1,51 @@
 
 #include <fstream>
 #include <string>
+#include <algorithm>
+#include <random>
 
 #include <iostream>
 
 #include "ComputingUnit.hpp"
+#include "ThreadAffinity.hpp"
+#include "CompactColor.hpp"
 
-ComputingUnit::ComputingUnit(const cl::Device &dev, const std::string& kernelFileName,
+// Enough resident work-groups to hide the memory latency of a compute unit
+const unsigned int ComputingUnit::kPersistentGroupsPerComputeUnit = 4;
+
+ComputingUnit::ComputingUnit(PlatformContext *sharedContext, const cl::Device &dev,
+	const std::string& kernelFileName,
+	const RenderOptions& options,
 	const unsigned int forceGPUWorkSize,
-	Camera *camera, Sphere *spheres,
 	const unsigned int sceneSphereCount,
-	Barrier *startBarrier, Barrier *endBarrier) :
-	renderThread(nullptr), threadStartBarrier(startBarrier), threadEndBarrier(endBarrier),
+	Barrier *startBarrier, Barrier *endBarrier,
+	const int numaNode) :
+	renderOptions(options), platformContext(sharedContext), renderThread(nullptr), threadStartBarrier(startBarrier), threadEndBarrier(endBarrier),
 	sphereCount(sceneSphereCount), colorBuffer(nullptr), pixelBuffer(nullptr), seedBuffer(nullptr),
 	pixels(nullptr), colors(nullptr), seeds(nullptr), exeUnitCount(0.0), exeTime(0.0) {
 
 	deviceName = dev.getInfo<CL_DEVICE_NAME >().c_str();
 
+	if (numaNode >= 0) {
+		deviceName += " (NUMA " + std::to_string(numaNode) + ")";
+
+		if (!GetNumaNodeCpus(numaNode, &numaCpus))
+			std::cerr << "[Device::" << deviceName << "] Unable to read the CPUs of the node, the thread is not pinned" << std::endl;
+	}
+
 
-	// Allocate a context with the selected device
-	cl::Platform platform = dev.getInfo<CL_DEVICE_PLATFORM>();
-	VECTOR_CLASS<cl::Device> devices;
-	devices.push_back(dev);
-	cl_context_properties cps[3] = {
-		CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0
-	};
-	context = cl::Context(devices, cps);
+	// The context is shared with the other devices of the platform
+	context = platformContext->GetContext();
 
 	// Allocate the queue for the device
 	cl_command_queue_properties prop = CL_QUEUE_PROFILING_ENABLE;
 	queue = cl::CommandQueue(context, dev, prop);
 
 
+	sceneStorage = ChooseSceneStorage(dev);
+	localStaging = renderOptions.localStaging && CanStageSpheres(dev);
+	deviceDenoise = renderOptions.denoise && renderOptions.tiledOutput.empty();
+
 	std::cerr << "Create the kernel" << std::endl;
 
 	// Create the kernel
@@ -39,30 +53,15 @@ ComputingUnit::ComputingUnit(const cl::Device &dev, const std::string& kernelFil
 
 	std::cerr << "Compile the source" << std::endl;
 
-	// Compile sources
-	cl::Program::Sources source(1, std::make_pair(src.c_str(), src.length()));
-	cl::Program program = cl::Program(context, source);
-
-	std::cerr << "Build" << std::endl;
-
-	try {
-		std::vector<cl::Device> buildDevice;
-		buildDevice.push_back(dev);
-		program.build(buildDevice, "-I.");
-
-		std::string result = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-		std::cerr << "[Device::" << deviceName << "]" << " Compilation result: " << result.c_str() << std::endl;
-
-	} catch (cl::Error e) {
-
-		std::string strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
-		std::cerr << "[Device::" << deviceName << "]" << " Compilation error:" << std::endl << strError.c_str() << std::endl;
+	BuildKernels(dev, src);
 
-		throw e;
+	// The local memory the built kernel uses by itself is only known now: the
+	// staged spheres may not fit next to it
+	if (localStaging && !CanLaunchStaged(dev, forceGPUWorkSize)) {
+		localStaging = false;
+		BuildKernels(dev, src);
 	}
 
-	kernel = cl::Kernel(program, "RadianceGPU");
-
 	kernel.getWorkGroupInfo<size_t>(dev, CL_KERNEL_WORK_GROUP_SIZE, &workGroupSize);
 	std::cerr << "[Device::" << deviceName << "]" << " Suggested work group size: " << workGroupSize << std::endl;
 
@@ -72,19 +71,40 @@ ComputingUnit::ComputingUnit(const cl::Device &dev, const std::string& kernelFil
 		std::cerr << "[Device::" << deviceName << "]" << " Forced work group size: " << workGroupSize << std::endl;
 	}
 
-	// Create the thread for rendering
-	renderThread = new std::thread(std::bind(ComputingUnit::RenderThread, this));
-
-	// Create camera buffer
-	cameraBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-		sizeof(Camera), camera);
+	if (localStaging) {
+		// Each work-group loads all the spheres: the wider the group, the
+		// fewer loads per work-item. The number of work-groups resident on a
+		// compute unit is bounded by the local memory.
+		const size_t stagedSize = sizeof(Sphere) * sphereCount;
+		const cl_ulong localSize = dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+		std::cerr << "[Device::" << deviceName << "] Local staging: " << (stagedSize / 1024) << "Kb per work-group, " <<
+			((sphereCount + workGroupSize - 1) / workGroupSize) << " sphere load(s) per work-item, at most " <<
+			(localSize / stagedSize) << " work-group(s) per compute unit" << std::endl;
+	}
 
-	std::cerr << "[Device::" << deviceName << "] CameraBuffer size: " << (sizeof(Camera) / 1024) << "Kb" << std::endl;
+	if (renderOptions.persistentThreads) {
+		persistentGroupCount = dev.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() * kPersistentGroupsPerComputeUnit;
+		workCounterBuffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint));
+		std::cerr << "[Device::" << deviceName << "] Persistent threads: " << persistentGroupCount <<
+			" work-group(s) of " << workGroupSize << std::endl;
+	}
 
-	sphereBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR,
-		sizeof(Sphere) * sphereCount, spheres);
+	if (sceneStorage == SCENE_STORAGE_IMAGE)
+		sphereImage = platformContext->GetSphereImage();
+	if (renderOptions.sampler == SAMPLER_BLUE_NOISE)
+		blueNoiseBuffer = platformContext->GetBlueNoiseBuffer();
+	instanceBuffer = platformContext->GetInstanceBuffer();
+	instanceNodeBuffer = platformContext->GetInstanceNodeBuffer();
+	prototypeSphereBuffer = platformContext->GetPrototypeSphereBuffer();
+	instanceCount = platformContext->GetInstanceCount();
+	meshBuffer = platformContext->GetMeshBuffer();
+	meshVertexBuffer = platformContext->GetMeshVertexBuffer();
+	meshIndexBuffer = platformContext->GetMeshIndexBuffer();
+	meshNodeBuffer = platformContext->GetMeshNodeBuffer();
+	meshCount = platformContext->GetMeshCount();
 
-	std::cerr << "[Device::" << deviceName << "] SceneBuffer size: " << (sizeof(Sphere) * sphereCount / 1024) << "Kb" << std::endl;
+	// Create the thread for rendering
+	renderThread = new std::thread(std::bind(ComputingUnit::RenderThread, this));
 }
 
 
@@ -101,6 +121,8 @@ ComputingUnit::~ComputingUnit() {
 
 	if (colors)
 		delete[] colors;
+	if (compactColors)
+		delete[] compactColors;
 	if (seeds)
 		delete[] seeds;
 
@@ -124,26 +146,256 @@ std::string ComputingUnit::ReadSources(const std::string &fileName) {
 	return program;
 }
 
-void ComputingUnit::SetArgs(const unsigned int count) {
+SceneStorage ComputingUnit::ChooseSceneStorage(const cl::Device& dev) const {
+	// The kernel has 5 __constant arguments: camera, spheres, instances,
+	// prototype spheres and mesh table. They must fit together.
+	const size_t sceneSize = platformContext->GetConstantSceneSize();
+	const cl_ulong constantSize = dev.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>();
+	const cl_uint constantArgs = dev.getInfo<CL_DEVICE_MAX_CONSTANT_ARGS>();
+	const bool fitsConstant = (sceneSize <= constantSize) && (constantArgs >= 5);
+
+	SceneStorage storage = renderOptions.sceneStorage;
+	if (storage == SCENE_STORAGE_IMAGE) {
+		const bool imageSupport = dev.getInfo<CL_DEVICE_IMAGE_SUPPORT>() &&
+			(dev.getInfo<CL_DEVICE_IMAGE2D_MAX_WIDTH>() >= platformContext->GetSphereImageWidth()) &&
+			(dev.getInfo<CL_DEVICE_IMAGE2D_MAX_HEIGHT>() >= platformContext->GetSphereImageHeight());
+		if (!imageSupport) {
+			std::cerr << "[Device::" << deviceName << "] No image support for the scene, ignoring the image storage" << std::endl;
+			storage = SCENE_STORAGE_AUTO;
+		}
+	} else if ((storage == SCENE_STORAGE_CONSTANT) && !fitsConstant) {
+		std::cerr << "[Device::" << deviceName << "] The scene does not fit the constant memory, ignoring the constant storage" << std::endl;
+		storage = SCENE_STORAGE_AUTO;
+	}
+
+	if (storage == SCENE_STORAGE_AUTO)
+		storage = fitsConstant ? SCENE_STORAGE_CONSTANT : SCENE_STORAGE_GLOBAL;
+
+	static const char *storageNames[] = { "auto", "constant", "global", "image" };
+	std::cerr << "[Device::" << deviceName << "] Scene storage: " << storageNames[storage] <<
+		" (scene " << (sceneSize / 1024) << "Kb, constant memory " << (constantSize / 1024) << "Kb, " <<
+		constantArgs << " constant args)" << std::endl;
+
+	return storage;
+}
+
+void ComputingUnit::BuildKernels(const cl::Device& dev, const std::string& src) {
+	// Compile sources
+	cl::Program::Sources source(1, std::make_pair(src.c_str(), src.length()));
+	cl::Program program = cl::Program(context, source);
+
+	std::cerr << "Build" << std::endl;
+
+	try {
+		std::vector<cl::Device> buildDevice;
+		buildDevice.push_back(dev);
+		const std::string buildOptions = GetBuildOptions();
+		std::cerr << "[Device::" << deviceName << "]" << " Build options: " << buildOptions << std::endl;
+
+		program.build(buildDevice, buildOptions.c_str());
+
+		std::string result = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
+		std::cerr << "[Device::" << deviceName << "]" << " Compilation result: " << result.c_str() << std::endl;
+
+	} catch (cl::Error e) {
+
+		std::string strError = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(dev);
+		std::cerr << "[Device::" << deviceName << "]" << " Compilation error:" << std::endl << strError.c_str() << std::endl;
+
+		throw e;
+	}
+
+	kernel = cl::Kernel(program, "RadianceGPU");
+	if (deviceDenoise)
+		denoiseKernel = cl::Kernel(program, "DenoiseGPU");
+}
+
+bool ComputingUnit::CanStageSpheres(const cl::Device& dev) const {
+	if (sphereCount == 0)
+		return false;
+
+	const size_t stagedSize = sizeof(Sphere) * sphereCount;
+	const cl_ulong localSize = dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	if (stagedSize > localSize) {
+		std::cerr << "[Device::" << deviceName << "] The spheres (" << (stagedSize / 1024) << "Kb) do not fit the local memory (" <<
+			(localSize / 1024) << "Kb), local staging disabled" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+bool ComputingUnit::CanLaunchStaged(const cl::Device& dev, const unsigned int forceGPUWorkSize) const {
+	// Static __local variables (the batch of the persistent threads) count
+	// as well, the staging argument is not set yet
+	const cl_ulong kernelLocalSize = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(dev);
+	const cl_ulong localSize = dev.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+	const size_t stagedSize = sizeof(Sphere) * sphereCount;
+	if (kernelLocalSize + stagedSize > localSize) {
+		std::cerr << "[Device::" << deviceName << "] The spheres (" << (stagedSize / 1024) << "Kb) and the kernel (" <<
+			(kernelLocalSize / 1024) << "Kb) do not fit the local memory (" << (localSize / 1024) <<
+			"Kb), local staging disabled" << std::endl;
+		return false;
+	}
+
+	// The work-group size the staged kernel can be launched with
+	const size_t maxGroupSize = kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(dev);
+	const bool forced = (forceGPUWorkSize > 0) && (dev.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_GPU);
+	if ((maxGroupSize == 0) || (forced && (forceGPUWorkSize > maxGroupSize))) {
+		std::cerr << "[Device::" << deviceName << "] The staged kernel allows work-groups of " << maxGroupSize <<
+			" only, local staging disabled" << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+std::string ComputingUnit::GetBuildOptions() const {
+	std::string buildOptions = "-I.";
+
+	if (sceneStorage == SCENE_STORAGE_GLOBAL)
+		buildOptions += " -DPARAM_SCENE_GLOBAL";
+	else if (sceneStorage == SCENE_STORAGE_IMAGE)
+		buildOptions += " -DPARAM_SCENE_IMAGE -DSCENE_IMAGE_SPHERES_PER_ROW=" +
+			std::to_string(PlatformContext::kSphereImageRowSpheres);
+
+	if (localStaging)
+		buildOptions += " -DPARAM_LOCAL_STAGING";
+
+	if (renderOptions.sampler == SAMPLER_SOBOL)
+		buildOptions += " -DPARAM_SAMPLER_SOBOL";
+	else if (renderOptions.sampler == SAMPLER_BLUE_NOISE)
+		buildOptions += " -DPARAM_SAMPLER_SOBOL -DPARAM_SAMPLER_BLUE_NOISE -DBLUE_NOISE_SIZE=" +
+			std::to_string(PlatformContext::kBlueNoiseSize);
+
+	if (renderOptions.denoise)
+		buildOptions += " -DPARAM_DENOISE";
+
+	if (renderOptions.reprojection)
+		buildOptions += " -DPARAM_REPROJECTION";
+
+	if (renderOptions.persistentThreads)
+		buildOptions += " -DPARAM_PERSISTENT_THREADS";
+
+	if (renderOptions.accumulation == ACCUMULATION_COMPACT)
+		buildOptions += " -DPARAM_ACCUMULATION_COMPACT";
+
+	return buildOptions;
+}
+
+void ComputingUnit::SetArgs(const unsigned int count, const unsigned int samples,
+	const unsigned int scale) {
 	currentSample = count;
+	samplesPerLaunch = samples;
+	previewScale = scale;
 }
 
 void ComputingUnit::RenderThread(ComputingUnit *computingItem) {
+	if (!computingItem->numaCpus.empty() && !PinCurrentThread(computingItem->numaCpus))
+		std::cerr << "[Device::" << computingItem->GetDeviceName() << "] Unable to pin the render thread" << std::endl;
+
 	try {
 		while (true) {
 			computingItem->threadStartBarrier->wait();
 
-			computingItem->SetKernelArgs();
-			computingItem->ExecuteKernel();
-			computingItem->ReadPixelBuffer();
-			computingItem->FinishExecuteKernel();
+			if (computingItem->IsStopping())
+				break;
+
+			if (computingItem->readbackOnly) {
+				computingItem->ReadPixelBuffer();
+			} else {
+				computingItem->SetKernelArgs();
+				computingItem->ExecuteKernel();
+				computingItem->ReadPixelBuffer();
+				computingItem->FinishExecuteKernel();
+			}
 			computingItem->Finish();
 
+			if (!computingItem->EndPass())
+				break;
+
 			computingItem->threadEndBarrier->wait();
 		}
 	} catch (cl::Error e) {
 		std::cerr << "[Device::" << computingItem->GetDeviceName() << "] ERROR: " << e.what() << "(" << e.err() << ")" << std::endl;
+		computingItem->Fail(std::string(e.what()) + " (" + std::to_string(e.err()) + ")");
 	}
+
+	std::lock_guard<std::mutex> lock(computingItem->stateMutex);
+	computingItem->threadDone = true;
+}
+
+void ComputingUnit::BeginPass() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	passDone = false;
+}
+
+bool ComputingUnit::EndPass() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	if (failed)
+		return false;
+
+	// The readback is complete
+	passDone = true;
+	pendingPixels = nullptr;
+	return true;
+}
+
+void ComputingUnit::Fail(const std::string& reason) {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	if (failed)
+		return;
+
+	failed = true;
+	failure = reason;
+
+	// The unit is between the two barriers
+	threadStartBarrier->leave();
+	threadEndBarrier->leave();
+}
+
+bool ComputingUnit::GiveUp(const std::string& reason) {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	if (failed || passDone)
+		return false;
+
+	failed = true;
+	failure = reason;
+
+	threadStartBarrier->leave();
+	threadEndBarrier->leave();
+
+	return true;
+}
+
+void ComputingUnit::Stop() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	stopping = true;
+}
+
+bool ComputingUnit::IsStopping() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return stopping;
+}
+
+bool ComputingUnit::IsThreadDone() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return threadDone;
+}
+
+unsigned int *ComputingUnit::GetPendingPixelTarget() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return pendingPixels;
+}
+
+bool ComputingUnit::IsFailed() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return failed;
+}
+
+std::string ComputingUnit::GetFailure() {
+	std::lock_guard<std::mutex> lock(stateMutex);
+	return failure;
 }
 
 
@@ -164,12 +416,12 @@ size_t ComputingUnit::GetWorkAmount() const {
 	return workAmount;
 }
 
-void ComputingUnit::UpdateCameraBuffer(Camera *camera) {
-	queue.enqueueWriteBuffer(cameraBuffer, CL_FALSE, 0, sizeof(Camera), camera);
+PlatformContext *ComputingUnit::GetPlatformContext() const {
+	return platformContext;
 }
 
-void ComputingUnit::UpdateSceneBuffer(Sphere *spheres) {
-	queue.enqueueWriteBuffer(sphereBuffer, CL_FALSE, 0, sizeof(Sphere) * sphereCount, spheres);
+DeviceMetrics& ComputingUnit::GetMetrics() {
+	return metrics;
 }
 
 void ComputingUnit::Finish() {
@@ -180,8 +432,12 @@ void ComputingUnit::Finish() {
 void ComputingUnit::SetKernelArgs() {
 	kernel.setArg(0, colorBuffer);
 	kernel.setArg(1, seedBuffer);
-	kernel.setArg(2, sphereBuffer);
-	kernel.setArg(3, cameraBuffer);
+	// The platform swaps the camera and scene buffers between animation frames
+	if (sceneStorage == SCENE_STORAGE_IMAGE)
+		kernel.setArg(2, sphereImage);
+	else
+		kernel.setArg(2, platformContext->GetSceneBuffer());
+	kernel.setArg(3, platformContext->GetCameraBuffer());
 	kernel.setArg(4, sphereCount);
 	kernel.setArg(5, width);
 	kernel.setArg(6, height);
@@ -189,6 +445,42 @@ void ComputingUnit::SetKernelArgs() {
 	kernel.setArg(8, pixelBuffer);
 	kernel.setArg(9, workOffset);
 	kernel.setArg(10, workAmount);
+	kernel.setArg(11, samplesPerLaunch);
+	kernel.setArg(12, previewScale);
+	kernel.setArg(13, instanceBuffer);
+	kernel.setArg(14, instanceCount);
+	kernel.setArg(15, prototypeSphereBuffer);
+	kernel.setArg(16, meshBuffer);
+	kernel.setArg(17, meshCount);
+	kernel.setArg(18, meshVertexBuffer);
+	kernel.setArg(19, meshIndexBuffer);
+	kernel.setArg(20, meshNodeBuffer);
+	kernel.setArg(21, (frameWidth > 0) ? frameWidth : width);
+	kernel.setArg(22, (frameHeight > 0) ? frameHeight : height);
+	kernel.setArg(23, cropX);
+	kernel.setArg(24, cropY);
+	kernel.setArg(25, instanceNodeBuffer);
+
+	cl_uint argIndex = 26;
+	if (renderOptions.reprojection) {
+		kernel.setArg(argIndex++, firstHitBuffer);
+		kernel.setArg(argIndex++, sampleCountBuffer);
+		kernel.setArg(argIndex++, expectedDepthBuffer);
+	}
+
+	if (renderOptions.denoise)
+		kernel.setArg(argIndex++, featureBuffer);
+
+	if (renderOptions.sampler == SAMPLER_BLUE_NOISE)
+		kernel.setArg(argIndex++, blueNoiseBuffer);
+
+	if (localStaging)
+		kernel.setArg(argIndex++, cl::__local(sizeof(Sphere) * sphereCount));
+
+	if (renderOptions.persistentThreads) {
+		kernel.setArg(argIndex++, workCounterBuffer);
+		kernel.setArg(argIndex++, static_cast<unsigned int>(GetLaunchSize()));
+	}
 }
 
 void ComputingUnit::SetWorkLoad(const unsigned int offset, const unsigned int amount,
@@ -197,6 +489,10 @@ void ComputingUnit::SetWorkLoad(const unsigned int offset, const unsigned int am
 
 	if (colors)
 		delete[] colors;
+	if (compactColors)
+		delete[] compactColors;
+	colors = nullptr;
+	compactColors = nullptr;
 	if (seeds)
 		delete[] seeds;
 
@@ -206,63 +502,322 @@ void ComputingUnit::SetWorkLoad(const unsigned int offset, const unsigned int am
 	width = screenWidth;
 	height = screenHeght;
 	pixels = screenPixels;
+	pixelTargetOffset = 0;
+	pixelTargetCount = 0;
 
 	std::cerr << "[Device::" << deviceName << "] ";
 	std::cerr << "Offset: " << workOffset << " Amount: " << workAmount << std::endl;
 
-	colors = new Vec[workAmount];
+	// Allocate and first-touch the host buffers on the NUMA node of the unit
+	RunPinned(numaCpus, [this]() {
+		if (renderOptions.accumulation == ACCUMULATION_COMPACT)
+			compactColors = new uint64_t[workAmount]();
+		else
+			colors = new Vec[workAmount];
+
+		// Seeded from the pixel range rather than rand(), shared by all the threads
+		std::minstd_rand generator(workOffset + 1);
+		seeds = new unsigned int[workAmount * 2];
+		for (size_t i = 0; i < workAmount * 2; ++i) {
+			seeds[i] = generator();
+			if (seeds[i] < 2)
+				seeds[i] = 2;
+		}
+	});
+
 	colorBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-		sizeof(Vec) * workAmount, colors);
+		GetAccumulationSize() * workAmount, compactColors ? static_cast<void *>(compactColors) : static_cast<void *>(colors));
 
-	std::cerr << "[Device::" << deviceName << "] ColorBuffer size: " << (sizeof(Vec) * workAmount / 1024) << " Kb" << std::endl;
+	std::cerr << "[Device::" << deviceName << "] ColorBuffer size: " << (GetAccumulationSize() * workAmount / 1024) << " Kb" << std::endl;
 
-	pixelBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY | CL_MEM_USE_HOST_PTR,
-		sizeof(unsigned int) * workAmount, &pixels[workOffset]);
+	// Not bound to the host frame buffer: the readback target can be swapped between passes
+	pixelBuffer = cl::Buffer(context, CL_MEM_WRITE_ONLY,
+		sizeof(unsigned int) * workAmount);
 
 
 	std::cerr << "[Device::" << deviceName << "] PixelBuffer size: " << (sizeof(unsigned int) * workAmount / 1024) << " Kb" << std::endl;
 
-	seeds = new unsigned int[workAmount * 2];
-	for (size_t i = 0; i < workAmount * 2; ++i) {
-		seeds[i] = rand();
-		if (seeds[i] < 2)
-			seeds[i] = 2;
-	}
-
 	seedBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
 		sizeof(unsigned int) * workAmount * 2, seeds);
 
 	std::cerr << "[Device::" << deviceName << "] SeedsBuffer size: " << (sizeof(unsigned int) * 2 * workAmount / 1024) << " Kb" << std::endl;
 
+	if (renderOptions.reprojection) {
+		std::vector<FirstHit> noHits(workAmount, FirstHit());
+		std::vector<float> zeros(workAmount, 0.f);
+
+		firstHitBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(FirstHit) * workAmount, noHits.data());
+		sampleCountBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * workAmount, zeros.data());
+		expectedDepthBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * workAmount, zeros.data());
+
+		std::cerr << "[Device::" << deviceName << "] ReprojectionBuffers size: " <<
+			((sizeof(FirstHit) + 2 * sizeof(float)) * workAmount / 1024) << " Kb" << std::endl;
+	}
+
+	if (renderOptions.denoise) {
+		Feature noHistory;
+		noHistory.depth = -1.f;
+		std::vector<Feature> noFeatures(workAmount, noHistory);
+
+		featureBuffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+			sizeof(Feature) * workAmount, noFeatures.data());
+
+		size_t denoiseSize = sizeof(Feature) * workAmount;
+		if (deviceDenoise) {
+			denoiseBuffers[0] = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(Vec) * workAmount);
+			denoiseBuffers[1] = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(Vec) * workAmount);
+			denoiseSize += 2 * sizeof(Vec) * workAmount;
+		}
+
+		std::cerr << "[Device::" << deviceName << "] DenoiseBuffers size: " << (denoiseSize / 1024) << " Kb" << std::endl;
+	}
+
+	size_t memorySize = (GetAccumulationSize() + 3 * sizeof(unsigned int)) * workAmount;
+	if (renderOptions.reprojection)
+		memorySize += (sizeof(FirstHit) + 2 * sizeof(float)) * workAmount;
+	if (renderOptions.denoise)
+		memorySize += (sizeof(Feature) + (deviceDenoise ? 2 * sizeof(Vec) : 0)) * workAmount;
+	metrics.memoryBytes = memorySize;
+	metrics.workAmount = workAmount;
+
 	currentSample = 0;
 }
 
+void ComputingUnit::ReadAccumulation(Vec *accumulation, unsigned int *seedsOut, const size_t count,
+	const unsigned int samples) {
+	// The compact accumulation holds sums, turned into averages on the host
+	std::vector<uint64_t> sums;
+	std::vector<float> sampleCounts;
+	if (renderOptions.accumulation == ACCUMULATION_COMPACT) {
+		sums.resize(count);
+		queue.enqueueReadBuffer(colorBuffer, CL_FALSE, 0, sizeof(uint64_t) * count, sums.data());
+		if (renderOptions.reprojection) {
+			sampleCounts.resize(count);
+			queue.enqueueReadBuffer(sampleCountBuffer, CL_FALSE, 0, sizeof(float) * count, sampleCounts.data());
+		}
+	} else
+		queue.enqueueReadBuffer(colorBuffer, CL_FALSE, 0, sizeof(Vec) * count, accumulation);
+	if (seedsOut)
+		queue.enqueueReadBuffer(seedBuffer, CL_FALSE, 0, sizeof(unsigned int) * 2 * count, seedsOut);
+	queue.finish();
+
+	for (size_t i = 0; i < sums.size(); ++i) {
+		const float n = sampleCounts.empty() ? static_cast<float>(samples) : sampleCounts[i];
+		accumulation[i] = UnpackCompactColor(sums[i]) * ((n > 0.f) ? 1.f / n : 0.f);
+	}
+
+	metrics.bytesRead += (GetAccumulationSize() + (seedsOut ? 2 * sizeof(unsigned int) : 0)) * count +
+		sizeof(float) * sampleCounts.size();
+}
+
+void ComputingUnit::WriteAccumulation(const Vec *accumulation, const unsigned int *seedsIn, const size_t count,
+	const unsigned int samples) {
+	std::vector<uint64_t> sums;
+	if (renderOptions.accumulation == ACCUMULATION_COMPACT) {
+		// The per pixel counts of the reprojection are already on the device
+		std::vector<float> sampleCounts;
+		if (renderOptions.reprojection) {
+			sampleCounts.resize(count);
+			queue.enqueueReadBuffer(sampleCountBuffer, CL_TRUE, 0, sizeof(float) * count, sampleCounts.data());
+		}
+
+		sums.resize(count);
+		for (size_t i = 0; i < count; ++i) {
+			const float n = sampleCounts.empty() ? static_cast<float>(samples) : sampleCounts[i];
+			sums[i] = PackCompactColor(accumulation[i] * n);
+		}
+		queue.enqueueWriteBuffer(colorBuffer, CL_FALSE, 0, sizeof(uint64_t) * count, sums.data());
+	} else
+		queue.enqueueWriteBuffer(colorBuffer, CL_FALSE, 0, sizeof(Vec) * count, accumulation);
+	queue.enqueueWriteBuffer(seedBuffer, CL_FALSE, 0, sizeof(unsigned int) * 2 * count, seedsIn);
+	queue.finish();
+
+	metrics.bytesWritten += (GetAccumulationSize() + 2 * sizeof(unsigned int)) * count;
+}
+
+void ComputingUnit::ClearReprojectionState() {
+	if (workAmount == 0)
+		return;
+
+	const std::vector<float> zeros(workAmount, 0.f);
+	queue.enqueueWriteBuffer(sampleCountBuffer, CL_FALSE, 0, sizeof(float) * workAmount, zeros.data());
+	queue.enqueueWriteBuffer(expectedDepthBuffer, CL_FALSE, 0, sizeof(float) * workAmount, zeros.data());
+	queue.finish();
+
+	metrics.bytesWritten += 2 * sizeof(float) * workAmount;
+}
+
+void ComputingUnit::ReadReprojectionState(float *sampleCountsOut, FirstHit *firstHitsOut, const size_t count) {
+	queue.enqueueReadBuffer(sampleCountBuffer, CL_FALSE, 0, sizeof(float) * count, sampleCountsOut);
+	if (firstHitsOut)
+		queue.enqueueReadBuffer(firstHitBuffer, CL_FALSE, 0, sizeof(FirstHit) * count, firstHitsOut);
+	queue.finish();
+
+	metrics.bytesRead += (sizeof(float) + (firstHitsOut ? sizeof(FirstHit) : 0)) * count;
+}
+
+void ComputingUnit::WriteReprojectionState(const float *sampleCountsIn, const float *expectedDepthsIn, const size_t count) {
+	queue.enqueueWriteBuffer(sampleCountBuffer, CL_FALSE, 0, sizeof(float) * count, sampleCountsIn);
+	queue.enqueueWriteBuffer(expectedDepthBuffer, CL_FALSE, 0, sizeof(float) * count, expectedDepthsIn);
+	queue.finish();
+
+	metrics.bytesWritten += 2 * sizeof(float) * count;
+}
+
+void ComputingUnit::ReadFeatures(Feature *featuresOut, const size_t count) {
+	queue.enqueueReadBuffer(featureBuffer, CL_TRUE, 0, sizeof(Feature) * count, featuresOut);
+
+	metrics.bytesRead += sizeof(Feature) * count;
+}
+
+void ComputingUnit::SetCropWindow(const unsigned int fullWidth, const unsigned int fullHeight,
+	const unsigned int x, const unsigned int y) {
+	frameWidth = fullWidth;
+	frameHeight = fullHeight;
+	cropX = x;
+	cropY = y;
+}
+
+void ComputingUnit::SetPixelTarget(unsigned int *screenPixels, const unsigned int targetOffset,
+	const unsigned int targetCount) {
+	pixels = screenPixels;
+	pixelTargetOffset = targetOffset;
+	pixelTargetCount = targetCount;
+}
+
+void ComputingUnit::SetReadbackOnly(const bool readback) {
+	readbackOnly = readback;
+}
+
 void ComputingUnit::ReadPixelBuffer() {
-	queue.enqueueReadBuffer(pixelBuffer, CL_FALSE, 0, sizeof(unsigned int) * workAmount, &pixels[workOffset]);
+	// Nobody needs the pixels of this pass
+	if (!pixels)
+		return;
+
+	// Filtered only when read back. The preview is not worth filtering.
+	if (deviceDenoise && (previewScale <= 1))
+		ExecuteDenoise();
+
+	// The last unit may own an empty range past the end of the target
+	const unsigned int targetEnd = (pixelTargetCount > 0) ?
+		(pixelTargetOffset + pixelTargetCount) : (width * height);
+	if (workOffset >= targetEnd)
+		return;
+
+	// Registered before the read is queued: the main thread retires the
+	// target of a unit given up with the read pending
+	{
+		std::lock_guard<std::mutex> lock(stateMutex);
+		if (failed)
+			return;
+		pendingPixels = pixels;
+	}
+
+	const size_t count = std::min<size_t>(workAmount, targetEnd - workOffset);
+	queue.enqueueReadBuffer(pixelBuffer, CL_FALSE, 0, sizeof(unsigned int) * count,
+		&pixels[workOffset - pixelTargetOffset]);
+
+	metrics.bytesRead += sizeof(unsigned int) * count;
+}
+
+
+size_t ComputingUnit::GetAccumulationSize() const {
+	return (renderOptions.accumulation == ACCUMULATION_COMPACT) ? sizeof(uint64_t) : sizeof(Vec);
 }
 
+size_t ComputingUnit::GetLaunchSize() const {
+	if (previewScale <= 1)
+		return workAmount;
+
+	// One work-item per preview block touching the range of the unit
+	const size_t blocksPerRow = (width + previewScale - 1) / previewScale;
+	const size_t firstBlockRow = (workOffset / width) / previewScale;
+	const size_t lastBlockRow = ((workOffset + workAmount - 1) / width) / previewScale;
+
+	return blocksPerRow * (lastBlockRow - firstBlockRow + 1);
+}
 
 void ComputingUnit::ExecuteKernel() {
-	size_t w = workAmount;
+	const size_t launchSize = GetLaunchSize();
+
+	size_t w = launchSize;
 	if (w % workGroupSize != 0) {
 		w = (w / workGroupSize + 1) * workGroupSize;
 	}
 
+	if (renderOptions.persistentThreads) {
+		// The work-groups fetch the work-items from the counter, restarted
+		// before each pass (the queue is in order)
+		static const cl_uint counterStart = 0;
+		queue.enqueueWriteBuffer(workCounterBuffer, CL_FALSE, 0, sizeof(cl_uint), &counterStart);
+
+		w = std::min(w, persistentGroupCount * workGroupSize);
+	}
+
 	// This release the old event as well
 	kernelExecutionTime = cl::Event();
 	queue.enqueueNDRangeKernel(kernel, cl::NullRange, cl::NDRange(w),
 		cl::NDRange(workGroupSize), NULL, &kernelExecutionTime);
 
-	exeUnitCount += workAmount;
+	exeUnitCount += static_cast<double>(launchSize) * samplesPerLaunch;
+
+	metrics.samples += static_cast<uint64_t>(launchSize) * samplesPerLaunch;
+	metrics.passes++;
+	metrics.samplesPerPixel = currentSample + samplesPerLaunch;
+}
+
+void ComputingUnit::ExecuteDenoise() {
+	// Ping-pong between the two buffers, the accumulation is never modified
+	const unsigned int iterations = std::max(1u, renderOptions.denoiseIterations);
+	for (unsigned int i = 0; i < iterations; ++i) {
+		const unsigned int step = 1u << i;
+		const float sigma = renderOptions.denoiseColorSigma / static_cast<float>(step);
+		const float colorPhi = std::max(sigma * sigma, 1e-8f);
+
+		// The compact accumulation is not a Vec buffer: the first iteration
+		// reads it from its own argument (the input is then not read)
+		const bool compactInput = (i == 0) && (renderOptions.accumulation == ACCUMULATION_COMPACT);
+		denoiseKernel.setArg(0, ((i == 0) && !compactInput) ? colorBuffer : denoiseBuffers[(i + 1) % 2]);
+		denoiseKernel.setArg(1, denoiseBuffers[i % 2]);
+		denoiseKernel.setArg(2, featureBuffer);
+		denoiseKernel.setArg(3, width);
+		denoiseKernel.setArg(4, height);
+		denoiseKernel.setArg(5, workOffset);
+		denoiseKernel.setArg(6, workAmount);
+		denoiseKernel.setArg(7, step);
+		denoiseKernel.setArg(8, colorPhi);
+		denoiseKernel.setArg(9, pixelBuffer);
+		denoiseKernel.setArg(10, (i + 1 == iterations) ? 1u : 0u);
+		if (renderOptions.accumulation == ACCUMULATION_COMPACT) {
+			// The sums are divided by the samples per pixel after this pass
+			denoiseKernel.setArg(11, colorBuffer);
+			denoiseKernel.setArg(12, compactInput ? 1u : 0u);
+			denoiseKernel.setArg(13, static_cast<float>(currentSample + samplesPerLaunch));
+			if (renderOptions.reprojection)
+				denoiseKernel.setArg(14, sampleCountBuffer);
+		}
+
+		// The work-group size of RadianceGPU may not suit this kernel
+		queue.enqueueNDRangeKernel(denoiseKernel, cl::NullRange, cl::NDRange(workAmount), cl::NullRange);
+	}
 }
 
 void ComputingUnit::FinishExecuteKernel() {
 	kernelExecutionTime.wait();
 
 	// Check kernel execution time
-	cl_ulong t1, t2;
+	cl_ulong t0, t1, t2;
+	kernelExecutionTime.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_QUEUED, &t0);
 	kernelExecutionTime.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &t1);
 	kernelExecutionTime.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_END, &t2);
 	exeTime += (t2 - t1) / 1e9;
+
+	metrics.kernelNanoseconds += t2 - t1;
+	metrics.queueWaitNanoseconds += t1 - t0;
+	if (t2 > t1)
+		metrics.samplesPerSecond = static_cast<double>(GetLaunchSize()) * samplesPerLaunch * 1e9 / (t2 - t1);
 }
 
@@ -0,0 +1,110 @@
+#include <cstdio>
+#include <cmath>
+
+#include "Convergence.hpp"
+
+
+// Keeps the relative error of the black pixels finite
+static const double kRelMSEEpsilon = 1e-2;
+
+
+ImageError ComputeImageError(const Vec *colors, const Vec *reference, const size_t pixelCount) {
+	double squared = 0.0;
+	double relative = 0.0;
+
+	for (size_t i = 0; i < pixelCount; ++i) {
+		const double c[3] = { colors[i].x, colors[i].y, colors[i].z };
+		const double r[3] = { reference[i].x, reference[i].y, reference[i].z };
+
+		for (int j = 0; j < 3; ++j) {
+			const double d = (c[j] - r[j]) * (c[j] - r[j]);
+			squared += d;
+			relative += d / (r[j] * r[j] + kRelMSEEpsilon);
+		}
+	}
+
+	const double count = 3.0 * static_cast<double>(pixelCount > 0 ? pixelCount : 1);
+
+	ImageError error;
+	error.rmse = std::sqrt(squared / count);
+	error.relMSE = relative / count;
+
+	return error;
+}
+
+// Scene and device names only need the quotes and backslashes escaped
+static std::string JsonString(const std::string& s) {
+	std::string result = "\"";
+	for (size_t i = 0; i < s.length(); ++i) {
+		if ((s[i] == '"') || (s[i] == '\\'))
+			result += '\\';
+		if (static_cast<unsigned char>(s[i]) >= 0x20)
+			result += s[i];
+	}
+
+	return result + "\"";
+}
+
+// JSON has no nan or infinity
+static std::string JsonNumber(const char *format, const double value) {
+	if (!std::isfinite(value))
+		return "null";
+
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), format, value);
+	return buffer;
+}
+
+bool WriteConvergenceReport(const std::string& fileName, const ConvergenceReport& report) {
+	FILE *f = fopen(fileName.c_str(), "w");
+	if (!f) {
+		fprintf(stderr, "Failed to open convergence report: %s\n", fileName.c_str());
+		return false;
+	}
+
+	fprintf(f, "{\n");
+	fprintf(f, "  \"scene\": %s,\n", JsonString(report.scene).c_str());
+	fprintf(f, "  \"reference\": %s,\n", JsonString(report.reference).c_str());
+	fprintf(f, "  \"sampler\": %s,\n", JsonString(report.sampler).c_str());
+	fprintf(f, "  \"accumulation\": %s,\n", JsonString(report.accumulation).c_str());
+	fprintf(f, "  \"width\": %u,\n", report.width);
+	fprintf(f, "  \"height\": %u,\n", report.height);
+
+	fprintf(f, "  \"devices\": [");
+	for (size_t i = 0; i < report.devices.size(); ++i)
+		fprintf(f, "%s%s", (i > 0) ? ", " : "", JsonString(report.devices[i]).c_str());
+	fprintf(f, "],\n");
+
+	fprintf(f, "  \"checkpoints\": [\n");
+	for (size_t i = 0; i < report.checkpoints.size(); ++i) {
+		const ConvergenceCheckpoint& c = report.checkpoints[i];
+		fprintf(f, "    { \"seconds\": %s, \"samples\": %u, \"rmse\": %s, \"relmse\": %s }%s\n",
+			JsonNumber("%g", c.seconds).c_str(), c.samples, JsonNumber("%.6g", c.error.rmse).c_str(),
+			JsonNumber("%.6g", c.error.relMSE).c_str(), (i + 1 < report.checkpoints.size()) ? "," : "");
+	}
+	fprintf(f, "  ],\n");
+
+	fprintf(f, "  \"thresholds\": [\n");
+	for (size_t i = 0; i < report.thresholds.size(); ++i) {
+		const ConvergenceThreshold& t = report.thresholds[i];
+		const char *separator = (i + 1 < report.thresholds.size()) ? "," : "";
+		if (t.reached)
+			fprintf(f, "    { \"relmse\": %s, \"seconds\": %s, \"samples\": %u }%s\n",
+				JsonNumber("%g", t.relMSE).c_str(), JsonNumber("%.4g", t.seconds).c_str(), t.samples, separator);
+		else
+			fprintf(f, "    { \"relmse\": %s, \"seconds\": null, \"samples\": null }%s\n",
+				JsonNumber("%g", t.relMSE).c_str(), separator);
+	}
+	fprintf(f, "  ],\n");
+
+	const double samplesPerSecond = (report.seconds > 0.f) ?
+		static_cast<double>(report.samples) * report.width * report.height / report.seconds : 0.0;
+	fprintf(f, "  \"seconds\": %s,\n", JsonNumber("%.4g", report.seconds).c_str());
+	fprintf(f, "  \"samples\": %u,\n", report.samples);
+	fprintf(f, "  \"samples_per_second\": %s,\n", JsonNumber("%.6g", samplesPerSecond).c_str());
+	fprintf(f, "  \"rmse\": %s,\n", JsonNumber("%.6g", report.error.rmse).c_str());
+	fprintf(f, "  \"relmse\": %s\n", JsonNumber("%.6g", report.error.relMSE).c_str());
+	fprintf(f, "}\n");
+
+	return fclose(f) == 0;
+}
@@ -0,0 +1,105 @@
+#include <cmath>
+#include <algorithm>
+#include <thread>
+
+#include "Denoise.hpp"
+
+// Edge-stopping functions, same as the kernel
+static const float kNormalPower = 32.f;
+static const float kDepthSigma = 0.02f;	/* relative depth change per pixel */
+static const float kAlbedoSigma = 0.1f;
+
+static const float kKernelWeights[3] = { 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+
+
+static void FilterRows(const unsigned int width, const unsigned int height,
+	const unsigned int firstRow, const unsigned int lastRow,
+	const unsigned int step, const float colorPhi,
+	const std::vector<Vec>& input, const std::vector<Feature>& features,
+	std::vector<Vec> *output) {
+
+	for (unsigned int py = firstRow; py < lastRow; ++py) {
+		for (unsigned int px = 0; px < width; ++px) {
+			const size_t p = static_cast<size_t>(py) * width + px;
+			const Vec& cp = input[p];
+			const Feature& fp = features[p];
+
+			Vec sum;
+			float weightSum = 0.f;
+			for (int dy = -2; dy <= 2; ++dy) {
+				const int qy = static_cast<int>(py) + dy * static_cast<int>(step);
+				if ((qy < 0) || (qy >= static_cast<int>(height)))
+					continue;
+
+				for (int dx = -2; dx <= 2; ++dx) {
+					const int qx = static_cast<int>(px) + dx * static_cast<int>(step);
+					if ((qx < 0) || (qx >= static_cast<int>(width)))
+						continue;
+
+					const size_t q = static_cast<size_t>(qy) * width + qx;
+					const Vec& cq = input[q];
+					const Feature& fq = features[q];
+
+					Vec d = cp - cq;
+					const float wColor = std::exp(-d.dot(d) / colorPhi);
+
+					const float wNormal = std::pow(std::max(0.f, fp.normal.dot(fq.normal)), kNormalPower);
+
+					const float dist = static_cast<float>(step * std::max(std::abs(dx), std::abs(dy)));
+					const float wDepth = std::exp(-std::fabs(fp.depth - fq.depth) / (kDepthSigma * dist * fp.depth + 1e-4f));
+
+					d = fp.albedo - fq.albedo;
+					const float wAlbedo = std::exp(-d.dot(d) / (kAlbedoSigma * kAlbedoSigma));
+
+					const float w = kKernelWeights[std::abs(dx)] * kKernelWeights[std::abs(dy)] *
+						wColor * wNormal * wDepth * wAlbedo;
+					sum = sum + cq * w;
+					weightSum += w;
+				}
+			}
+
+			(*output)[p] = (weightSum > 0.f) ? (sum * (1.f / weightSum)) : cp;
+		}
+	}
+}
+
+void DenoiseATrous(const unsigned int width, const unsigned int height,
+	const unsigned int iterations, const float colorSigma,
+	const std::vector<Vec>& colors, const std::vector<Feature>& features,
+	const unsigned int threadCount, std::vector<Vec> *result) {
+
+	*result = colors;
+	if (iterations == 0)
+		return;
+
+	std::vector<Vec> input(colors);
+	const unsigned int threads = std::max(1u, std::min(threadCount, height));
+
+	for (unsigned int i = 0; i < iterations; ++i) {
+		const unsigned int step = 1u << i;
+		const float sigma = colorSigma / static_cast<float>(step);
+		const float colorPhi = std::max(sigma * sigma, 1e-8f);
+
+		std::vector<std::thread> workers;
+		for (unsigned int t = 0; t < threads; ++t) {
+			const unsigned int firstRow = height * t / threads;
+			const unsigned int lastRow = height * (t + 1) / threads;
+			workers.push_back(std::thread(FilterRows, width, height, firstRow, lastRow,
+				step, colorPhi, std::cref(input), std::cref(features), result));
+		}
+		for (size_t t = 0; t < workers.size(); ++t)
+			workers[t].join();
+
+		input.swap(*result);
+	}
+
+	result->swap(input);
+}
+
+unsigned int ColorToPixel(const Vec& color) {
+	auto toInt = [](const float x) {
+		return static_cast<unsigned int>(std::pow(std::min(std::max(x, 0.f), 1.f), 1.f / 2.2f) * 255.f + .5f);
+	};
+
+	return toInt(color.x) | (toInt(color.y) << 8) | (toInt(color.z) << 16);
+}
@@ -14,6 +14,7 @@
 #include "RayTracingConfig.hpp"
 #include "ComputingUnit.hpp"
 #include "DisplayProcedure.hpp"
+#include "PixelBufferRing.hpp"
 #include "Utility.hpp"
 
 
@@ -26,9 +27,17 @@ static double totalElapsedTime = 0.0;
 static bool isMouseTracking = false;
 static std::pair<int, int> mousePos;
 
+// Crop window being dragged with the right button, in window coordinates
+static bool isCropSelecting = false;
+static std::pair<int, int> cropStart;
+static std::pair<int, int> cropEnd;
+
 
 RayTracingConfig *rtConfig;
 
+// nullptr when the frames are displayed with glDrawPixels()
+static PixelBufferRing *pixelBufferRing = nullptr;
+
 static void UpdateRendering() {
 
 	int startSampleCount = rtConfig->currentSample;
@@ -41,13 +50,38 @@ static void UpdateRendering() {
 	const double elapsedTime = std::chrono::duration_cast<std::chrono::duration<double>>(endTime - startTime).count();
 	totalElapsedTime += elapsedTime;
 
-	const int samples = rtConfig->currentSample - startSampleCount;
-	const double sampleSec = samples * rtConfig->height * rtConfig->width / elapsedTime;
+	// Only the pixels of the crop window are rendered
+	unsigned int cropX, cropY, cropWidth, cropHeight;
+	rtConfig->GetCropWindow(&cropX, &cropY, &cropWidth, &cropHeight);
+	const double pixelCount = static_cast<double>(cropWidth) * cropHeight;
 
-	sprintf(rtConfig->captionBuffer, "[Rendering time %.3f sec (pass %d)][Avg. sample/sec %.1fK][Instant sample/sec %.1fK]",
+	// The preview restarts the accumulation when its resolution changes
+	const int samples = std::max<int>(0, rtConfig->currentSample - startSampleCount);
+	const double sampleSec = samples * pixelCount / elapsedTime;
+
+	sprintf(rtConfig->captionBuffer, "[Rendering time %.3f sec (%d spp)][Avg. sample/sec %.1fK][Instant sample/sec %.1fK]",
 		elapsedTime, rtConfig->currentSample,
-		(rtConfig->currentSample) * (rtConfig->height) * (rtConfig->width) / totalElapsedTime / 1000.f,
+		(rtConfig->currentSample) * pixelCount / totalElapsedTime / 1000.f,
 		sampleSec / 1000.f);
+
+	if (rtConfig->IsCropping()) {
+		const size_t len = strlen(rtConfig->captionBuffer);
+		snprintf(rtConfig->captionBuffer + len, sizeof(rtConfig->captionBuffer) - len,
+			"[Crop %ux%u at %u,%u]", cropWidth, cropHeight, cropX, cropY);
+	}
+
+	if (rtConfig->GetPreviewScale() > 1) {
+		const size_t len = strlen(rtConfig->captionBuffer);
+		snprintf(rtConfig->captionBuffer + len, sizeof(rtConfig->captionBuffer) - len,
+			"[Preview 1/%u]", rtConfig->GetPreviewScale());
+	}
+
+	const unsigned int droppedFrames = rtConfig->GetDroppedFrames();
+	if (droppedFrames > 0) {
+		const size_t len = strlen(rtConfig->captionBuffer);
+		snprintf(rtConfig->captionBuffer + len, sizeof(rtConfig->captionBuffer) - len,
+			"[Dropped frames %u]", droppedFrames);
+	}
 }
 
 static void PrintString(void *font, const std::string& str) {
@@ -164,14 +198,23 @@ static void PrintCaptions() {
 
 static void displayFunc(void) {
 
-	glRasterPos2i(0, 0);
-	glDrawPixels(rtConfig->width, rtConfig->height, GL_RGBA, GL_UNSIGNED_BYTE, rtConfig->pixels);
+	if (pixelBufferRing)
+		pixelBufferRing->Draw();
+	else {
+		glRasterPos2i(0, 0);
+		glDrawPixels(rtConfig->width, rtConfig->height, GL_RGBA, GL_UNSIGNED_BYTE, rtConfig->pixels);
+	}
+
+	// The devices split the rows of the crop window
+	unsigned int cropX, cropY, cropWidth, cropHeight;
+	rtConfig->GetCropWindow(&cropX, &cropY, &cropWidth, &cropHeight);
+	const int cropBottom = rtConfig->height - cropY - cropHeight;
 
 	if (showWorkLoad) {
 		const std::vector<ComputingUnit *> computingUnits = rtConfig->GetComputingItem();
-		int start = 0;
+		int start = cropBottom;
 		for (size_t i = 0; i < computingUnits.size(); ++i) {
-			const int end = (computingUnits[i]->GetWorkOffset() + computingUnits[i]->GetWorkAmount()) / rtConfig->width;
+			const int end = cropBottom + (computingUnits[i]->GetWorkOffset() + computingUnits[i]->GetWorkAmount()) / cropWidth;
 
 			switch (i % 4) {
 			case 0:
@@ -203,6 +246,27 @@ static void displayFunc(void) {
 		}
 	}
 
+	if (rtConfig->IsCropping()) {
+		glColor3f(1.f, 1.f, 1.f);
+		glBegin(GL_LINE_LOOP);
+		glVertex2i(cropX, cropBottom);
+		glVertex2i(cropX + cropWidth - 1, cropBottom);
+		glVertex2i(cropX + cropWidth - 1, cropBottom + cropHeight - 1);
+		glVertex2i(cropX, cropBottom + cropHeight - 1);
+		glEnd();
+	}
+
+	if (isCropSelecting) {
+		// The window coordinates go from the top
+		glColor3f(1.f, 1.f, 0.f);
+		glBegin(GL_LINE_LOOP);
+		glVertex2i(cropStart.first, rtConfig->height - 1 - cropStart.second);
+		glVertex2i(cropEnd.first, rtConfig->height - 1 - cropStart.second);
+		glVertex2i(cropEnd.first, rtConfig->height - 1 - cropEnd.second);
+		glVertex2i(cropStart.first, rtConfig->height - 1 - cropEnd.second);
+		glEnd();
+	}
+
 	PrintCaptions();
 
 	if (printHelp) {
@@ -233,6 +297,11 @@ void reshapeFunc(int newWidth, int newHeight) {
 
 
 void OnMouseMove(int x, int y) {
+	if (isCropSelecting) {
+		cropEnd = std::make_pair(x, y);
+		return;
+	}
+
 	if (isMouseTracking) {
 		//std::string tmp = " OnMouseMove: " + std::to_string(x) + " " + std::to_string(y);
 
@@ -272,6 +341,7 @@ void OnMouseMove(int x, int y) {
 		rtConfig->camera->target.y += (dir.y) * mouseDeltaY * 5;
 		rtConfig->camera->target.z += (dir.z) * mouseDeltaY * 5;
 
+		rtConfig->BeginInteraction();
 		rtConfig->ReInit(false);
 
 
@@ -286,11 +356,47 @@ void OnMouseButton(int btn, int state, int x, int y) {
 		} else if (state == GLUT_UP && isMouseTracking) {
 			isMouseTracking = true;
 		}
+	} else if (btn == GLUT_RIGHT_BUTTON) {
+		// Right drag: crop window, right click: whole frame again
+		if (state == GLUT_DOWN) {
+			isCropSelecting = true;
+			cropStart = std::make_pair(x, y);
+			cropEnd = cropStart;
+		} else if (state == GLUT_UP && isCropSelecting) {
+			isCropSelecting = false;
+
+			const int x0 = std::max(0, std::min(cropStart.first, x));
+			const int y0 = std::max(0, std::min(cropStart.second, y));
+			const int x1 = std::max(cropStart.first, x);
+			const int y1 = std::max(cropStart.second, y);
+			if ((x1 - x0 < 4) || (y1 - y0 < 4))
+				rtConfig->SetCropWindow(0, 0, 0, 0);
+			else
+				rtConfig->SetCropWindow(x0, y0, x1 - x0, y1 - y0);
+		}
 	}
 }
 
 static void idleFunc(void) {
-	UpdateRendering();
+	if (pixelBufferRing) {
+		// The window has been resized
+		if ((pixelBufferRing->GetWidth() != rtConfig->width) || (pixelBufferRing->GetHeight() != rtConfig->height)) {
+			delete pixelBufferRing;
+			pixelBufferRing = new PixelBufferRing(rtConfig->width, rtConfig->height);
+		}
+
+		// The devices read back straight into the mapped buffer. While
+		// cropping, the frame stays in host memory for the pixels out of the window.
+		unsigned int *slotPixels = pixelBufferRing->BeginFrame();
+		rtConfig->SetExternalRenderTarget(rtConfig->IsCropping() ? nullptr : slotPixels);
+		UpdateRendering();
+
+		// A failed device may still read back into the slot
+		if (rtConfig->IsPixelTargetRetired(slotPixels))
+			pixelBufferRing->RetireSlot();
+		pixelBufferRing->EndFrame(rtConfig->pixels);
+	} else
+		UpdateRendering();
 
 	glutPostRedisplay();
 }
@@ -321,5 +427,12 @@ void RunGlut() {
 	glLoadIdentity();
 	glOrtho(0.f, rtConfig->width - 1.f, 0.f, rtConfig->height - 1.f, -1.f, 1.f);
 
+	if (rtConfig->GetOptions().pboDisplay) {
+		if (PixelBufferRing::IsSupported())
+			pixelBufferRing = new PixelBufferRing(rtConfig->width, rtConfig->height);
+		else
+			std::cerr << "Display: GL_ARB_buffer_storage not available, using glDrawPixels()" << std::endl;
+	}
+
 	glutMainLoop();
 }
\ No newline at end of file
@@ -0,0 +1,58 @@
+#include <algorithm>
+
+#include "FrameTimeController.hpp"
+
+
+// Weight of the last frame in the time per sample
+const float FrameTimeController::kSmoothing = 0.25f;
+// Margin before doubling the pass size, so that it does not flip at the boundary
+const float FrameTimeController::kHysteresis = 1.25f;
+
+
+FrameTimeController::FrameTimeController(const float target, const unsigned int maxPassSamples) :
+	targetTime(target), maxSamplesPerLaunch(std::max(1u, maxPassSamples)) {
+}
+
+void FrameTimeController::Reset() {
+	secondsPerSample = 0.f;
+	samplesPerLaunch = 1;
+	passesPerFrame = 1;
+}
+
+void FrameTimeController::Update(const float frameTime, const unsigned int samples) {
+	if ((samples == 0) || (frameTime <= 0.f) || (targetTime <= 0.f))
+		return;
+
+	// The readback and synchronization costs are spread over the samples
+	const float measured = frameTime / samples;
+	if (secondsPerSample == 0.f)
+		secondsPerSample = measured;
+	else
+		secondsPerSample += kSmoothing * (measured - secondsPerSample);
+
+	// Samples per pixel that fit in the target
+	const float budget = targetTime / secondsPerSample;
+
+	// The largest power of two pass within the budget: fewer passes, less
+	// synchronization between the devices
+	unsigned int passSamples = samplesPerLaunch;
+	while ((passSamples > 1) && (passSamples > budget))
+		passSamples /= 2;
+	while ((passSamples * 2 <= maxSamplesPerLaunch) && (passSamples * 2 * kHysteresis <= budget))
+		passSamples *= 2;
+
+	samplesPerLaunch = passSamples;
+	passesPerFrame = std::max(1u, static_cast<unsigned int>(budget / samplesPerLaunch + .5f));
+}
+
+unsigned int FrameTimeController::GetSamplesPerLaunch() const {
+	return samplesPerLaunch;
+}
+
+unsigned int FrameTimeController::GetPassesPerFrame() const {
+	return passesPerFrame;
+}
+
+float FrameTimeController::GetSecondsPerSample() const {
+	return secondsPerSample;
+}
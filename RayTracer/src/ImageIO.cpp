@@ -0,0 +1,372 @@
+#include <cstdio>
+#include <cstdint>
+
+#include <vector>
+#include <algorithm>
+
+#include "ImageIO.hpp"
+
+
+static bool HasExtension(const std::string& fileName, const std::string& ext) {
+	if (fileName.length() < ext.length())
+		return false;
+
+	std::string tail = fileName.substr(fileName.length() - ext.length());
+	std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+
+	return tail == ext;
+}
+
+bool IsFloatImageFile(const std::string& fileName) {
+	return HasExtension(fileName, ".pfm");
+}
+
+std::string MakeSequenceFileName(const std::string& pattern, const unsigned int index) {
+	std::string number = std::to_string(index);
+
+	const size_t start = pattern.find('#');
+	if (start == std::string::npos) {
+		const size_t dot = pattern.find_last_of('.');
+		if (dot == std::string::npos)
+			return pattern + "_" + number;
+
+		return pattern.substr(0, dot) + "_" + number + pattern.substr(dot);
+	}
+
+	size_t end = start;
+	while ((end < pattern.length()) && (pattern[end] == '#'))
+		++end;
+
+	if (number.length() < end - start)
+		number.insert(0, end - start - number.length(), '0');
+
+	return pattern.substr(0, start) + number + pattern.substr(end);
+}
+
+bool WriteImage(const std::string& fileName, const unsigned int *pixels, const Vec *colors,
+	const unsigned int width, const unsigned int height) {
+
+	if (HasExtension(fileName, ".png"))
+		return WriteImagePNG(fileName, pixels, width, height);
+	else if (HasExtension(fileName, ".pfm"))
+		return colors && WriteImagePFM(fileName, colors, width, height);
+	else
+		return WriteImagePPM(fileName, pixels, width, height);
+}
+
+
+bool WriteImagePPM(const std::string& fileName, const unsigned int *pixels,
+	const unsigned int width, const unsigned int height) {
+
+	FILE *f = fopen(fileName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open image file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	fprintf(f, "P6\n%u %u\n255\n", width, height);
+
+	std::vector<unsigned char> row(3 * width);
+	bool ok = true;
+	for (unsigned int y = 0; (y < height) && ok; ++y) {
+		const unsigned int *src = &pixels[(height - y - 1) * width];
+		for (unsigned int x = 0; x < width; ++x) {
+			row[3 * x] = src[x] & 0xff;
+			row[3 * x + 1] = (src[x] >> 8) & 0xff;
+			row[3 * x + 2] = (src[x] >> 16) & 0xff;
+		}
+
+		ok = (fwrite(row.data(), 1, row.size(), f) == row.size());
+	}
+
+	return (fclose(f) == 0) && ok;
+}
+
+
+//------------------------------------------------------------------------------
+// PNG with uncompressed (stored) deflate blocks, so no zlib is required
+
+static std::vector<uint32_t> MakeCrc32Table() {
+	std::vector<uint32_t> table(256);
+	for (uint32_t n = 0; n < 256; ++n) {
+		uint32_t c = n;
+		for (int k = 0; k < 8; ++k)
+			c = (c & 1) ? (0xedb88320u ^ (c >> 1)) : (c >> 1);
+		table[n] = c;
+	}
+
+	return table;
+}
+
+static uint32_t Crc32(uint32_t crc, const unsigned char *data, const size_t size) {
+	static const std::vector<uint32_t> table = MakeCrc32Table();
+
+	crc = ~crc;
+	for (size_t i = 0; i < size; ++i)
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static void PutU32(std::vector<unsigned char>& out, const uint32_t v) {
+	out.push_back((v >> 24) & 0xff);
+	out.push_back((v >> 16) & 0xff);
+	out.push_back((v >> 8) & 0xff);
+	out.push_back(v & 0xff);
+}
+
+static bool WritePNGChunk(FILE *f, const char *type, const std::vector<unsigned char>& data) {
+	std::vector<unsigned char> chunk;
+	chunk.reserve(data.size() + 12);
+
+	PutU32(chunk, static_cast<uint32_t>(data.size()));
+	chunk.insert(chunk.end(), type, type + 4);
+	chunk.insert(chunk.end(), data.begin(), data.end());
+	PutU32(chunk, Crc32(0, &chunk[4], data.size() + 4));
+
+	return fwrite(chunk.data(), 1, chunk.size(), f) == chunk.size();
+}
+
+bool WriteImagePNG(const std::string& fileName, const unsigned int *pixels,
+	const unsigned int width, const unsigned int height) {
+
+	// Raw scanlines, each one with the "None" filter type
+	const size_t stride = 3 * width + 1;
+	std::vector<unsigned char> raw(stride * height);
+	for (unsigned int y = 0; y < height; ++y) {
+		const unsigned int *src = &pixels[(height - y - 1) * width];
+		unsigned char *dst = &raw[y * stride];
+
+		dst[0] = 0;
+		for (unsigned int x = 0; x < width; ++x) {
+			dst[1 + 3 * x] = src[x] & 0xff;
+			dst[2 + 3 * x] = (src[x] >> 8) & 0xff;
+			dst[3 + 3 * x] = (src[x] >> 16) & 0xff;
+		}
+	}
+
+	// zlib stream made of stored blocks
+	std::vector<unsigned char> idat;
+	idat.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+	idat.push_back(0x78);
+	idat.push_back(0x01);
+
+	uint32_t a = 1, b = 0;
+	for (size_t pos = 0; pos < raw.size() || pos == 0; ) {
+		const size_t len = std::min<size_t>(65535, raw.size() - pos);
+		const bool last = (pos + len == raw.size());
+
+		idat.push_back(last ? 1 : 0);
+		idat.push_back(len & 0xff);
+		idat.push_back((len >> 8) & 0xff);
+		idat.push_back(~len & 0xff);
+		idat.push_back((~len >> 8) & 0xff);
+		idat.insert(idat.end(), raw.begin() + pos, raw.begin() + pos + len);
+
+		for (size_t i = pos; i < pos + len; ++i) {
+			a = (a + raw[i]) % 65521;
+			b = (b + a) % 65521;
+		}
+
+		pos += len;
+		if (last)
+			break;
+	}
+	PutU32(idat, (b << 16) | a);
+
+	std::vector<unsigned char> ihdr;
+	PutU32(ihdr, width);
+	PutU32(ihdr, height);
+	ihdr.push_back(8);	// bit depth
+	ihdr.push_back(2);	// RGB
+	ihdr.push_back(0);	// deflate
+	ihdr.push_back(0);	// adaptive filtering
+	ihdr.push_back(0);	// no interlace
+
+	FILE *f = fopen(fileName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open image file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+	bool ok = (fwrite(signature, 1, sizeof(signature), f) == sizeof(signature)) &&
+		WritePNGChunk(f, "IHDR", ihdr) &&
+		WritePNGChunk(f, "IDAT", idat) &&
+		WritePNGChunk(f, "IEND", std::vector<unsigned char>());
+
+	return (fclose(f) == 0) && ok;
+}
+
+
+bool WriteImagePFM(const std::string& fileName, const Vec *colors,
+	const unsigned int width, const unsigned int height) {
+
+	FILE *f = fopen(fileName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open image file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	// Negative scale: little endian. PFM rows are stored bottom-to-top as well.
+	fprintf(f, "PF\n%u %u\n-1.0\n", width, height);
+
+	std::vector<float> row(3 * width);
+	bool ok = true;
+	for (unsigned int y = 0; (y < height) && ok; ++y) {
+		const Vec *src = &colors[y * width];
+		for (unsigned int x = 0; x < width; ++x) {
+			row[3 * x] = src[x].x;
+			row[3 * x + 1] = src[x].y;
+			row[3 * x + 2] = src[x].z;
+		}
+
+		ok = (fwrite(row.data(), sizeof(float), row.size(), f) == row.size());
+	}
+
+	return (fclose(f) == 0) && ok;
+}
+
+bool ReadImagePFM(const std::string& fileName, std::vector<Vec> *colors,
+	unsigned int *width, unsigned int *height) {
+
+	FILE *f = fopen(fileName.c_str(), "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open image file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	char type[3] = { 0 };
+	float scale;
+	unsigned int w, h;
+	if ((fscanf(f, "%2s %u %u %f", type, &w, &h, &scale) != 4) || (type[0] != 'P') || (type[1] != 'F') ||
+		(w == 0) || (h == 0) || (fgetc(f) == EOF)) {
+		fprintf(stderr, "Not an RGB PFM file: %s\n", fileName.c_str());
+		fclose(f);
+		return false;
+	}
+
+	// A positive scale means big endian data
+	const uint32_t one = 1;
+	const bool swapBytes = (scale > 0.f) == (*reinterpret_cast<const unsigned char *>(&one) == 1);
+
+	std::vector<float> data(3 * static_cast<size_t>(w) * h);
+	const bool ok = (fread(data.data(), sizeof(float), data.size(), f) == data.size());
+	fclose(f);
+
+	if (!ok) {
+		fprintf(stderr, "Truncated PFM file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	if (swapBytes) {
+		for (size_t i = 0; i < data.size(); ++i) {
+			unsigned char *b = reinterpret_cast<unsigned char *>(&data[i]);
+			std::swap(b[0], b[3]);
+			std::swap(b[1], b[2]);
+		}
+	}
+
+	colors->resize(static_cast<size_t>(w) * h);
+	for (size_t i = 0; i < colors->size(); ++i)
+		(*colors)[i] = Vec(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+
+	*width = w;
+	*height = h;
+
+	return true;
+}
+
+
+//------------------------------------------------------------------------------
+// Band by band output
+
+ScanlineImageFile::ScanlineImageFile() {
+}
+
+ScanlineImageFile::~ScanlineImageFile() {
+	if (file)
+		fclose(file);
+}
+
+bool ScanlineImageFile::Open(const std::string& fileName, const unsigned int w, const unsigned int h) {
+	if (HasExtension(fileName, ".png")) {
+		fprintf(stderr, "PNG can not be written band by band, use .ppm or .pfm: %s\n", fileName.c_str());
+		return false;
+	}
+
+	file = fopen(fileName.c_str(), "wb");
+	if (!file) {
+		fprintf(stderr, "Failed to open image file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	isFloat = IsFloatImageFile(fileName);
+	width = w;
+	height = h;
+	rowsWritten = 0;
+
+	if (isFloat)
+		fprintf(file, "PF\n%u %u\n-1.0\n", width, height);
+	else
+		fprintf(file, "P6\n%u %u\n255\n", width, height);
+
+	return true;
+}
+
+bool ScanlineImageFile::Close() {
+	if (!file)
+		return false;
+
+	const bool ok = (fclose(file) == 0) && (rowsWritten == height);
+	file = nullptr;
+
+	if (rowsWritten != height)
+		fprintf(stderr, "Image closed after %u of %u rows\n", rowsWritten, height);
+
+	return ok;
+}
+
+bool ScanlineImageFile::IsTopDown() const {
+	return !isFloat;
+}
+
+bool ScanlineImageFile::IsFloat() const {
+	return isFloat;
+}
+
+bool ScanlineImageFile::WriteBand(const unsigned int *pixels, const Vec *colors, const unsigned int rows) {
+	if (!file || (rowsWritten + rows > height))
+		return false;
+
+	bool ok = true;
+	if (isFloat) {
+		std::vector<float> row(3 * width);
+		for (unsigned int y = 0; (y < rows) && ok; ++y) {
+			const Vec *src = &colors[y * width];
+			for (unsigned int x = 0; x < width; ++x) {
+				row[3 * x] = src[x].x;
+				row[3 * x + 1] = src[x].y;
+				row[3 * x + 2] = src[x].z;
+			}
+
+			ok = (fwrite(row.data(), sizeof(float), row.size(), file) == row.size());
+		}
+	} else {
+		std::vector<unsigned char> row(3 * width);
+		for (unsigned int y = 0; (y < rows) && ok; ++y) {
+			const unsigned int *src = &pixels[(rows - y - 1) * width];
+			for (unsigned int x = 0; x < width; ++x) {
+				row[3 * x] = src[x] & 0xff;
+				row[3 * x + 1] = (src[x] >> 8) & 0xff;
+				row[3 * x + 2] = (src[x] >> 16) & 0xff;
+			}
+
+			ok = (fwrite(row.data(), 1, row.size(), file) == row.size());
+		}
+	}
+
+	rowsWritten += rows;
+
+	return ok;
+}
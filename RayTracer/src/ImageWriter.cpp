@@ -0,0 +1,114 @@
+#include <iostream>
+
+#include "ImageWriter.hpp"
+#include "ImageIO.hpp"
+
+
+ImageWriter::ImageWriter(const size_t maxQueuedFrames) :
+	queueCapacity(maxQueuedFrames > 0 ? maxQueuedFrames : 1) {
+
+	writerThread = new std::thread(ImageWriter::WriterThread, this);
+}
+
+ImageWriter::~ImageWriter() {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		stop = true;
+	}
+	cond.notify_all();
+
+	// Queued frames are written before the thread exits
+	writerThread->join();
+	delete writerThread;
+
+	for (size_t i = 0; i < freeFrames.size(); ++i)
+		delete freeFrames[i];
+
+	if (droppedFrames > 0)
+		std::cerr << "Image writer: " << droppedFrames << " frame(s) dropped" << std::endl;
+}
+
+ImageFrame *ImageWriter::Acquire(const unsigned int width, const unsigned int height) {
+	ImageFrame *frame = nullptr;
+
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		if (framesInUse >= queueCapacity) {
+			++droppedFrames;
+			return nullptr;
+		}
+
+		if (!freeFrames.empty()) {
+			frame = freeFrames.back();
+			freeFrames.pop_back();
+		} else
+			frame = new ImageFrame();
+
+		++framesInUse;
+	}
+
+	frame->width = width;
+	frame->height = height;
+	frame->pixels.resize(width * height);
+	frame->colors.clear();
+
+	return frame;
+}
+
+void ImageWriter::Submit(ImageFrame *frame) {
+	{
+		std::lock_guard<std::mutex> lock(mtx);
+		queue.push_back(frame);
+	}
+	cond.notify_all();
+}
+
+void ImageWriter::Release(ImageFrame *frame) {
+	std::lock_guard<std::mutex> lock(mtx);
+	freeFrames.push_back(frame);
+	--framesInUse;
+}
+
+void ImageWriter::Retire(ImageFrame *frame) {
+	std::lock_guard<std::mutex> lock(mtx);
+	retiredFrames.push_back(frame);
+	--framesInUse;
+}
+
+unsigned int ImageWriter::GetDroppedFrames() const {
+	return droppedFrames;
+}
+
+unsigned int ImageWriter::GetWrittenFrames() const {
+	return writtenFrames;
+}
+
+void ImageWriter::WriterThread(ImageWriter *writer) {
+	while (true) {
+		ImageFrame *frame = nullptr;
+
+		{
+			std::unique_lock<std::mutex> lock(writer->mtx);
+			while (writer->queue.empty() && !writer->stop)
+				writer->cond.wait(lock);
+
+			if (writer->queue.empty())
+				return;
+
+			frame = writer->queue.front();
+			writer->queue.pop_front();
+		}
+
+		const Vec *colors = frame->colors.empty() ? nullptr : frame->colors.data();
+		if (WriteImage(frame->fileName, frame->pixels.data(), colors, frame->width, frame->height))
+			++writer->writtenFrames;
+		else
+			std::cerr << "Image writer: failed to write " << frame->fileName << std::endl;
+
+		{
+			std::lock_guard<std::mutex> lock(writer->mtx);
+			writer->freeFrames.push_back(frame);
+			--writer->framesInUse;
+		}
+	}
+}
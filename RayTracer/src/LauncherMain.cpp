@@ -1,6 +1,10 @@
 
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstdio>
 
 
 #define __CL_ENABLE_EXCEPTIONS
@@ -10,42 +14,258 @@
 
 
 #include "DisplayProcedure.hpp"
+#include "RenderOptions.hpp"
 
 
+// Comma separated list of numbers
+static std::vector<float> ParseFloatList(const std::string& list) {
+	std::vector<float> values;
+
+	size_t start = 0;
+	while (start < list.length()) {
+		size_t end = list.find(',', start);
+		if (end == std::string::npos)
+			end = list.length();
+
+		if (end > start)
+			values.push_back(static_cast<float>(atof(list.substr(start, end - start).c_str())));
+		start = end + 1;
+	}
+
+	return values;
+}
+
+// Splits the command line into positional arguments and "--name [value]" options
+static std::vector<std::string> ParseCommandLine(int argc, char *argv[], RenderOptions *options) {
+	std::vector<std::string> positional;
+
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+
+		if (arg.compare(0, 2, "--") != 0) {
+			positional.push_back(arg);
+			continue;
+		}
+
+		const bool hasValue = (i + 1 < argc);
+		if (arg == "--platform" && hasValue)
+			options->platformInclude.push_back(argv[++i]);
+		else if (arg == "--exclude-platform" && hasValue)
+			options->platformExclude.push_back(argv[++i]);
+		else if (arg == "--numa")
+			options->numaSplit = true;
+		else if (arg == "--scene-storage" && hasValue) {
+			const std::string storage = argv[++i];
+			if (storage == "auto")
+				options->sceneStorage = SCENE_STORAGE_AUTO;
+			else if (storage == "constant")
+				options->sceneStorage = SCENE_STORAGE_CONSTANT;
+			else if (storage == "global")
+				options->sceneStorage = SCENE_STORAGE_GLOBAL;
+			else if (storage == "image")
+				options->sceneStorage = SCENE_STORAGE_IMAGE;
+			else {
+				std::cerr << "Unknown scene storage: " << storage << std::endl;
+				exit(-1);
+			}
+		} else if (arg == "--local-staging")
+			options->localStaging = true;
+		else if (arg == "--persistent-threads")
+			options->persistentThreads = true;
+		else if (arg == "--sampler" && hasValue) {
+			const std::string sampler = argv[++i];
+			if (sampler == "random")
+				options->sampler = SAMPLER_RANDOM;
+			else if (sampler == "sobol")
+				options->sampler = SAMPLER_SOBOL;
+			else if (sampler == "bluenoise")
+				options->sampler = SAMPLER_BLUE_NOISE;
+			else {
+				std::cerr << "Unknown sampler: " << sampler << std::endl;
+				exit(-1);
+			}
+		} else if (arg == "--accumulation" && hasValue) {
+			const std::string format = argv[++i];
+			if (format == "float")
+				options->accumulation = ACCUMULATION_FLOAT;
+			else if (format == "compact")
+				options->accumulation = ACCUMULATION_COMPACT;
+			else {
+				std::cerr << "Unknown accumulation format: " << format << std::endl;
+				exit(-1);
+			}
+		} else if (arg == "--reprojection")
+			options->reprojection = true;
+		else if (arg == "--reprojection-history" && hasValue)
+			options->reprojectionMaxHistory = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--preview-frame-time" && hasValue)
+			options->previewFrameTime = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--preview-settle" && hasValue)
+			options->previewSettleTime = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--checkpoint" && hasValue)
+			options->checkpointFile = argv[++i];
+		else if (arg == "--checkpoint-interval" && hasValue)
+			options->checkpointInterval = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--resume")
+			options->resume = true;
+		else if (arg == "--dump" && hasValue)
+			options->dumpFile = argv[++i];
+		else if (arg == "--dump-every" && hasValue)
+			options->dumpInterval = atoi(argv[++i]);
+		else if (arg == "--dump-queue" && hasValue)
+			options->dumpQueueSize = atoi(argv[++i]);
+		else if (arg == "--denoise")
+			options->denoise = true;
+		else if (arg == "--denoise-iterations" && hasValue)
+			options->denoiseIterations = atoi(argv[++i]);
+		else if (arg == "--denoise-sigma" && hasValue)
+			options->denoiseColorSigma = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--pass-timeout" && hasValue)
+			options->passTimeout = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--frame-time" && hasValue)
+			options->frameTime = static_cast<float>(atof(argv[++i]));
+		else if (arg == "--metrics" && hasValue)
+			options->metricsAddress = argv[++i];
+		else if (arg == "--kernel" && hasValue)
+			options->kernelPath = argv[++i];
+		else if (arg == "--crop" && hasValue) {
+			if (sscanf(argv[++i], "%u,%u,%u,%u", &options->cropX, &options->cropY,
+				&options->cropWidth, &options->cropHeight) != 4) {
+				std::cerr << "Invalid crop window: " << argv[i] << std::endl;
+				exit(-1);
+			}
+		}
+		else if (arg == "--no-pbo")
+			options->pboDisplay = false;
+		else if (arg == "--animation" && hasValue)
+			options->animationFile = argv[++i];
+		else if (arg == "--animation-output" && hasValue)
+			options->animationOutput = argv[++i];
+		else if (arg == "--animation-spp" && hasValue)
+			options->animationSamples = atoi(argv[++i]);
+		else if (arg == "--convergence" && hasValue)
+			options->convergenceReport = argv[++i];
+		else if (arg == "--reference" && hasValue)
+			options->convergenceReference = argv[++i];
+		else if (arg == "--convergence-times" && hasValue)
+			options->convergenceTimes = ParseFloatList(argv[++i]);
+		else if (arg == "--convergence-thresholds" && hasValue)
+			options->convergenceThresholds = ParseFloatList(argv[++i]);
+		else if (arg == "--tiled" && hasValue)
+			options->tiledOutput = argv[++i];
+		else if (arg == "--tile-rows" && hasValue)
+			options->tileRows = atoi(argv[++i]);
+		else if (arg == "--tile-spp" && hasValue)
+			options->tileSamples = atoi(argv[++i]);
+		else {
+			std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+			exit(-1);
+		}
+	}
+
+	return positional;
+}
+
 int main(int argc, char *argv[]) {
 	try {
 		std::cerr << "Usage: " << argv[0] << std::endl;
 		std::cerr << "Usage: " << argv[0] << " <use CPU devices (0/1)> <use GPU devices (0/1)> \
 											 <GPU workgroup size (0=default value or anything x^2)>\
 											 <width> <height> <scene file>" << std::endl;
+		std::cerr << "Options: --platform <name> --exclude-platform <name> (repeatable, all platforms by default)" << std::endl;
+		std::cerr << "         --numa (one CPU sub-device per NUMA node)" << std::endl;
+		std::cerr << "         --scene-storage <auto|constant|global|image> (memory the kernel reads the scene from)" << std::endl;
+		std::cerr << "         --local-staging (work-groups copy the spheres to local memory)" << std::endl;
+		std::cerr << "         --persistent-threads (work-groups pull pixels from a queue until the pass is done)" << std::endl;
+		std::cerr << "         --sampler <random|sobol|bluenoise> (sample sequences, random by default)" << std::endl;
+		std::cerr << "         --accumulation <float|compact> (device storage of the accumulated colors, float by default)" << std::endl;
+		std::cerr << "         --reprojection [--reprojection-history <samples>] (keep samples across camera moves)" << std::endl;
+		std::cerr << "         --preview-frame-time <sec> (0 = off) --preview-settle <sec> (reduced resolution while moving)" << std::endl;
+		std::cerr << "         --checkpoint <file> [--checkpoint-interval <sec>] [--resume]" << std::endl;
+		std::cerr << "         --dump <file_####.png|ppm|pfm> [--dump-every <passes>] [--dump-queue <frames>]" << std::endl;
+		std::cerr << "         --denoise [--denoise-iterations <n>] [--denoise-sigma <color sigma>] (edge-avoiding a-trous filter)" << std::endl;
+		std::cerr << "         --pass-timeout <sec> (0 = off by default, a device not done by then is removed)" << std::endl;
+		std::cerr << "         --frame-time <sec> (target time per displayed frame, default 0.033)" << std::endl;
+		std::cerr << "         --metrics <port|socket path> (Prometheus metrics of the devices over HTTP)" << std::endl;
+		std::cerr << "         --kernel <rendering_kernel.cl> (kernel source, relative to the working directory)" << std::endl;
+		std::cerr << "         --crop <x,y,w,h> (render only this window, from the top left corner; right drag in the viewer)" << std::endl;
+		std::cerr << "         --no-pbo (display with glDrawPixels instead of mapped pixel buffers)" << std::endl;
+		std::cerr << "         --animation <camera path> [--animation-output <frame_####.png|ppm|pfm>] [--animation-spp <samples>] (headless)" << std::endl;
+		std::cerr << "         --convergence <report.json> --reference <file.pfm> [--convergence-times <sec,...>]" << std::endl;
+		std::cerr << "           [--convergence-thresholds <relMSE,...>] (headless, error against the reference over time)" << std::endl;
+		std::cerr << "         --tiled <file.ppm|pfm> [--tile-rows <rows>] [--tile-spp <samples>] (headless, band by band)" << std::endl;
+
+		RenderOptions options;
+		const std::vector<std::string> args = ParseCommandLine(argc, argv, &options);
 
 		// It is important to initialize OpenGL before OpenCL
 		unsigned int width;
 		unsigned int height;
-		if (argc == 7) {
-			width = atoi(argv[4]);
-			height = atoi(argv[5]);
-		} else if (argc == 1) {
+		if (args.size() == 6) {
+			width = atoi(args[3].c_str());
+			height = atoi(args[4].c_str());
+		} else if (args.size() == 0) {
 			width = 800;
 			height = 600;
 		} else
 			exit(-1);
 
+		// Each animation frame starts from scratch
+		if (!options.animationFile.empty() && options.reprojection) {
+			std::cerr << "The reprojection is not used by the animation mode" << std::endl;
+			options.reprojection = false;
+		}
+
+		// The headless modes have their own bands and frames
+		if ((options.cropWidth > 0) && (!options.tiledOutput.empty() || !options.animationFile.empty() ||
+			!options.convergenceReport.empty()))
+			std::cerr << "The crop window is not used by the headless modes" << std::endl;
+
+		if (!options.convergenceReport.empty() && options.convergenceReference.empty()) {
+			std::cerr << "The convergence report needs a reference image (--reference)" << std::endl;
+			exit(-1);
+		}
+
+		// The last time ends the measurement
+		if (!options.convergenceReport.empty() && options.convergenceTimes.empty()) {
+			std::cerr << "The convergence needs at least one time (--convergence-times)" << std::endl;
+			exit(-1);
+		}
+
+		// Headless: the image is rendered and written one band at a time,
+		// the animation one frame at a time, or the convergence measured
+		if (!options.tiledOutput.empty() || !options.animationFile.empty() || !options.convergenceReport.empty()) {
+			if (args.size() == 6)
+				rtConfig = new RayTracingConfig(args[5], width, height,
+				(atoi(args[0].c_str()) == 1), (atoi(args[1].c_str()) == 1), atoi(args[2].c_str()), options);
+			else
+				rtConfig = new RayTracingConfig("../Scene/cornell_test.scn", width, height, true, true, 0, options);
+
+			// The render threads never return, as with the GLUT main loop
+			if (!options.tiledOutput.empty())
+				exit(rtConfig->RenderTiled() ? EXIT_SUCCESS : EXIT_FAILURE);
+			else if (!options.convergenceReport.empty())
+				exit(rtConfig->RenderConvergence() ? EXIT_SUCCESS : EXIT_FAILURE);
+			else
+				exit(rtConfig->RenderAnimation() ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
 		InitGlut(argc, argv, width, height);
 
-		if (argc == 7)
-			rtConfig = new RayTracingConfig(argv[6], width, height,
-			(atoi(argv[1]) == 1), (atoi(argv[2]) == 1), atoi(argv[3]));
-		else if (argc == 1)
-			rtConfig = new RayTracingConfig("../Scene/cornell_test.scn", width, height, true, true, 0);
+		if (args.size() == 6)
+			rtConfig = new RayTracingConfig(args[5], width, height,
+			(atoi(args[0].c_str()) == 1), (atoi(args[1].c_str()) == 1), atoi(args[2].c_str()), options);
 		else
-			exit(-1);
+			rtConfig = new RayTracingConfig("../Scene/cornell_test.scn", width, height, true, true, 0, options);
 
 		RunGlut();
 
 	} catch (cl::Error e) {
 		std::cerr << "ERROR: " << e.what() << "[" << e.err() << "]" << std::endl;
 		return EXIT_FAILURE;
+	} catch (std::runtime_error& e) {
+		std::cerr << "ERROR: " << e.what() << std::endl;
+		return EXIT_FAILURE;
 	}
 
 	if (rtConfig) {
@@ -55,4 +275,4 @@ int main(int argc, char *argv[]) {
 	return EXIT_SUCCESS;
 
 
-}
\ No newline at end of file
+}
@@ -0,0 +1,252 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#include <iostream>
+#include <functional>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#include "MetricsServer.hpp"
+
+
+// Milliseconds between two checks of the stop flag, and given to a client
+// to send its request
+static const int kPollTimeout = 200;
+static const int kRequestTimeout = 1000;
+
+static std::string EscapeLabel(const std::string& value) {
+	std::string result;
+	for (size_t i = 0; i < value.length(); ++i) {
+		if ((value[i] == '"') || (value[i] == '\\'))
+			result += '\\';
+
+		if (value[i] == '\n')
+			result += "\\n";
+		else
+			result += value[i];
+	}
+
+	return result;
+}
+
+static bool IsPortNumber(const std::string& address) {
+	if (address.empty() || (address.length() > 5))
+		return false;
+
+	for (size_t i = 0; i < address.length(); ++i) {
+		if ((address[i] < '0') || (address[i] > '9'))
+			return false;
+	}
+
+	return true;
+}
+
+
+MetricsServer::MetricsServer(const std::string& addr, const std::vector<std::string>& deviceNames,
+	const std::vector<const DeviceMetrics *>& devices) : address(addr), deviceMetrics(devices) {
+
+	for (size_t i = 0; i < deviceNames.size(); ++i)
+		deviceLabels.push_back(EscapeLabel(deviceNames[i]));
+
+#ifdef _WIN32
+	std::cerr << "Metrics: not supported on this platform" << std::endl;
+#else
+	if (IsPortNumber(address)) {
+		listenSocket = socket(AF_INET, SOCK_STREAM, 0);
+
+		const int reuse = 1;
+		setsockopt(listenSocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		// Local only: the endpoint has no authentication
+		sockaddr_in addrIn;
+		memset(&addrIn, 0, sizeof(addrIn));
+		addrIn.sin_family = AF_INET;
+		addrIn.sin_port = htons(static_cast<uint16_t>(atoi(address.c_str())));
+		addrIn.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if ((listenSocket >= 0) && (bind(listenSocket, reinterpret_cast<sockaddr *>(&addrIn), sizeof(addrIn)) != 0)) {
+			close(listenSocket);
+			listenSocket = -1;
+		}
+	} else {
+		listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+		sockaddr_un addrUn;
+		memset(&addrUn, 0, sizeof(addrUn));
+		addrUn.sun_family = AF_UNIX;
+		strncpy(addrUn.sun_path, address.c_str(), sizeof(addrUn.sun_path) - 1);
+
+		// A socket left by a previous run
+		unlink(addrUn.sun_path);
+
+		if ((listenSocket >= 0) && (bind(listenSocket, reinterpret_cast<sockaddr *>(&addrUn), sizeof(addrUn)) != 0)) {
+			close(listenSocket);
+			listenSocket = -1;
+		}
+	}
+
+	if ((listenSocket >= 0) && (listen(listenSocket, 4) != 0)) {
+		close(listenSocket);
+		listenSocket = -1;
+	}
+
+	if (listenSocket < 0) {
+		std::cerr << "Metrics: unable to listen on " << address << ": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	std::cerr << "Metrics: serving on " << (IsPortNumber(address) ? "http://127.0.0.1:" : "") << address << std::endl;
+
+	serverThread = new std::thread(std::bind(MetricsServer::ServerThread, this));
+#endif
+}
+
+MetricsServer::~MetricsServer() {
+	stop = true;
+
+	if (serverThread) {
+		serverThread->join();
+		delete serverThread;
+	}
+
+#ifndef _WIN32
+	if (listenSocket >= 0) {
+		close(listenSocket);
+		if (!IsPortNumber(address))
+			unlink(address.c_str());
+	}
+#endif
+}
+
+bool MetricsServer::IsRunning() const {
+	return serverThread != nullptr;
+}
+
+std::string MetricsServer::FormatMetrics() const {
+	struct Metric {
+		const char *name;
+		const char *type;
+		const char *help;
+	};
+
+	static const Metric kMetrics[] = {
+		{ "raytracer_samples_total", "counter", "Pixel samples rendered" },
+		{ "raytracer_passes_total", "counter", "Kernel launches" },
+		{ "raytracer_kernel_seconds_total", "counter", "Kernel execution time" },
+		{ "raytracer_queue_wait_seconds_total", "counter", "Time between the kernel enqueue and its start" },
+		{ "raytracer_read_bytes_total", "counter", "Bytes transferred from the device" },
+		{ "raytracer_written_bytes_total", "counter", "Bytes transferred to the device" },
+		{ "raytracer_memory_bytes", "gauge", "Device buffers allocated for the workload" },
+		{ "raytracer_work_pixels", "gauge", "Pixels assigned to the device" },
+		{ "raytracer_samples_per_pixel", "gauge", "Samples per pixel accumulated" },
+		{ "raytracer_samples_per_second", "gauge", "Pixel samples per second of the last kernel" },
+		{ "raytracer_performance_share", "gauge", "Share of the performance index used for the workload split" }
+	};
+
+	std::string text;
+	char line[512];
+
+	for (size_t m = 0; m < sizeof(kMetrics) / sizeof(kMetrics[0]); ++m) {
+		text += std::string("# HELP ") + kMetrics[m].name + " " + kMetrics[m].help + "\n";
+		text += std::string("# TYPE ") + kMetrics[m].name + " " + kMetrics[m].type + "\n";
+
+		for (size_t i = 0; i < deviceMetrics.size(); ++i) {
+			const DeviceMetrics& d = *deviceMetrics[i];
+
+			double value = 0.0;
+			switch (m) {
+				case 0: value = static_cast<double>(d.samples.load()); break;
+				case 1: value = static_cast<double>(d.passes.load()); break;
+				case 2: value = d.kernelNanoseconds.load() / 1e9; break;
+				case 3: value = d.queueWaitNanoseconds.load() / 1e9; break;
+				case 4: value = static_cast<double>(d.bytesRead.load()); break;
+				case 5: value = static_cast<double>(d.bytesWritten.load()); break;
+				case 6: value = static_cast<double>(d.memoryBytes.load()); break;
+				case 7: value = static_cast<double>(d.workAmount.load()); break;
+				case 8: value = static_cast<double>(d.samplesPerPixel.load()); break;
+				case 9: value = d.samplesPerSecond.load(); break;
+				default: value = d.performanceShare.load(); break;
+			}
+
+			snprintf(line, sizeof(line), "%s{device=\"%s\",index=\"%u\"} %.17g\n", kMetrics[m].name,
+				deviceLabels[i].c_str(), static_cast<unsigned int>(i), value);
+			text += line;
+		}
+	}
+
+	return text;
+}
+
+void MetricsServer::ServerThread(MetricsServer *server) {
+#ifndef _WIN32
+	pollfd listenPoll;
+	listenPoll.fd = server->listenSocket;
+	listenPoll.events = POLLIN;
+
+	while (!server->stop) {
+		listenPoll.revents = 0;
+		if (poll(&listenPoll, 1, kPollTimeout) <= 0)
+			continue;
+
+		const int connection = accept(server->listenSocket, nullptr, nullptr);
+		if (connection < 0)
+			continue;
+
+		server->Serve(connection);
+		close(connection);
+	}
+#endif
+}
+
+void MetricsServer::Serve(const int connection) const {
+#ifndef _WIN32
+	// Any request gets the metrics: only the end of the headers is awaited
+	std::string request;
+	char buffer[1024];
+
+	pollfd clientPoll;
+	clientPoll.fd = connection;
+	clientPoll.events = POLLIN;
+
+	while ((request.find("\r\n\r\n") == std::string::npos) && (request.find("\n\n") == std::string::npos) &&
+		(request.length() < 8192)) {
+		clientPoll.revents = 0;
+		if (poll(&clientPoll, 1, kRequestTimeout) <= 0)
+			return;
+
+		const ssize_t received = recv(connection, buffer, sizeof(buffer), 0);
+		if (received <= 0)
+			return;
+
+		request.append(buffer, received);
+	}
+
+	const std::string body = FormatMetrics();
+	const std::string response = "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: " + std::to_string(body.length()) + "\r\n"
+		"Connection: close\r\n\r\n" + body;
+
+	size_t sent = 0;
+	while (sent < response.length()) {
+		const ssize_t n = send(connection, response.data() + sent, response.length() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			return;
+
+		sent += n;
+	}
+#endif
+}
@@ -0,0 +1,184 @@
+#include <cstring>
+#include <cstddef>
+
+#include <iostream>
+#include <string>
+#include <algorithm>
+
+#include <GL/glut.h>
+#ifdef FREEGLUT
+#include <GL/freeglut_ext.h>
+#endif
+
+#include "PixelBufferRing.hpp"
+
+
+#ifndef APIENTRY
+#define APIENTRY
+#endif
+
+// GL 1.5 / 3.2 / 4.4 entry points and tokens, loaded at run time
+#define RT_GL_PIXEL_UNPACK_BUFFER 0x88EC
+#define RT_GL_MAP_WRITE_BIT 0x0002
+#define RT_GL_MAP_PERSISTENT_BIT 0x0040
+#define RT_GL_MAP_COHERENT_BIT 0x0080
+#define RT_GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#define RT_GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#define RT_GL_CLAMP_TO_EDGE 0x812F
+#define RT_GL_RGBA8 0x8058
+
+typedef void (APIENTRY *RTGenBuffersProc)(GLsizei n, GLuint *buffers);
+typedef void (APIENTRY *RTDeleteBuffersProc)(GLsizei n, const GLuint *buffers);
+typedef void (APIENTRY *RTBindBufferProc)(GLenum target, GLuint buffer);
+typedef void (APIENTRY *RTBufferStorageProc)(GLenum target, ptrdiff_t size, const void *data, GLbitfield flags);
+typedef void *(APIENTRY *RTMapBufferRangeProc)(GLenum target, ptrdiff_t offset, ptrdiff_t length, GLbitfield access);
+typedef GLboolean (APIENTRY *RTUnmapBufferProc)(GLenum target);
+typedef void *(APIENTRY *RTFenceSyncProc)(GLenum condition, GLbitfield flags);
+typedef GLenum (APIENTRY *RTClientWaitSyncProc)(void *sync, GLbitfield flags, unsigned long long timeout);
+typedef void (APIENTRY *RTDeleteSyncProc)(void *sync);
+
+static RTGenBuffersProc rtGenBuffers = nullptr;
+static RTDeleteBuffersProc rtDeleteBuffers = nullptr;
+static RTBindBufferProc rtBindBuffer = nullptr;
+static RTBufferStorageProc rtBufferStorage = nullptr;
+static RTMapBufferRangeProc rtMapBufferRange = nullptr;
+static RTUnmapBufferProc rtUnmapBuffer = nullptr;
+static RTFenceSyncProc rtFenceSync = nullptr;
+static RTClientWaitSyncProc rtClientWaitSync = nullptr;
+static RTDeleteSyncProc rtDeleteSync = nullptr;
+
+
+bool PixelBufferRing::IsSupported() {
+#ifdef FREEGLUT
+	const char *extensions = reinterpret_cast<const char *>(glGetString(GL_EXTENSIONS));
+	if (!extensions || !strstr(extensions, "GL_ARB_buffer_storage") || !strstr(extensions, "GL_ARB_sync"))
+		return false;
+
+	rtGenBuffers = (RTGenBuffersProc)glutGetProcAddress("glGenBuffers");
+	rtDeleteBuffers = (RTDeleteBuffersProc)glutGetProcAddress("glDeleteBuffers");
+	rtBindBuffer = (RTBindBufferProc)glutGetProcAddress("glBindBuffer");
+	rtBufferStorage = (RTBufferStorageProc)glutGetProcAddress("glBufferStorage");
+	rtMapBufferRange = (RTMapBufferRangeProc)glutGetProcAddress("glMapBufferRange");
+	rtUnmapBuffer = (RTUnmapBufferProc)glutGetProcAddress("glUnmapBuffer");
+	rtFenceSync = (RTFenceSyncProc)glutGetProcAddress("glFenceSync");
+	rtClientWaitSync = (RTClientWaitSyncProc)glutGetProcAddress("glClientWaitSync");
+	rtDeleteSync = (RTDeleteSyncProc)glutGetProcAddress("glDeleteSync");
+
+	return rtGenBuffers && rtDeleteBuffers && rtBindBuffer && rtBufferStorage && rtMapBufferRange &&
+		rtUnmapBuffer && rtFenceSync && rtClientWaitSync && rtDeleteSync;
+#else
+	// No portable way to load the entry points
+	return false;
+#endif
+}
+
+
+PixelBufferRing::PixelBufferRing(const unsigned int w, const unsigned int h, const unsigned int slotCount) :
+	width(w), height(h), buffers(slotCount, 0), mappedPixels(slotCount, nullptr), fences(slotCount, nullptr) {
+
+	const ptrdiff_t size = sizeof(unsigned int) * width * height;
+
+	for (size_t i = 0; i < buffers.size(); ++i)
+		MapSlot(i);
+
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, RT_GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, RT_GL_CLAMP_TO_EDGE);
+	glTexImage2D(GL_TEXTURE_2D, 0, RT_GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	std::cerr << "Display: " << buffers.size() << " persistently mapped PBOs of " << (size / 1024) << "Kb" << std::endl;
+}
+
+void PixelBufferRing::MapSlot(const size_t slot) {
+	const ptrdiff_t size = sizeof(unsigned int) * width * height;
+	const GLbitfield flags = RT_GL_MAP_WRITE_BIT | RT_GL_MAP_PERSISTENT_BIT | RT_GL_MAP_COHERENT_BIT;
+
+	rtGenBuffers(1, &buffers[slot]);
+	rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, buffers[slot]);
+	rtBufferStorage(RT_GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+	mappedPixels[slot] = static_cast<unsigned int *>(rtMapBufferRange(RT_GL_PIXEL_UNPACK_BUFFER, 0, size, flags));
+	rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, 0);
+}
+
+PixelBufferRing::~PixelBufferRing() {
+	for (size_t i = 0; i < buffers.size(); ++i) {
+		if (fences[i])
+			rtDeleteSync(fences[i]);
+
+		rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, buffers[i]);
+		rtUnmapBuffer(RT_GL_PIXEL_UNPACK_BUFFER);
+	}
+	rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, 0);
+
+	rtDeleteBuffers(static_cast<GLsizei>(buffers.size()), &buffers[0]);
+	glDeleteTextures(1, &texture);
+}
+
+unsigned int PixelBufferRing::GetWidth() const {
+	return width;
+}
+
+unsigned int PixelBufferRing::GetHeight() const {
+	return height;
+}
+
+unsigned int *PixelBufferRing::BeginFrame() {
+	currentSlot = (currentSlot + 1) % buffers.size();
+
+	// The texture upload from this slot may still be pending
+	if (fences[currentSlot]) {
+		rtClientWaitSync(fences[currentSlot], RT_GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+		rtDeleteSync(fences[currentSlot]);
+		fences[currentSlot] = nullptr;
+	}
+
+	return mappedPixels[currentSlot];
+}
+
+void PixelBufferRing::EndFrame(const unsigned int *framePixels) {
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	if (framePixels == mappedPixels[currentSlot]) {
+		rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, buffers[currentSlot]);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+		rtBindBuffer(RT_GL_PIXEL_UNPACK_BUFFER, 0);
+
+		fences[currentSlot] = rtFenceSync(RT_GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	} else if (std::find(mappedPixels.begin(), mappedPixels.end(), framePixels) == mappedPixels.end()) {
+		// Mapped memory is write only: the frame of an earlier slot (kept
+		// after a failed pass) is in the texture already
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, framePixels);
+	}
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+void PixelBufferRing::RetireSlot() {
+	// BeginFrame() waited for the fence of the slot
+	retiredBuffers.push_back(buffers[currentSlot]);
+	MapSlot(currentSlot);
+}
+
+void PixelBufferRing::Draw() const {
+	glEnable(GL_TEXTURE_2D);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_REPLACE);
+
+	glBegin(GL_QUADS);
+	glTexCoord2f(0.f, 0.f);
+	glVertex2f(0.f, 0.f);
+	glTexCoord2f(1.f, 0.f);
+	glVertex2f(width - 1.f, 0.f);
+	glTexCoord2f(1.f, 1.f);
+	glVertex2f(width - 1.f, height - 1.f);
+	glTexCoord2f(0.f, 1.f);
+	glVertex2f(0.f, height - 1.f);
+	glEnd();
+
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+}
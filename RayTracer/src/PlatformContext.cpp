@@ -0,0 +1,269 @@
+#include <iostream>
+#include <algorithm>
+
+#include "PlatformContext.hpp"
+#include "BlueNoise.hpp"
+
+const unsigned int PlatformContext::kSphereImageRowSpheres = 1024;
+const unsigned int PlatformContext::kBlueNoiseSize = 64;
+
+PlatformContext::PlatformContext(const cl::Platform& platform, const std::vector<cl::Device>& devices,
+	Camera *camera, Sphere *spheres, const unsigned int sceneSphereCount,
+	const std::vector<Sphere>& prototypeSpheres, const std::vector<Instance>& instances,
+	const std::vector<MeshBVHNode>& instanceNodes, const std::vector<Mesh>& meshes, const std::vector<MappedMesh *>& meshFiles) :
+	contextDevices(devices), sphereCount(sceneSphereCount), sceneSpheres(spheres), instanceCount(static_cast<unsigned int>(instances.size())),
+	meshCount(static_cast<unsigned int>(meshes.size())) {
+
+	platformName = platform.getInfo<CL_PLATFORM_NAME>().c_str();
+
+	// Allocate a context with all the selected devices of the platform
+	cl_context_properties cps[3] = {
+		CL_CONTEXT_PLATFORM, (cl_context_properties)platform(), 0
+	};
+	context = cl::Context(contextDevices, cps);
+
+	// Uploads of the shared buffers go through the first device
+	uploadQueue = cl::CommandQueue(context, contextDevices[0]);
+
+	// Create camera buffer. The camera and the spheres live in device memory
+	// only: StageFrame() swaps them with a second generation, which must not
+	// alias the host copies.
+	cameraBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Camera));
+	uploadQueue.enqueueWriteBuffer(cameraBuffer, CL_TRUE, 0, sizeof(Camera), camera);
+
+	std::cerr << "[Platform::" << platformName << "] CameraBuffer size: " << (sizeof(Camera) / 1024) << "Kb" << std::endl;
+
+	sphereBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Sphere) * std::max(1u, sphereCount));
+	if (sphereCount > 0)
+		uploadQueue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(Sphere) * sphereCount, spheres);
+
+	std::cerr << "[Platform::" << platformName << "] SceneBuffer size: " << (sizeof(Sphere) * sphereCount / 1024) << "Kb"
+		<< " shared by " << contextDevices.size() << " device(s)" << std::endl;
+
+	// OpenCL buffers can not be empty
+	std::vector<Instance> instanceData(instances);
+	std::vector<MeshBVHNode> instanceNodeData(instanceNodes);
+	std::vector<Sphere> prototypeData(prototypeSpheres);
+	if (instanceData.empty())
+		instanceData.resize(1);
+	if (instanceNodeData.empty())
+		instanceNodeData.resize(1);
+	if (prototypeData.empty())
+		prototypeData.resize(1);
+
+	instanceBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(Instance) * instanceData.size(), instanceData.data());
+	instanceNodeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(MeshBVHNode) * instanceNodeData.size(), instanceNodeData.data());
+	prototypeSphereBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(Sphere) * prototypeData.size(), prototypeData.data());
+
+	constantSceneSize = sizeof(Camera) + sizeof(Sphere) * sphereCount +
+		sizeof(Instance) * instanceData.size() + sizeof(Sphere) * prototypeData.size();
+
+	if (instanceCount > 0)
+		std::cerr << "[Platform::" << platformName << "] InstanceBuffer size: " <<
+			((sizeof(Instance) * instanceData.size() + sizeof(MeshBVHNode) * instanceNodeData.size() +
+			sizeof(Sphere) * prototypeData.size()) / 1024) << "Kb" <<
+			" for " << instanceCount << " instance(s) of " << prototypeData.size() << " prototype sphere(s)" << std::endl;
+
+	// The meshes are copied from their mapped files, one after the other
+	size_t vertexSize = 0;
+	size_t indexSize = 0;
+	size_t nodeSize = 0;
+	for (size_t i = 0; i < meshFiles.size(); ++i) {
+		vertexSize += sizeof(uint16_t) * 3 * meshFiles[i]->GetVertexCount();
+		indexSize += sizeof(uint32_t) * 3 * meshFiles[i]->GetTriangleCount();
+		nodeSize += sizeof(MeshBVHNode) * meshFiles[i]->GetNodeCount();
+	}
+
+	std::vector<Mesh> meshData(meshes);
+	if (meshData.empty())
+		meshData.resize(1);
+
+	meshBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+		sizeof(Mesh) * meshData.size(), meshData.data());
+	constantSceneSize += sizeof(Mesh) * meshData.size();
+	meshVertexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(vertexSize, sizeof(uint32_t)));
+	meshIndexBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(indexSize, sizeof(uint32_t)));
+	meshNodeBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, std::max<size_t>(nodeSize, sizeof(MeshBVHNode)));
+
+	vertexSize = indexSize = nodeSize = 0;
+	for (size_t i = 0; i < meshFiles.size(); ++i) {
+		const MappedMesh *mesh = meshFiles[i];
+		const size_t v = sizeof(uint16_t) * 3 * mesh->GetVertexCount();
+		const size_t t = sizeof(uint32_t) * 3 * mesh->GetTriangleCount();
+		const size_t n = sizeof(MeshBVHNode) * mesh->GetNodeCount();
+
+		uploadQueue.enqueueWriteBuffer(meshVertexBuffer, CL_TRUE, vertexSize, v, mesh->GetVertices());
+		uploadQueue.enqueueWriteBuffer(meshIndexBuffer, CL_TRUE, indexSize, t, mesh->GetIndices());
+		uploadQueue.enqueueWriteBuffer(meshNodeBuffer, CL_TRUE, nodeSize, n, mesh->GetNodes());
+
+		vertexSize += v;
+		indexSize += t;
+		nodeSize += n;
+	}
+
+	if (meshCount > 0)
+		std::cerr << "[Platform::" << platformName << "] MeshBuffers size: " <<
+			((vertexSize + indexSize + nodeSize) / 1024) << "Kb for " << meshCount << " mesh(es)" << std::endl;
+}
+
+const std::string& PlatformContext::GetPlatformName() const {
+	return platformName;
+}
+
+const cl::Context& PlatformContext::GetContext() const {
+	return context;
+}
+
+const std::vector<cl::Device>& PlatformContext::GetDevices() const {
+	return contextDevices;
+}
+
+const cl::Buffer& PlatformContext::GetCameraBuffer() const {
+	return cameraBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetSceneBuffer() const {
+	return sphereBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetInstanceBuffer() const {
+	return instanceBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetInstanceNodeBuffer() const {
+	return instanceNodeBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetPrototypeSphereBuffer() const {
+	return prototypeSphereBuffer;
+}
+
+unsigned int PlatformContext::GetInstanceCount() const {
+	return instanceCount;
+}
+
+const cl::Buffer& PlatformContext::GetMeshBuffer() const {
+	return meshBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetMeshVertexBuffer() const {
+	return meshVertexBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetMeshIndexBuffer() const {
+	return meshIndexBuffer;
+}
+
+const cl::Buffer& PlatformContext::GetMeshNodeBuffer() const {
+	return meshNodeBuffer;
+}
+
+unsigned int PlatformContext::GetMeshCount() const {
+	return meshCount;
+}
+
+const cl::Image2D& PlatformContext::GetSphereImage() {
+	if (!sphereImage()) {
+		sphereImage = cl::Image2D(context, CL_MEM_READ_ONLY, cl::ImageFormat(CL_RGBA, CL_FLOAT),
+			GetSphereImageWidth(), GetSphereImageHeight());
+		WriteSphereImage(sceneSpheres);
+
+		std::cerr << "[Platform::" << platformName << "] SphereImage size: " << GetSphereImageWidth() << "x" <<
+			GetSphereImageHeight() << " texels" << std::endl;
+	}
+
+	return sphereImage;
+}
+
+unsigned int PlatformContext::GetSphereImageWidth() const {
+	return 3 * std::max(1u, std::min(sphereCount, kSphereImageRowSpheres));
+}
+
+unsigned int PlatformContext::GetSphereImageHeight() const {
+	return std::max(1u, (sphereCount + kSphereImageRowSpheres - 1) / kSphereImageRowSpheres);
+}
+
+const cl::Buffer& PlatformContext::GetBlueNoiseBuffer() {
+	if (!blueNoiseBuffer()) {
+		std::vector<float> tile = MakeBlueNoiseTile(kBlueNoiseSize);
+		blueNoiseBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+			sizeof(float) * tile.size(), &tile[0]);
+
+		std::cerr << "[Platform::" << platformName << "] BlueNoise size: " << kBlueNoiseSize << "x" <<
+			kBlueNoiseSize << std::endl;
+	}
+
+	return blueNoiseBuffer;
+}
+
+size_t PlatformContext::GetConstantSceneSize() const {
+	return constantSceneSize;
+}
+
+void PlatformContext::WriteSphereImage(const Sphere *spheres) {
+	const unsigned int width = GetSphereImageWidth();
+	const unsigned int height = GetSphereImageHeight();
+
+	// Same layout as FetchSphere() in the kernel
+	std::vector<float> texels(4 * width * height, 0.f);
+	for (unsigned int i = 0; i < sphereCount; ++i) {
+		const Sphere& s = spheres[i];
+		const size_t x = 3 * (i % kSphereImageRowSpheres);
+		const size_t y = i / kSphereImageRowSpheres;
+		float *t = &texels[4 * (y * width + x)];
+
+		t[0] = s.rad;
+		t[1] = s.p.x; t[2] = s.p.y; t[3] = s.p.z;
+		t[4] = s.e.x; t[5] = s.e.y; t[6] = s.e.z;
+		t[7] = s.c.x; t[8] = s.c.y; t[9] = s.c.z;
+		t[10] = static_cast<float>(s.refl);
+	}
+
+	cl::size_t<3> origin;
+	cl::size_t<3> region;
+	region[0] = width;
+	region[1] = height;
+	region[2] = 1;
+	uploadQueue.enqueueWriteImage(sphereImage, CL_TRUE, origin, region, 0, 0, texels.data());
+}
+
+void PlatformContext::UpdateCameraBuffer(Camera *camera) {
+	uploadQueue.enqueueWriteBuffer(cameraBuffer, CL_TRUE, 0, sizeof(Camera), camera);
+}
+
+void PlatformContext::UpdateSceneBuffer(Sphere *spheres) {
+	if (sphereCount > 0)
+		uploadQueue.enqueueWriteBuffer(sphereBuffer, CL_TRUE, 0, sizeof(Sphere) * sphereCount, spheres);
+
+	if (sphereImage())
+		WriteSphereImage(spheres);
+}
+
+void PlatformContext::StageFrame(const Camera *camera, const Sphere *spheres) {
+	if (!stagedCameraBuffer()) {
+		stagedCameraBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Camera));
+		stagedSphereBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(Sphere) * std::max(1u, sphereCount));
+	}
+
+	uploadQueue.enqueueWriteBuffer(stagedCameraBuffer, CL_FALSE, 0, sizeof(Camera), camera);
+	if (sphereCount > 0)
+		uploadQueue.enqueueWriteBuffer(stagedSphereBuffer, CL_FALSE, 0, sizeof(Sphere) * sphereCount, spheres);
+	uploadQueue.flush();
+
+	stagedSpheres = spheres;
+}
+
+void PlatformContext::SwapFrameBuffers() {
+	uploadQueue.finish();
+
+	std::swap(cameraBuffer, stagedCameraBuffer);
+	std::swap(sphereBuffer, stagedSphereBuffer);
+
+	// The image is not double buffered, it is only read between two frames
+	if (sphereImage() && stagedSpheres)
+		WriteSphereImage(stagedSpheres);
+	stagedSpheres = nullptr;
+}
@@ -1,112 +1,323 @@
 
 #include <iostream>
+#include <cstring>
+#include <cmath>
 #include <algorithm>
+#include <functional>
+#include <stdexcept>
 
 #include "RayTracingConfig.hpp"
+#include "Reprojection.hpp"
+#include "Denoise.hpp"
+#include "CameraPath.hpp"
+#include "ImageIO.hpp"
+#include "Convergence.hpp"
 #include "Utility.hpp"
+#include "ThreadAffinity.hpp"
 
 
-const std::string RayTracingConfig::kDefaultKernelPath = "../RayTracer/kernel/rendering_kernel.cl";
 const unsigned int RayTracingConfig::kDefaultWidth = 800;
 const unsigned int RayTracingConfig::kDefaultHeight = 600;
+const unsigned int RayTracingConfig::kMaxPreviewScale = 8;
+const unsigned int RayTracingConfig::kMaxSamplesPerLaunch = 16;
+const unsigned int RayTracingConfig::kMaxNumaNodes = 64;
 
 
 RayTracingConfig::RayTracingConfig(const std::string &sceneFileName, const unsigned int w,
 	const unsigned int h, const bool useCPUs, const bool useGPUs,
-	const unsigned int forceGPUWorkSize) :
+	const unsigned int forceGPUWorkSize, const RenderOptions& renderOptions) :
 	selectedDevice(0), width(w), height(h), currentSample(0),
-	threadStartBarrier(nullptr), threadEndBarrier(nullptr) {
+	threadStartBarrier(nullptr), threadEndBarrier(nullptr), options(renderOptions), sceneFile(sceneFileName) {
+	SceneData scene;
+	if (!ReadSceneFile(sceneFileName, &scene))
+		throw std::runtime_error("Unable to read the scene " + sceneFileName);
+
+	Init(scene, useCPUs, useGPUs, forceGPUWorkSize);
+}
+
+RayTracingConfig::RayTracingConfig(const SceneData& scene, const unsigned int w,
+	const unsigned int h, const bool useCPUs, const bool useGPUs,
+	const unsigned int forceGPUWorkSize, const RenderOptions& renderOptions) :
+	selectedDevice(0), width(w), height(h), currentSample(0),
+	threadStartBarrier(nullptr), threadEndBarrier(nullptr), options(renderOptions) {
+	Init(scene, useCPUs, useGPUs, forceGPUWorkSize);
+}
+
+void RayTracingConfig::Init(const SceneData& scene, const bool useCPUs, const bool useGPUs,
+	const unsigned int forceGPUWorkSize) {
 	captionBuffer[0] = 0;
-	computingUnitsPerfIndex.resize(computingUnits.size(), 1.f);
+	renderWidth = width;
+	renderHeight = height;
+	frameTimeController = FrameTimeController(options.frameTime, kMaxSamplesPerLaunch);
+
+	// The destructor does not run when the constructor throws
+	try {
+		if (!LoadScene(scene))
+			throw std::runtime_error("Invalid scene");
+		SetUpOpenCL(useCPUs, useGPUs, forceGPUWorkSize);
+
+		// Do the profiling only if there are more than 1 device
+		workLoadProfilingFlag = (computingUnits.size() > 1);
+		timeFirstWorkloadUpdate = std::chrono::system_clock::now();
+
+		// The headless modes never have a whole frame to save, or to save again
+		const bool headless = IsHeadless();
+		if (!options.checkpointFile.empty() && !headless) {
+			if (options.resume)
+				ResumeFromCheckpoint();
+
+			checkpointWriter = new CheckpointWriter(options.checkpointFile);
+			timeLastCheckpoint = std::chrono::system_clock::now();
+		}
+
+		if (!options.dumpFile.empty() && (options.dumpInterval > 0) && !headless)
+			imageWriter = new ImageWriter(options.dumpQueueSize);
 
-	ReadSceneFile(sceneFileName);	//need to be changed
-	SetUpOpenCL(useCPUs, useGPUs, forceGPUWorkSize);
+		if (!options.metricsAddress.empty()) {
+			std::vector<std::string> deviceNames;
+			std::vector<const DeviceMetrics *> deviceMetrics;
+			for (size_t i = 0; i < computingUnits.size(); ++i) {
+				deviceNames.push_back(computingUnits[i]->GetDeviceName());
+				deviceMetrics.push_back(&computingUnits[i]->GetMetrics());
+			}
 
-	// Do the profiling only if there are more than 1 device
-	workLoadProfilingFlag = (computingUnits.size() > 1);
-	timeFirstWorkloadUpdate = std::chrono::system_clock::now();
+			metricsServer = new MetricsServer(options.metricsAddress, deviceNames, deviceMetrics);
+		}
+	} catch (...) {
+		Release();
+		throw;
+	}
 }
 
 RayTracingConfig::~RayTracingConfig() {
+	Release();
+}
+
+void RayTracingConfig::Release() {
+	// Flush the last checkpoint before the devices go away
+	if (checkpointWriter)
+		delete checkpointWriter;
+	if (imageWriter)
+		delete imageWriter;
+	// Stopped before the metrics it reads go away
+	if (metricsServer)
+		delete metricsServer;
+	checkpointWriter = nullptr;
+	imageWriter = nullptr;
+	metricsServer = nullptr;
+
+	// The render threads are waiting for the next pass: release them for good
+	for (size_t i = 0; i < computingUnits.size(); ++i)
+		computingUnits[i]->Stop();
+	if (threadStartBarrier)
+		threadStartBarrier->wait();
+
 	//delete all compting units
 	for (size_t i = 0; i < computingUnits.size(); ++i)
 		delete computingUnits[i];
 
-	delete[] pixels;
+	// A failed unit still stuck in the driver can not be joined: it is left
+	// to its thread
+	for (size_t i = 0; i < failedUnits.size(); ++i) {
+		if (failedUnits[i]->IsThreadDone())
+			delete failedUnits[i];
+		else
+			std::cerr << "[Device::" << failedUnits[i]->GetDeviceName() << "] Still busy, not released" << std::endl;
+	}
+	failedUnits.clear();
+	for (size_t i = 0; i < platformContexts.size(); ++i)
+		delete platformContexts[i];
+	computingUnits.clear();
+	platformContexts.clear();
+
+	delete[] renderPixels;
+	delete[] cropPixels;
 	delete camera;
 	delete[] spheres;
+	for (size_t i = 0; i < meshFiles.size(); ++i)
+		delete meshFiles[i];
+	renderPixels = nullptr;
+	cropPixels = nullptr;
+	camera = nullptr;
+	spheres = nullptr;
+	meshFiles.clear();
 
 	if (threadStartBarrier)
 		delete threadStartBarrier;
 	if (threadEndBarrier)
 		delete threadEndBarrier;
+	threadStartBarrier = nullptr;
+	threadEndBarrier = nullptr;
 }
 
 
-void RayTracingConfig::ReadSceneFile(const std::string& fileName) {
-	fprintf(stderr, "Reading scene: %s\n", fileName.c_str());
+bool RayTracingConfig::LoadScene(const SceneData& scene) {
+	if (scene.spheres.empty()) {
+		fprintf(stderr, "The scene has no sphere\n");
+		return false;
+	}
+
+	fprintf(stderr, "Scene size: %d\n", (int)scene.spheres.size());
+
+	// Nothing is kept unless the whole scene is valid
+	struct Prototype {
+		unsigned int firstSphere, sphereCount;
+		Vec boundCenter;
+		float boundRadius;
+	};
+	std::vector<Prototype> prototypes;
+	std::vector<Sphere> sceneProtoSpheres;
+	std::vector<Instance> sceneInstances;
+	std::vector<Mesh> sceneMeshes;
+	std::vector<MappedMesh *> sceneMeshFiles;
+	size_t instancedSphereCount = 0;
+
+	for (size_t p = 0; p < scene.prototypes.size(); ++p) {
+		const std::vector<Sphere>& protoSpheres = scene.prototypes[p].spheres;
+		if (protoSpheres.empty()) {
+			fprintf(stderr, "Prototype #%d has no sphere\n", (int)p);
+			return false;
+		}
+
+		Prototype proto;
+		proto.firstSphere = static_cast<unsigned int>(sceneProtoSpheres.size());
+		proto.sphereCount = static_cast<unsigned int>(protoSpheres.size());
+
+		Vec bmin(1e20f, 1e20f, 1e20f);
+		Vec bmax(-1e20f, -1e20f, -1e20f);
+		for (unsigned int i = 0; i < proto.sphereCount; i++) {
+			const Sphere& s = protoSpheres[i];
+
+			/* Only the top level spheres are sampled as lights */
+			if ((s.e.x != 0.f) || (s.e.y != 0.f) || (s.e.z != 0.f)) {
+				fprintf(stderr, "Light sources can not be instanced (prototype #%d, sphere #%d)\n", (int)p, i);
+				return false;
+			}
+
+			bmin = Vec(std::min(bmin.x, s.p.x - s.rad), std::min(bmin.y, s.p.y - s.rad), std::min(bmin.z, s.p.z - s.rad));
+			bmax = Vec(std::max(bmax.x, s.p.x + s.rad), std::max(bmax.y, s.p.y + s.rad), std::max(bmax.z, s.p.z + s.rad));
+		}
 
-	FILE *f = fopen(fileName.c_str(), "r");
-	if (!f) {
-		fprintf(stderr, "Failed to open file: %s\n", fileName.c_str());
-		exit(-1);
+		proto.boundCenter = (bmin + bmax) * .5f;
+		proto.boundRadius = 0.f;
+		for (unsigned int i = 0; i < proto.sphereCount; i++) {
+			const Sphere& s = protoSpheres[i];
+			Vec d = s.p - proto.boundCenter;
+			proto.boundRadius = std::max(proto.boundRadius, sqrtf(d.dot(d)) + s.rad);
+		}
+
+		sceneProtoSpheres.insert(sceneProtoSpheres.end(), protoSpheres.begin(), protoSpheres.end());
+		prototypes.push_back(proto);
 	}
 
-	/* Read the camera position */
-	camera = new Camera();
-	int c = fscanf(f, "camera %f %f %f  %f %f %f\n",
-		&camera->orig.x, &camera->orig.y, &camera->orig.z,
-		&camera->target.x, &camera->target.y, &camera->target.z);
-	if (c != 6) {
-		fprintf(stderr, "Failed to read 6 camera parameters: %d\n", c);
-		exit(-1);
+	for (size_t i = 0; i < scene.instances.size(); ++i) {
+		const SceneInstance& sceneInst = scene.instances[i];
+		if ((sceneInst.prototype >= prototypes.size()) || (sceneInst.scale <= 0.f)) {
+			fprintf(stderr, "Invalid prototype or scale for instance #%d\n", (int)i);
+			return false;
+		}
+
+		const Prototype& proto = prototypes[sceneInst.prototype];
+		Instance inst;
+		inst.translate = sceneInst.translate;
+		inst.scale = sceneInst.scale;
+		inst.firstSphere = proto.firstSphere;
+		inst.sphereCount = proto.sphereCount;
+		inst.boundCenter = proto.boundCenter * inst.scale + inst.translate;
+		inst.boundRadius = proto.boundRadius * inst.scale;
+
+		sceneInstances.push_back(inst);
+		instancedSphereCount += proto.sphereCount;
 	}
 
-	/* Read the sphere count */
-	c = fscanf(f, "size %u\n", &sphereCount);
-	if (c != 1) {
-		fprintf(stderr, "Failed to read sphere count: %d\n", c);
-		exit(-1);
+	// Top level BVH over the instance bounds, the instances are stored in its leaf order
+	std::vector<MeshBVHNode> sceneInstanceNodes;
+	if (!sceneInstances.empty()) {
+		std::vector<BVHPrimitive> bounds(sceneInstances.size());
+		for (size_t i = 0; i < sceneInstances.size(); ++i) {
+			const Instance& inst = sceneInstances[i];
+			const float center[3] = { inst.boundCenter.x, inst.boundCenter.y, inst.boundCenter.z };
+			for (int k = 0; k < 3; ++k) {
+				bounds[i].bmin[k] = center[k] - inst.boundRadius;
+				bounds[i].bmax[k] = center[k] + inst.boundRadius;
+				bounds[i].centroid[k] = center[k];
+			}
+		}
+
+		// Padded by the EPSILON of the kernel against rounding
+		const float padding[3] = { .01f, .01f, .01f };
+		std::vector<uint32_t> order;
+		BuildBVH(bounds, padding, &sceneInstanceNodes, &order);
+
+		std::vector<Instance> sortedInstances(sceneInstances.size());
+		for (size_t i = 0; i < order.size(); ++i)
+			sortedInstances[i] = sceneInstances[order[i]];
+		sceneInstances.swap(sortedInstances);
 	}
 
-	fprintf(stderr, "Scene size: %d\n", sphereCount);
+	for (size_t i = 0; i < scene.meshes.size(); ++i) {
+		MappedMesh *mappedMesh = new MappedMesh();
+		if (!LoadObjMesh(scene.meshes[i].objFileName, mappedMesh)) {
+			delete mappedMesh;
+			for (size_t j = 0; j < sceneMeshFiles.size(); ++j)
+				delete sceneMeshFiles[j];
+			return false;
+		}
 
-	/* Read all spheres */
+		Mesh mesh;
+		mesh.c = scene.meshes[i].c;
+		mesh.refl = scene.meshes[i].refl;
+		mesh.boundMin = mappedMesh->GetBoundMin();
+		mesh.quantScale = mappedMesh->GetQuantScale();
+		mesh.firstVertex = sceneMeshes.empty() ? 0 : (sceneMeshes.back().firstVertex + sceneMeshFiles.back()->GetVertexCount());
+		mesh.firstTriangle = sceneMeshes.empty() ? 0 : (sceneMeshes.back().firstTriangle + sceneMeshFiles.back()->GetTriangleCount());
+		mesh.firstNode = sceneMeshes.empty() ? 0 : (sceneMeshes.back().firstNode + sceneMeshFiles.back()->GetNodeCount());
+
+		sceneMeshes.push_back(mesh);
+		sceneMeshFiles.push_back(mappedMesh);
+	}
+
+	camera = new Camera();
+	camera->orig = scene.cameraOrig;
+	camera->target = scene.cameraTarget;
+
+	sphereCount = static_cast<unsigned int>(scene.spheres.size());
 	spheres = new Sphere[sphereCount];
+	std::copy(scene.spheres.begin(), scene.spheres.end(), spheres);
+
+	prototypeSpheres = sceneProtoSpheres;
+	instances = sceneInstances;
+	instanceNodes = sceneInstanceNodes;
+	meshes = sceneMeshes;
+	meshFiles = sceneMeshFiles;
+
+	// The geometry of the mapped files never changes: hashed once for the checkpoints
+	meshGeometryHash = HashBytes(nullptr, 0);
+	for (size_t i = 0; i < meshFiles.size(); ++i) {
+		const MappedMesh *mesh = meshFiles[i];
+		meshGeometryHash = HashBytes(mesh->GetVertices(), sizeof(uint16_t) * 3 * mesh->GetVertexCount(), meshGeometryHash);
+		meshGeometryHash = HashBytes(mesh->GetIndices(), sizeof(uint32_t) * 3 * mesh->GetTriangleCount(), meshGeometryHash);
+		meshGeometryHash = HashBytes(mesh->GetNodes(), sizeof(MeshBVHNode) * mesh->GetNodeCount(), meshGeometryHash);
+	}
 
-	for (unsigned int i = 0; i < sphereCount; i++) {
-		Sphere *s = &spheres[i];
-		int material;
-		int k = fscanf(f, "sphere %f  %f %f %f  %f %f %f  %f %f %f  %d\n",
-			&s->rad,
-			&s->p.x, &s->p.y, &s->p.z,
-			&s->e.x, &s->e.y, &s->e.z,
-			&s->c.x, &s->c.y, &s->c.z,
-			&material);
-
-		switch (material) {
-		case 0:
-			s->refl = DIFFuse;
-			break;
-		case 1:
-			s->refl = SPECular;
-			break;
-		case 2:
-			s->refl = REFRactive;
-			break;
-		default:
-			fprintf(stderr, "Failed to parse material type for sphere #%d: %d\n", i, material);
-			exit(-1);
-			break;
+	if (!instances.empty())
+		fprintf(stderr, "Instances: %d of %d prototypes (%d unique spheres, %d instanced spheres, %d BVH nodes)\n",
+			(int)instances.size(), (int)prototypes.size(), (int)prototypeSpheres.size(), (int)instancedSphereCount,
+			(int)instanceNodes.size());
+
+	if (!meshes.empty()) {
+		size_t triangleCount = 0;
+		size_t deviceSize = 0;
+		for (size_t i = 0; i < meshFiles.size(); ++i) {
+			triangleCount += meshFiles[i]->GetTriangleCount();
+			deviceSize += meshFiles[i]->GetDeviceSize();
 		}
 
-		if (k != 11) {
-			fprintf(stderr, "Failed to read sphere #%d: %d\n", i, k);
-			exit(-1);
-		}
+		fprintf(stderr, "Meshes: %d, %d triangles, %dKb on each device (%.1f bytes/triangle)\n",
+			(int)meshes.size(), (int)triangleCount, (int)(deviceSize / 1024), deviceSize / (double)triangleCount);
 	}
 
-	fclose(f);
+	return true;
 }
 
 void RayTracingConfig::SetUpOpenCL(const bool useCPUs, const bool useGPUs,
@@ -121,46 +332,94 @@ void RayTracingConfig::SetUpOpenCL(const bool useCPUs, const bool useGPUs,
 	if (platforms.size() == 0)
 		throw std::runtime_error("Unable to find an appropiate OpenCL platform");
 
-	// Select the first platform available
-	cl::Platform platform = platforms[0];
+	// Devices selected on each platform, with their NUMA node (-1 if none)
+	std::vector<cl::Device> selectedDevices;
+	std::vector<int> selectedNumaNodes;
+	std::vector<PlatformContext *> selectedContexts;
 
-	// Get the list of devices available on the platform
-	std::vector<cl::Device> devices;
-	platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+	for (size_t p = 0; p < platforms.size(); ++p) {
+		cl::Platform platform = platforms[p];
 
-	// Device information
-	std::vector<cl::Device> selectedDevices;
-	for (size_t i = 0; i < devices.size(); ++i) {
-		cl_int type = devices[i].getInfo<CL_DEVICE_TYPE>();
-		std::cerr << "OpenCL Device name " << i << " : " <<
-			devices[i].getInfo<CL_DEVICE_NAME>().c_str() << std::endl;
-
-		std::string stype;
-		switch (type) {
-		case CL_DEVICE_TYPE_ALL:
-			stype = "TYPE_ALL";
-			break;
-		case CL_DEVICE_TYPE_DEFAULT:
-			stype = "TYPE_DEFAULT";
-			break;
-		case CL_DEVICE_TYPE_CPU:
-			stype = "TYPE_CPU";
-			if (useCPUs)
-				selectedDevices.push_back(devices[i]);
-			break;
-		case CL_DEVICE_TYPE_GPU:
-			stype = "TYPE_GPU";
-			if (useGPUs)
-				selectedDevices.push_back(devices[i]);
-			break;
-		default:
-			stype = "TYPE_UNKNOWN";
-			break;
+		if (!IsPlatformSelected(platform)) {
+			std::cerr << "OpenCL Platform " << p << " : skipped" << std::endl;
+			continue;
+		}
+
+		// Get the list of devices available on the platform
+		std::vector<cl::Device> devices;
+		try {
+			platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
+		} catch (cl::Error e) {
+			// CL_DEVICE_NOT_FOUND
+			std::cerr << "OpenCL Platform " << p << " : no devices" << std::endl;
+			continue;
 		}
 
-		std::cerr << "OpenCL Device type " << i << ": " << stype << std::endl;
-		std::cerr << "OpenCL Device units " << i << ": " <<
-			devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << std::endl;
+		// Device information
+		std::vector<cl::Device> platformDevices;
+		std::vector<int> platformNumaNodes;
+		for (size_t i = 0; i < devices.size(); ++i) {
+			cl_device_type type = devices[i].getInfo<CL_DEVICE_TYPE>();
+			std::cerr << "OpenCL Device name " << i << " : " <<
+				devices[i].getInfo<CL_DEVICE_NAME>().c_str() << std::endl;
+
+			std::string stype;
+			switch (type) {
+			case CL_DEVICE_TYPE_ALL:
+				stype = "TYPE_ALL";
+				break;
+			case CL_DEVICE_TYPE_DEFAULT:
+				stype = "TYPE_DEFAULT";
+				break;
+			case CL_DEVICE_TYPE_CPU:
+				stype = "TYPE_CPU";
+				if (useCPUs) {
+					std::vector<cl::Device> subDevices;
+					std::vector<int> subDeviceNodes;
+					if (options.numaSplit)
+						subDevices = SplitByNumaNode(devices[i], &subDeviceNodes);
+
+					if (subDevices.empty()) {
+						platformDevices.push_back(devices[i]);
+						platformNumaNodes.push_back(-1);
+					} else {
+						for (size_t j = 0; j < subDevices.size(); ++j) {
+							platformDevices.push_back(subDevices[j]);
+							platformNumaNodes.push_back(subDeviceNodes[j]);
+						}
+					}
+				}
+				break;
+			case CL_DEVICE_TYPE_GPU:
+				stype = "TYPE_GPU";
+				if (useGPUs) {
+					platformDevices.push_back(devices[i]);
+					platformNumaNodes.push_back(-1);
+				}
+				break;
+			default:
+				stype = "TYPE_UNKNOWN";
+				break;
+			}
+
+			std::cerr << "OpenCL Device type " << i << ": " << stype << std::endl;
+			std::cerr << "OpenCL Device units " << i << ": " <<
+				devices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() << std::endl;
+		}
+
+		if (platformDevices.empty())
+			continue;
+
+		// One context per platform, the scene and camera buffers are shared by its devices
+		PlatformContext *platformContext = new PlatformContext(platform, platformDevices,
+			camera, spheres, sphereCount, prototypeSpheres, instances, instanceNodes, meshes, meshFiles);
+		platformContexts.push_back(platformContext);
+
+		for (size_t i = 0; i < platformDevices.size(); ++i) {
+			selectedDevices.push_back(platformDevices[i]);
+			selectedNumaNodes.push_back(platformNumaNodes[i]);
+			selectedContexts.push_back(platformContext);
+		}
 	}
 
 	if (selectedDevices.size() == 0)
@@ -172,10 +431,19 @@ void RayTracingConfig::SetUpOpenCL(const bool useCPUs, const bool useGPUs,
 		threadEndBarrier = new Barrier(selectedDevices.size() + 1);
 
 		for (size_t i = 0; i < selectedDevices.size(); ++i) {
-			computingUnits.push_back(new ComputingUnit(
-				selectedDevices[i], kDefaultKernelPath, forceGPUWorkSize,
-				camera, spheres, sphereCount,
-				threadStartBarrier, threadEndBarrier));
+			try {
+				computingUnits.push_back(new ComputingUnit(selectedContexts[i],
+					selectedDevices[i], options.kernelPath, options, forceGPUWorkSize,
+					sphereCount,
+					threadStartBarrier, threadEndBarrier, selectedNumaNodes[i]));
+			} catch (...) {
+				// The barriers only wait for the units already running
+				for (size_t j = i; j < selectedDevices.size(); ++j) {
+					threadStartBarrier->leave();
+					threadEndBarrier->leave();
+				}
+				throw;
+			}
 		}
 
 		std::cerr << "OpenCL Device used: ";
@@ -186,28 +454,167 @@ void RayTracingConfig::SetUpOpenCL(const bool useCPUs, const bool useGPUs,
 
 	std::cerr << "Create done, width: " << width << ", heigh: " << height << std::endl;
 
-	pixels = new unsigned int[width * height];
+	// The bands are assigned by RenderTiled(), with the same split as the
+	// other modes: every unit starts with the same performance
+	if (!options.tiledOutput.empty()) {
+		computingUnitsPerfIndex.assign(computingUnits.size(), 1.f);
+		ReInitScene();
+		UpdateCamera();
+		return;
+	}
+
+	renderPixels = new unsigned int[width * height];
+	pixels = renderPixels;
 
 	// Test colors
 	for (unsigned int i = 0; i < width * height; ++i)
 		pixels[i] = i;
 
+	if (!IsHeadless())
+		ApplyCropWindow(options.cropX, options.cropY, options.cropWidth, options.cropHeight);
+
 	UpdateDeviceWorkload(true);
 	ReInitScene();
 	ReInit(false);
 }
 
 
+static bool ContainsIgnoreCase(const std::string& str, const std::string& pattern) {
+	std::string a = str;
+	std::string b = pattern;
+	std::transform(a.begin(), a.end(), a.begin(), ::tolower);
+	std::transform(b.begin(), b.end(), b.begin(), ::tolower);
+
+	return a.find(b) != std::string::npos;
+}
+
+bool RayTracingConfig::IsPlatformSelected(const cl::Platform& platform) const {
+	const std::string name = platform.getInfo<CL_PLATFORM_NAME>().c_str();
+	const std::string vendor = platform.getInfo<CL_PLATFORM_VENDOR>().c_str();
+
+	for (size_t i = 0; i < options.platformExclude.size(); ++i) {
+		if (ContainsIgnoreCase(name, options.platformExclude[i]) ||
+			ContainsIgnoreCase(vendor, options.platformExclude[i]))
+			return false;
+	}
+
+	if (options.platformInclude.empty())
+		return true;
+
+	for (size_t i = 0; i < options.platformInclude.size(); ++i) {
+		if (ContainsIgnoreCase(name, options.platformInclude[i]) ||
+			ContainsIgnoreCase(vendor, options.platformInclude[i]))
+			return true;
+	}
+
+	return false;
+}
+
+std::vector<cl::Device> RayTracingConfig::SplitByNumaNode(cl::Device& device, std::vector<int> *nodes) {
+	std::vector<cl::Device> subDevices;
+	nodes->clear();
+
+#ifdef CL_VERSION_1_2
+	try {
+		const cl_device_affinity_domain domains = device.getInfo<CL_DEVICE_PARTITION_AFFINITY_DOMAIN>();
+		if (!(domains & CL_DEVICE_AFFINITY_DOMAIN_NUMA)) {
+			std::cerr << "OpenCL Device does not support NUMA partitioning" << std::endl;
+			return subDevices;
+		}
+
+		const cl_device_partition_property props[] = {
+			CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+		};
+		device.createSubDevices(props, &subDevices);
+
+	} catch (cl::Error e) {
+		std::cerr << "OpenCL Device NUMA partitioning failed: " << e.what() << "(" << e.err() << ")" << std::endl;
+		subDevices.clear();
+	}
+
+	// A single node is no better than the whole device
+	if (subDevices.size() < 2) {
+		subDevices.clear();
+		return subDevices;
+	}
+
+	std::cerr << "OpenCL Device split into " << subDevices.size() << " NUMA sub-devices" << std::endl;
+
+	// OpenCL does not tell which node a sub-device covers. A compute unit
+	// count that only one node has identifies it; the other sub-devices take
+	// the remaining nodes in order, the order of the affinity domain
+	// partition (the nodes in ascending order with the known runtimes).
+	std::vector<std::pair<int, size_t> > nodeCpuCounts;
+	for (unsigned int node = 0; node < kMaxNumaNodes; ++node) {
+		std::vector<unsigned int> cpus;
+		if (GetNumaNodeCpus(node, &cpus))
+			nodeCpuCounts.push_back(std::make_pair(static_cast<int>(node), cpus.size()));
+	}
+
+	if (nodeCpuCounts.size() != subDevices.size()) {
+		std::cerr << "OpenCL Device has " << subDevices.size() << " NUMA sub-devices for " <<
+			nodeCpuCounts.size() << " nodes, mapped in order" << std::endl;
+
+		for (size_t i = 0; i < subDevices.size(); ++i)
+			nodes->push_back(nodeCpuCounts.empty() ? static_cast<int>(i) : nodeCpuCounts[i % nodeCpuCounts.size()].first);
+	} else {
+		nodes->assign(subDevices.size(), -1);
+		std::vector<bool> nodeTaken(nodeCpuCounts.size(), false);
+
+		for (size_t i = 0; i < subDevices.size(); ++i) {
+			size_t computeUnits = 0;
+			try {
+				computeUnits = subDevices[i].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			} catch (cl::Error e) {
+				continue;
+			}
+
+			size_t matches = 0, match = 0;
+			for (size_t j = 0; j < nodeCpuCounts.size(); ++j) {
+				if (nodeCpuCounts[j].second == computeUnits) {
+					match = j;
+					++matches;
+				}
+			}
+
+			if ((matches == 1) && !nodeTaken[match]) {
+				(*nodes)[i] = nodeCpuCounts[match].first;
+				nodeTaken[match] = true;
+			}
+		}
+
+		size_t nextNode = 0;
+		for (size_t i = 0; i < subDevices.size(); ++i) {
+			if ((*nodes)[i] >= 0)
+				continue;
+
+			while (nodeTaken[nextNode])
+				++nextNode;
+			(*nodes)[i] = nodeCpuCounts[nextNode].first;
+			nodeTaken[nextNode] = true;
+		}
+	}
+
+	for (size_t i = 0; i < subDevices.size(); ++i)
+		std::cerr << "OpenCL Sub-device " << i << ": NUMA node " << (*nodes)[i] << std::endl;
+#else
+	std::cerr << "OpenCL 1.2 is required for NUMA partitioning" << std::endl;
+#endif
+
+	return subDevices;
+}
+
+
 void RayTracingConfig::ReInitScene() {
 	// Flush everything
 	for (size_t i = 0; i < computingUnits.size(); ++i)
 		computingUnits[i]->Finish();
 
-	currentSample = 0;
+	RestartAccumulation();
 
 	// Re-download the scene
-	for (size_t i = 0; i < computingUnits.size(); ++i)
-		computingUnits[i]->UpdateSceneBuffer(spheres);
+	for (size_t i = 0; i < platformContexts.size(); ++i)
+		platformContexts[i]->UpdateSceneBuffer(spheres);
 }
 
 
@@ -216,19 +623,35 @@ void RayTracingConfig::ReInit(const bool reallocBuffers) {
 	for (size_t i = 0; i < computingUnits.size(); ++i)
 		computingUnits[i]->Finish();
 
-	currentSample = 0;
+	// A camera move keeps the history that is still visible
+	if (options.reprojection && !reallocBuffers && (currentSample > 0)) {
+		ReprojectHistory();
+		currentSample = 0;
+		return;
+	}
+
+	RestartAccumulation();
 
 	// Check if needed to reallocate buffers
 	if (reallocBuffers) {
-		delete[] pixels;
-		pixels = new unsigned int[width * height];
+		delete[] renderPixels;
+		renderPixels = new unsigned int[width * height];
+		externalRenderPixels = nullptr;
+		pixels = renderPixels;
 
 		// Test colors
 		for (unsigned int i = 0; i < width * height; ++i)
 			pixels[i] = i;
 
+		// The crop window is kept, clipped to the new frame
+		if (IsCropping())
+			ApplyCropWindow(cropX, cropY, renderWidth, renderHeight);
+		else
+			ApplyCropWindow(0, 0, 0, 0);
+
 		// Update devices
 		UpdateDeviceWorkload(false);
+		frameTimeController.Reset();
 	}
 
 	UpdateCamera();
@@ -236,31 +659,615 @@ void RayTracingConfig::ReInit(const bool reallocBuffers) {
 
 
 void RayTracingConfig::Execute() {
-	// Run the kernels
-	if (currentSample < 10000) {
-
-		ExecuteKernels();
-		currentSample++;
+	if (isInteracting) {
+		ExecutePreview();
+		if (isInteracting)
+			return;
+	}
 
-	} else {
-		// After the first 10000 samples, continue to execute for more and more time
-		auto  startTime = std::chrono::system_clock::now();
-		const float k = std::min<unsigned int>(currentSample - 20u, 100u) / 100.f;
-		const float thresholdTime = 0.5f * k;
+	// Run the passes chosen for the frame time, only the last one is read
+	// back for the display
+	auto startTime = std::chrono::system_clock::now();
+	const unsigned int passes = frameTimeController.GetPassesPerFrame();
+	samplesPerLaunch = frameTimeController.GetSamplesPerLaunch();
+
+	unsigned int frameSamples = 0;
+	for (unsigned int pass = 0; pass < passes; ++pass) {
+		if (ExecuteKernels(pass == passes - 1)) {
+			currentSample += samplesPerLaunch;
+			frameSamples += samplesPerLaunch;
+		}
+	}
 
-		while (true) {
+	auto endTime = std::chrono::system_clock::now();
+	frameTimeController.Update(std::chrono::duration_cast<std::chrono::duration<float>>(endTime - startTime).count(),
+		frameSamples);
 
-			ExecuteKernels();
-			currentSample++;
+	CheckDeviceWorkload();
+	CheckCheckpoint();
+}
 
-			auto endTime = std::chrono::system_clock::now();
-			const float elapsedTime = std::chrono::duration_cast<std::chrono::duration<float>>(endTime - startTime).count();
-			if (elapsedTime > thresholdTime)
+bool RayTracingConfig::RenderTiled() {
+	ScanlineImageFile output;
+	if (!output.Open(options.tiledOutput, width, height))
+		return false;
+
+	const unsigned int tileRows = std::max(1u, std::min(options.tileRows, height));
+	const unsigned int tileCount = (height + tileRows - 1) / tileRows;
+	const unsigned int tileSamples = std::max(1u, options.tileSamples);
+
+	std::vector<unsigned int> tilePixels(width * tileRows);
+	// The denoiser needs the colors even for 8 bit outputs
+	const bool readColors = output.IsFloat() || options.denoise;
+	std::vector<Vec> tileColors(readColors ? width * tileRows : 0);
+	std::vector<Feature> tileFeatures(options.denoise ? width * tileRows : 0);
+	const unsigned int denoiseThreads = std::max(1u, std::thread::hardware_concurrency());
+
+	// The denoiser reads up to 2 * (2^iterations - 1) rows away from a pixel:
+	// each band is filtered with this apron of rows from its neighbours, so
+	// a band is written once the bands around it have been rendered. The
+	// window keeps the rendered rows [windowFirstRow, windowFirstRow +
+	// windowRows) that a band still to be written can read.
+	const unsigned int denoiseIterations = std::min(std::max(1u, options.denoiseIterations), 31u);
+	const unsigned int apron = static_cast<unsigned int>(std::min<uint64_t>(height,
+		2 * ((static_cast<uint64_t>(1) << denoiseIterations) - 1)));
+	std::vector<Vec> windowColors;
+	std::vector<Feature> windowFeatures;
+	unsigned int windowFirstRow = 0;
+	unsigned int windowRows = 0;
+	std::vector<std::pair<unsigned int, unsigned int> > pendingBands;	// first row, rows
+
+	// Writes the pending bands whose apron is rendered (all of them once the
+	// last band is), false on a write error
+	auto writeDenoisedBands = [&](const bool allRendered) {
+		while (!pendingBands.empty()) {
+			const unsigned int firstRow = pendingBands.front().first;
+			const unsigned int rows = pendingBands.front().second;
+			const unsigned int lo = (firstRow > apron) ? (firstRow - apron) : 0;
+			const unsigned int hi = std::min(height, firstRow + rows + apron);
+			if (!allRendered && ((lo < windowFirstRow) || (hi > windowFirstRow + windowRows)))
 				break;
+
+			const unsigned int regionFirst = std::max(lo, windowFirstRow);
+			const unsigned int regionRows = std::min(hi, windowFirstRow + windowRows) - regionFirst;
+			const size_t regionStart = static_cast<size_t>(regionFirst - windowFirstRow) * width;
+			const std::vector<Vec> regionColors(windowColors.begin() + regionStart,
+				windowColors.begin() + regionStart + regionRows * width);
+			const std::vector<Feature> regionFeatures(windowFeatures.begin() + regionStart,
+				windowFeatures.begin() + regionStart + regionRows * width);
+
+			std::vector<Vec> denoisedColors;
+			DenoiseATrous(width, regionRows, denoiseIterations, options.denoiseColorSigma,
+				regionColors, regionFeatures, denoiseThreads, &denoisedColors);
+
+			const size_t bandStart = static_cast<size_t>(firstRow - regionFirst) * width;
+			for (size_t i = 0; i < rows * width; ++i) {
+				tileColors[i] = denoisedColors[bandStart + i];
+				tilePixels[i] = ColorToPixel(denoisedColors[bandStart + i]);
+			}
+
+			if (!output.WriteBand(tilePixels.data(), tileColors.data(), rows)) {
+				std::cerr << "Failed to write the band at row " << firstRow << " of " << options.tiledOutput << std::endl;
+				return false;
+			}
+			pendingBands.erase(pendingBands.begin());
+		}
+
+		// Drop the rows out of the apron of the pending bands (the bands go
+		// one way, the rows behind them are not read anymore)
+		if (!pendingBands.empty() && (windowRows > 0)) {
+			unsigned int pendingFirst = height;
+			unsigned int pendingEnd = 0;
+			for (size_t i = 0; i < pendingBands.size(); ++i) {
+				pendingFirst = std::min(pendingFirst, pendingBands[i].first);
+				pendingEnd = std::max(pendingEnd, pendingBands[i].first + pendingBands[i].second);
+			}
+
+			const unsigned int keepFirst = (pendingFirst > apron) ? (pendingFirst - apron) : 0;
+			const unsigned int keepEnd = std::min(height, pendingEnd + apron);
+			const unsigned int first = std::max(keepFirst, windowFirstRow);
+			const unsigned int end = std::max(first, std::min(keepEnd, windowFirstRow + windowRows));
+
+			const size_t dropFront = static_cast<size_t>(first - windowFirstRow) * width;
+			const size_t keep = static_cast<size_t>(end - first) * width;
+			windowColors.erase(windowColors.begin(), windowColors.begin() + dropFront);
+			windowColors.resize(keep);
+			windowFeatures.erase(windowFeatures.begin(), windowFeatures.begin() + dropFront);
+			windowFeatures.resize(keep);
+			windowFirstRow = first;
+			windowRows = end - first;
+		}
+
+		return true;
+	};
+
+	std::cerr << "Tiled rendering: " << tileCount << " bands of " << tileRows << " rows, " <<
+		tileSamples << " spp, " << ((sizeof(Vec) + 3 * sizeof(unsigned int)) * width * tileRows / 1024) <<
+		" Kb of accumulation per band" << std::endl;
+
+	auto startTime = std::chrono::system_clock::now();
+	previewScale = 1;
+
+	for (unsigned int t = 0; t < tileCount; ++t) {
+		// PPM rows are stored from the top of the image, PFM rows from the bottom
+		const unsigned int band = output.IsTopDown() ? (tileCount - 1 - t) : t;
+		const unsigned int firstRow = band * tileRows;
+		const unsigned int rows = std::min(tileRows, height - firstRow);
+		const unsigned int tileOffset = firstRow * width;
+		const unsigned int tileAmount = rows * width;
+
+		// Balance each band with the performance measured on the previous ones
+		if (t > 0) {
+			for (size_t i = 0; i < computingUnits.size(); ++i)
+				computingUnitsPerfIndex[i] = computingUnits[i]->GetPerformance();
+		}
+
+		AssignWorkload(tileOffset, tileAmount);
+
+		// A device failure restarts the band on the other devices
+		RestartAccumulation();
+		while (currentSample < tileSamples) {
+			samplesPerLaunch = std::min(kMaxSamplesPerLaunch, tileSamples - currentSample);
+
+			// Only the last pass of the band is read back
+			const bool lastPass = (currentSample + samplesPerLaunch >= tileSamples);
+			for (size_t i = 0; i < computingUnits.size(); ++i) {
+				computingUnits[i]->SetArgs(currentSample, samplesPerLaunch, previewScale);
+				computingUnits[i]->SetPixelTarget(lastPass ? tilePixels.data() : nullptr, tileOffset, tileAmount);
+			}
+
+			StartPass();
+			if (FinishPass())
+				currentSample += samplesPerLaunch;
+			else if (IsPixelTargetRetired(tilePixels.data())) {
+				// Left to the failed device, the band goes on in a new buffer
+				retiredBands.push_back(new std::vector<unsigned int>());
+				retiredBands.back()->swap(tilePixels);
+				tilePixels.resize(width * tileRows);
+			}
+		}
+
+		if (readColors) {
+			for (size_t i = 0; i < computingUnits.size(); ++i) {
+				const unsigned int offset = computingUnits[i]->GetWorkOffset();
+				if (offset >= tileOffset + tileAmount)
+					continue;
+
+				const size_t count = std::min<size_t>(computingUnits[i]->GetWorkAmount(), tileOffset + tileAmount - offset);
+				computingUnits[i]->ReadAccumulation(&tileColors[offset - tileOffset], nullptr, count, currentSample);
+				if (options.denoise)
+					computingUnits[i]->ReadFeatures(&tileFeatures[offset - tileOffset], count);
+			}
 		}
+
+		if (options.denoise) {
+			// Filtered on the host across the device ranges and the bands: the
+			// band joins the window on the side it was rendered (the last band
+			// may be shorter)
+			if (windowRows == 0)
+				windowFirstRow = firstRow;
+
+			if (firstRow < windowFirstRow) {
+				windowColors.insert(windowColors.begin(), tileColors.begin(), tileColors.begin() + tileAmount);
+				windowFeatures.insert(windowFeatures.begin(), tileFeatures.begin(), tileFeatures.begin() + tileAmount);
+				windowFirstRow = firstRow;
+			} else {
+				windowColors.insert(windowColors.end(), tileColors.begin(), tileColors.begin() + tileAmount);
+				windowFeatures.insert(windowFeatures.end(), tileFeatures.begin(), tileFeatures.begin() + tileAmount);
+			}
+			windowRows += rows;
+
+			pendingBands.push_back(std::make_pair(firstRow, rows));
+			if (!writeDenoisedBands(t + 1 == tileCount))
+				return false;
+		} else if (!output.WriteBand(tilePixels.data(), tileColors.data(), rows)) {
+			std::cerr << "Failed to write band " << band << " of " << options.tiledOutput << std::endl;
+			return false;
+		}
+
+		auto t1 = std::chrono::system_clock::now();
+		std::cerr << "Band " << (t + 1) << "/" << tileCount << " done, " <<
+			std::chrono::duration_cast<std::chrono::duration<double>>(t1 - startTime).count() << " sec" << std::endl;
 	}
 
-	CheckDeviceWorkload();
+	samplesPerLaunch = 1;
+
+	return output.Close();
+}
+
+bool RayTracingConfig::RenderAnimation() {
+	CameraPath path;
+	if (!path.Load(options.animationFile, sphereCount))
+		return false;
+
+	const unsigned int frameCount = path.GetFrameCount();
+	const unsigned int frameSamples = std::max(1u, options.animationSamples);
+	const bool moveSpheres = path.HasSphereKeys();
+
+	// Next frame state, uploaded while the current frame is rendered
+	Camera nextCamera = *camera;
+	std::vector<Sphere> nextSpheres(spheres, spheres + sphereCount);
+
+	path.GetCamera(0, camera);
+	path.GetSpheres(0, spheres);
+	UpdateCamera();
+	ReInitScene();
+
+	ImageWriter writer(std::max(1u, options.dumpQueueSize));
+
+	auto startTime = std::chrono::system_clock::now();
+	previewScale = 1;
+
+	for (unsigned int frame = 0; frame < frameCount; ++frame) {
+		// Frames are never dropped: wait for the writer to catch up
+		ImageFrame *output;
+		while (!(output = writer.Acquire(width, height)))
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+		// A device failure restarts the frame on the other devices
+		bool nextFrameStaged = false;
+		RestartAccumulation();
+		while (currentSample < frameSamples) {
+			samplesPerLaunch = std::min(kMaxSamplesPerLaunch, frameSamples - currentSample);
+
+			// Only the last pass of the frame is read back
+			const bool lastPass = (currentSample + samplesPerLaunch >= frameSamples);
+			for (size_t i = 0; i < computingUnits.size(); ++i) {
+				computingUnits[i]->SetArgs(currentSample, samplesPerLaunch, previewScale);
+				computingUnits[i]->SetPixelTarget(lastPass ? output->pixels.data() : nullptr);
+			}
+
+			StartPass();
+
+			// The devices are busy: prepare and upload the next frame
+			if (!nextFrameStaged && (frame + 1 < frameCount)) {
+				nextFrameStaged = true;
+
+				path.GetCamera(frame + 1, &nextCamera);
+				SetUpCamera(&nextCamera);
+
+				if (moveSpheres)
+					path.GetSpheres(frame + 1, nextSpheres.data());
+
+				for (size_t i = 0; i < platformContexts.size(); ++i)
+					platformContexts[i]->StageFrame(&nextCamera, moveSpheres ? nextSpheres.data() : spheres);
+			}
+
+			if (FinishPass())
+				currentSample += samplesPerLaunch;
+			else if (IsPixelTargetRetired(output->pixels.data())) {
+				// Left to the failed device, the frame goes on in a new one
+				writer.Retire(output);
+				while (!(output = writer.Acquire(width, height)))
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			}
+		}
+
+		output->fileName = MakeSequenceFileName(options.animationOutput, frame);
+		if (IsFloatImageFile(output->fileName)) {
+			output->colors.resize(width * height);
+			GatherAccumulation(output->colors.data(), nullptr);
+		}
+		writer.Submit(output);
+
+		if (frame + 1 < frameCount) {
+			for (size_t i = 0; i < platformContexts.size(); ++i)
+				platformContexts[i]->SwapFrameBuffers();
+
+			*camera = nextCamera;
+			if (moveSpheres)
+				std::copy(nextSpheres.begin(), nextSpheres.end(), spheres);
+		}
+
+		// The first frame measures the devices, the workload is then kept
+		if ((frame == 0) && (computingUnits.size() > 1)) {
+			for (size_t i = 0; i < computingUnits.size(); ++i)
+				computingUnitsPerfIndex[i] = computingUnits[i]->GetPerformance();
+			AssignWorkload(0, width * height);
+		}
+
+		auto t1 = std::chrono::system_clock::now();
+		std::cerr << "Frame " << (frame + 1) << "/" << frameCount << " done, " <<
+			std::chrono::duration_cast<std::chrono::duration<double>>(t1 - startTime).count() << " sec" << std::endl;
+	}
+
+	samplesPerLaunch = 1;
+
+	// The writer destructor flushes the queued frames
+	return true;
+}
+
+bool RayTracingConfig::RenderConvergence() {
+	std::vector<Vec> reference;
+	unsigned int referenceWidth, referenceHeight;
+	if (!ReadImagePFM(options.convergenceReference, &reference, &referenceWidth, &referenceHeight))
+		return false;
+
+	if ((referenceWidth != width) || (referenceHeight != height)) {
+		std::cerr << "The reference image is " << referenceWidth << "x" << referenceHeight <<
+			", the rendering " << width << "x" << height << std::endl;
+		return false;
+	}
+
+	// The last time ends the measurement, a threshold may never be reached
+	std::vector<float> times;
+	for (size_t i = 0; i < options.convergenceTimes.size(); ++i) {
+		if (std::isfinite(options.convergenceTimes[i]) && (options.convergenceTimes[i] >= 0.f))
+			times.push_back(options.convergenceTimes[i]);
+	}
+	if (times.empty()) {
+		std::cerr << "The convergence needs at least one checkpoint time" << std::endl;
+		return false;
+	}
+	std::sort(times.begin(), times.end());
+	std::vector<float> thresholds = options.convergenceThresholds;
+	std::sort(thresholds.begin(), thresholds.end(), std::greater<float>());
+
+	static const char *kSamplerNames[] = { "random", "sobol", "bluenoise" };
+	static const char *kAccumulationNames[] = { "float", "compact" };
+
+	ConvergenceReport report;
+	report.scene = sceneFile;
+	report.reference = options.convergenceReference;
+	report.sampler = kSamplerNames[options.sampler];
+	report.accumulation = kAccumulationNames[options.accumulation];
+	report.width = width;
+	report.height = height;
+	for (size_t i = 0; i < computingUnits.size(); ++i)
+		report.devices.push_back(computingUnits[i]->GetDeviceName());
+	for (size_t i = 0; i < thresholds.size(); ++i) {
+		ConvergenceThreshold threshold = { thresholds[i], false, 0.f, 0 };
+		report.thresholds.push_back(threshold);
+	}
+
+	std::vector<Vec> colors(width * height);
+	ImageError error = { 0.0, 0.0 };
+	float renderTime = 0.f;
+	size_t nextTime = 0;
+	size_t nextThreshold = 0;
+
+	previewScale = 1;
+	samplesPerLaunch = 1;
+	RestartAccumulation();
+
+	// Same passes and load balancing as the interactive mode, until the last
+	// checkpoint time: the thresholds not reached by then are reported as such
+	while (nextTime < times.size()) {
+		auto startTime = std::chrono::system_clock::now();
+
+		// The error is measured on the accumulation, the pixels are not needed
+		if (ExecuteKernels(false))
+			currentSample += samplesPerLaunch;
+		CheckDeviceWorkload();
+
+		auto endTime = std::chrono::system_clock::now();
+		renderTime += std::chrono::duration_cast<std::chrono::duration<float>>(endTime - startTime).count();
+
+		GatherAccumulation(colors.data(), nullptr);
+		error = ComputeImageError(colors.data(), reference.data(), colors.size());
+
+		for (; (nextTime < times.size()) && (renderTime >= times[nextTime]); ++nextTime) {
+			ConvergenceCheckpoint checkpoint = { times[nextTime], currentSample, error };
+			report.checkpoints.push_back(checkpoint);
+
+			std::cerr << "Convergence: " << times[nextTime] << " sec, " << currentSample << " spp, RMSE " <<
+				error.rmse << ", relMSE " << error.relMSE << std::endl;
+		}
+
+		for (; (nextThreshold < thresholds.size()) && (error.relMSE <= thresholds[nextThreshold]); ++nextThreshold) {
+			report.thresholds[nextThreshold].reached = true;
+			report.thresholds[nextThreshold].seconds = renderTime;
+			report.thresholds[nextThreshold].samples = currentSample;
+		}
+	}
+
+	report.seconds = renderTime;
+	report.samples = currentSample;
+	report.error = error;
+
+	return WriteConvergenceReport(options.convergenceReport, report);
+}
+
+unsigned int RayTracingConfig::RenderProgressive(const unsigned int maxSamples, const float maxSeconds,
+	unsigned int *target, Vec *colors, const std::function<bool(unsigned int, float)>& progress) {
+	if ((maxSamples == 0) && (maxSeconds <= 0.f) && !progress)
+		throw std::invalid_argument("No sample budget, time budget nor progress callback: the rendering would never stop");
+
+	// A device failure restarts the accumulation: the lost samples are rendered again
+	const unsigned int targetSample = currentSample + maxSamples;
+	unsigned int *savedTarget = externalRenderPixels;
+	externalRenderPixels = target;
+	previewScale = 1;
+
+	bool readBack = false;
+	auto startTime = std::chrono::system_clock::now();
+
+	while ((maxSamples == 0) || (currentSample < targetSample)) {
+		// Without a sample budget the passes stay short for the time budget
+		samplesPerLaunch = (maxSamples == 0) ? 1 : std::min(kMaxSamplesPerLaunch, targetSample - currentSample);
+
+		// Only the last pass is read back when it is known in advance
+		readBack = target && (maxSamples > 0) && (currentSample + samplesPerLaunch >= targetSample);
+		if (ExecuteKernels(readBack))
+			currentSample += samplesPerLaunch;
+		else
+			readBack = false;
+		CheckDeviceWorkload();
+
+		auto endTime = std::chrono::system_clock::now();
+		const float elapsedTime = std::chrono::duration_cast<std::chrono::duration<float>>(endTime - startTime).count();
+		if (progress && !progress(currentSample, elapsedTime))
+			break;
+		if ((maxSeconds > 0.f) && (elapsedTime >= maxSeconds))
+			break;
+	}
+
+	// Stopped by the time budget or the callback
+	if (target && !readBack)
+		ReadBackFrame();
+	if (colors)
+		GatherFrameColors(colors);
+
+	// The buffer of the caller is not kept
+	samplesPerLaunch = 1;
+	externalRenderPixels = savedTarget;
+	pixels = renderPixels;
+
+	return currentSample;
+}
+
+void RayTracingConfig::BeginInteraction() {
+	timeLastInteraction = std::chrono::system_clock::now();
+
+	// The reprojection keeps the full resolution history instead
+	if (isInteracting || options.reprojection || (options.previewFrameTime <= 0.f))
+		return;
+
+	isInteracting = true;
+	previewScale = lastPreviewScale;
+}
+
+unsigned int RayTracingConfig::GetPreviewScale() const {
+	return previewScale;
+}
+
+void RayTracingConfig::SetCropWindow(const unsigned int x, const unsigned int y,
+	const unsigned int w, const unsigned int h) {
+	// The headless modes have no frame to crop
+	if (IsHeadless())
+		return;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i)
+		computingUnits[i]->Finish();
+
+	// The pixels out of the window keep the last complete frame. A frame in
+	// a mapped display buffer is write only for the host: it is read back
+	// from the devices again instead.
+	if (pixels != renderPixels) {
+		externalRenderPixels = nullptr;
+		ReadBackFrame();
+	}
+	pixels = renderPixels;
+
+	ApplyCropWindow(x, y, w, h);
+
+	// The accumulation of the previous window does not match the new one
+	RestartAccumulation();
+	UpdateDeviceWorkload(false);
+	frameTimeController.Reset();
+}
+
+bool RayTracingConfig::IsCropping() const {
+	return cropPixels != nullptr;
+}
+
+void RayTracingConfig::GetCropWindow(unsigned int *x, unsigned int *y, unsigned int *w, unsigned int *h) const {
+	*x = cropX;
+	*y = cropY;
+	*w = renderWidth;
+	*h = renderHeight;
+}
+
+bool RayTracingConfig::ApplyCropWindow(unsigned int x, unsigned int y, unsigned int w, unsigned int h) {
+	x = std::min(x, width);
+	y = std::min(y, height);
+	w = std::min(w, width - x);
+	h = std::min(h, height - y);
+
+	delete[] cropPixels;
+	cropPixels = nullptr;
+
+	// The reprojection works on the whole frame
+	const bool wholeFrame = (w == 0) || (h == 0) || ((w == width) && (h == height));
+	if (!wholeFrame && options.reprojection)
+		std::cerr << "The crop window is not used with the reprojection" << std::endl;
+
+	if (wholeFrame || options.reprojection) {
+		cropX = 0;
+		cropY = 0;
+		renderWidth = width;
+		renderHeight = height;
+		return false;
+	}
+
+	cropX = x;
+	cropY = y;
+	renderWidth = w;
+	renderHeight = h;
+	cropPixels = new unsigned int[renderWidth * renderHeight];
+
+	std::cerr << "Crop window: " << renderWidth << "x" << renderHeight << " at " << cropX << ", " << cropY << std::endl;
+
+	return true;
+}
+
+void RayTracingConfig::ComposeCropWindow(unsigned int *frame) const {
+	// The frame buffer rows go from the bottom of the image
+	const unsigned int firstRow = height - cropY - renderHeight;
+	for (unsigned int y = 0; y < renderHeight; ++y)
+		std::copy(cropPixels + y * renderWidth, cropPixels + (y + 1) * renderWidth,
+			frame + (firstRow + y) * width + cropX);
+}
+
+void RayTracingConfig::GatherFrameColors(Vec *colors) {
+	if (!IsCropping()) {
+		GatherAccumulation(colors, nullptr);
+		return;
+	}
+
+	std::vector<Vec> windowColors(renderWidth * renderHeight);
+	GatherAccumulation(windowColors.data(), nullptr);
+
+	const unsigned int firstRow = height - cropY - renderHeight;
+	for (unsigned int y = 0; y < renderHeight; ++y)
+		std::copy(windowColors.begin() + y * renderWidth, windowColors.begin() + (y + 1) * renderWidth,
+			colors + (firstRow + y) * width + cropX);
+}
+
+void RayTracingConfig::ExecutePreview() {
+	auto startTime = std::chrono::system_clock::now();
+	const float idleTime = std::chrono::duration_cast<std::chrono::duration<float>>(startTime - timeLastInteraction).count();
+
+	// Back to full resolution once the input has stopped
+	if (idleTime > options.previewSettleTime) {
+		isInteracting = false;
+		previewScale = 1;
+		samplesPerLaunch = 1;
+		ReInit(false);
+		return;
+	}
+
+	if (ExecuteKernels())
+		currentSample += samplesPerLaunch;
+
+	auto endTime = std::chrono::system_clock::now();
+	UpdatePreviewSettings(std::chrono::duration_cast<std::chrono::duration<float>>(endTime - startTime).count());
+}
+
+void RayTracingConfig::UpdatePreviewSettings(const float passTime) {
+	const float targetTime = options.previewFrameTime;
+	unsigned int scale = previewScale;
+
+	if (passTime > 1.25f * targetTime) {
+		// Too slow: fewer samples first, then fewer pixels
+		if (samplesPerLaunch > 1)
+			samplesPerLaunch /= 2;
+		else if (scale < kMaxPreviewScale)
+			scale *= 2;
+	} else if (passTime < 0.5f * targetTime) {
+		// Halving the scale costs about 4 times more
+		if ((scale > 1) && (4.f * passTime < 0.8f * targetTime))
+			scale /= 2;
+		else if (samplesPerLaunch < kMaxSamplesPerLaunch)
+			samplesPerLaunch *= 2;
+	}
+
+	// The accumulation of a different block size is not reusable
+	if (scale != previewScale) {
+		previewScale = scale;
+		lastPreviewScale = scale;
+		RestartAccumulation();
+	}
 }
 
 const bool RayTracingConfig::IsProfiling() const {
@@ -268,24 +1275,28 @@ const bool RayTracingConfig::IsProfiling() const {
 }
 
 
-void RayTracingConfig::UpdateCamera() {
-	camera->dir = camera->target - camera->orig;
-	camera->dir.norm();
+void RayTracingConfig::SetUpCamera(Camera *cam) const {
+	cam->dir = cam->target - cam->orig;
+	cam->dir.norm();
 
 	const Vec up(0, 1, 0);
 	const float fov = (FLOAT_PI / 180.f) * 45.f;
 
-	camera->x = camera->dir.cross(up);
-	camera->x.norm();
-	camera->x = camera->x * (width * fov / height);
+	cam->x = cam->dir.cross(up);
+	cam->x.norm();
+	cam->x = cam->x * (width * fov / height);
+
+	cam->y = cam->x.cross(cam->dir);
+	cam->y.norm();
+	cam->y = cam->y * fov;
+}
 
-	camera->y = camera->x.cross(camera->dir);
-	camera->y.norm();
-	camera->y = camera->y * fov;
+void RayTracingConfig::UpdateCamera() {
+	SetUpCamera(camera);
 
 	// Update devices
-	for (size_t i = 0; i < computingUnits.size(); ++i)
-		computingUnits[i]->UpdateCameraBuffer(camera);
+	for (size_t i = 0; i < platformContexts.size(); ++i)
+		platformContexts[i]->UpdateCameraBuffer(camera);
 }
 
 const std::vector<ComputingUnit *>& RayTracingConfig::GetComputingItem() const {
@@ -293,15 +1304,190 @@ const std::vector<ComputingUnit *>& RayTracingConfig::GetComputingItem() const {
 }
 
 
-void RayTracingConfig::ExecuteKernels() {
+bool RayTracingConfig::ExecuteKernels(const bool readBack) {
+	const unsigned int nextSample = currentSample + samplesPerLaunch;
+
+	// A frame dump reads back into a writer frame instead of copying the displayed one
+	ImageFrame *dumpFrame = nullptr;
+	if (imageWriter && (previewScale == 1) &&
+		(nextSample / options.dumpInterval > currentSample / options.dumpInterval))
+		dumpFrame = imageWriter->Acquire(width, height);
+
+	unsigned int *target = nullptr;
+	if (dumpFrame)
+		target = dumpFrame->pixels.data();
+	else if (readBack)
+		target = externalRenderPixels ? externalRenderPixels : renderPixels;
+
+	// While cropping the devices read back the window only
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		computingUnits[i]->SetArgs(currentSample, samplesPerLaunch, previewScale);
+		computingUnits[i]->SetPixelTarget((target && IsCropping()) ? cropPixels : target);
+	}
+
+	// Trigger the rendering threads and wait for them
+	StartPass();
+	const bool passDone = FinishPass();
+
+	// The range of the failed devices is stale: the previous frame stays
+	if (!passDone) {
+		if (dumpFrame) {
+			if (IsPixelTargetRetired(dumpFrame->pixels.data()))
+				imageWriter->Retire(dumpFrame);
+			else
+				imageWriter->Release(dumpFrame);
+		}
+
+		return false;
+	}
+
+	if (target && IsCropping()) {
+		// A dump gets the window over the last complete frame
+		if (dumpFrame) {
+			ComposeCropWindow(renderPixels);
+			std::copy(renderPixels, renderPixels + width * height, target);
+		} else
+			ComposeCropWindow(target);
+	}
+
+	if (target)
+		pixels = target;
+
+	if (dumpFrame) {
+		dumpFrame->fileName = MakeSequenceFileName(options.dumpFile, nextSample);
+
+		if (IsFloatImageFile(dumpFrame->fileName)) {
+			dumpFrame->colors.assign(width * height, Vec());
+			GatherFrameColors(dumpFrame->colors.data());
+		}
+
+		imageWriter->Submit(dumpFrame);
+	}
+
+	return true;
+}
+
+void RayTracingConfig::ReadBackFrame() {
+	unsigned int *target = externalRenderPixels ? externalRenderPixels : renderPixels;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		computingUnits[i]->SetReadbackOnly(true);
+		computingUnits[i]->SetPixelTarget(IsCropping() ? cropPixels : target);
+	}
+
+	StartPass();
+	const bool passDone = FinishPass();
+
+	for (size_t i = 0; i < computingUnits.size(); ++i)
+		computingUnits[i]->SetReadbackOnly(false);
+
+	if (!passDone)
+		return;
+
+	if (IsCropping())
+		ComposeCropWindow(target);
+
+	pixels = target;
+}
+
+void RayTracingConfig::StartPass() {
 	for (size_t i = 0; i < computingUnits.size(); ++i)
-		computingUnits[i]->SetArgs(currentSample);
+		computingUnits[i]->BeginPass();
 
-	// Trigger the rendering threads
 	threadStartBarrier->wait();
+}
 
-	// Wait for job done signal
-	threadEndBarrier->wait();
+bool RayTracingConfig::FinishPass() {
+	if (options.passTimeout <= 0.f)
+		threadEndBarrier->wait();
+	else {
+		const std::chrono::duration<float> timeout(options.passTimeout);
+		while (!threadEndBarrier->wait_for(timeout)) {
+			for (size_t i = 0; i < computingUnits.size(); ++i)
+				computingUnits[i]->GiveUp("no answer after " + std::to_string(options.passTimeout) + " sec");
+		}
+	}
+
+	return RemoveFailedUnits();
+}
+
+bool RayTracingConfig::RemoveFailedUnits() {
+	bool allDone = true;
+
+	for (size_t i = 0; i < computingUnits.size();) {
+		if (!computingUnits[i]->IsFailed()) {
+			++i;
+			continue;
+		}
+
+		std::cerr << "[Device::" << computingUnits[i]->GetDeviceName() << "] Removed after a failure (" <<
+			computingUnits[i]->GetFailure() << "), its " << computingUnits[i]->GetWorkAmount() <<
+			" pixels go to the other devices" << std::endl;
+
+		RetirePixelTarget(computingUnits[i]->GetPendingPixelTarget());
+
+		failedUnits.push_back(computingUnits[i]);
+		computingUnits.erase(computingUnits.begin() + i);
+		computingUnitsPerfIndex.erase(computingUnitsPerfIndex.begin() + i);
+		allDone = false;
+	}
+
+	if (allDone)
+		return true;
+
+	if (computingUnits.empty())
+		throw std::runtime_error("No device left to render");
+
+	selectedDevice = std::min<unsigned int>(selectedDevice, static_cast<unsigned int>(computingUnits.size() - 1));
+	workLoadProfilingFlag = workLoadProfilingFlag && (computingUnits.size() > 1);
+
+	// The accumulation of the failed ranges can not be read back: the
+	// surviving devices restart the image, split by their performance
+	RestartAccumulation();
+	AssignWorkload(workRangeOffset, workRangeAmount);
+	frameTimeController.Reset();
+
+	return false;
+}
+
+void RayTracingConfig::RetirePixelTarget(unsigned int *target) {
+	if (!target || IsPixelTargetRetired(target))
+		return;
+
+	retiredPixelTargets.push_back(target);
+
+	// The copy keeps the last frame for the display. A late readback may
+	// tear the range of the failed device in it, the next pass renders it again.
+	if (target == renderPixels) {
+		renderPixels = new unsigned int[width * height];
+		std::copy(target, target + width * height, renderPixels);
+		if (pixels == target)
+			pixels = renderPixels;
+	} else if (target == cropPixels) {
+		cropPixels = new unsigned int[renderWidth * renderHeight];
+		std::copy(target, target + renderWidth * renderHeight, cropPixels);
+	}
+}
+
+bool RayTracingConfig::IsPixelTargetRetired(const unsigned int *target) const {
+	return std::find(retiredPixelTargets.begin(), retiredPixelTargets.end(), target) != retiredPixelTargets.end();
+}
+
+unsigned int RayTracingConfig::GetDroppedFrames() const {
+	return imageWriter ? imageWriter->GetDroppedFrames() : 0;
+}
+
+void RayTracingConfig::SetExternalRenderTarget(unsigned int *target) {
+	externalRenderPixels = target;
+}
+
+const RenderOptions& RayTracingConfig::GetOptions() const {
+	return options;
+}
+
+bool RayTracingConfig::IsHeadless() const {
+	return !options.tiledOutput.empty() || !options.animationFile.empty() ||
+		!options.convergenceReport.empty();
 }
 
 void RayTracingConfig::CheckDeviceWorkload() {
@@ -320,6 +1506,22 @@ const double RayTracingConfig::GetPerformanceIndex(size_t index) const {
 }
 
 void RayTracingConfig::UpdateDeviceWorkload(bool calculateNewLoad) {
+	// Keep the accumulated samples when only the split between the devices changes
+	std::vector<Vec> savedColors;
+	std::vector<unsigned int> savedSeeds;
+	const unsigned int savedSample = currentSample;
+	std::vector<float> savedCounts;
+	if (savedSample > 0) {
+		savedColors.resize(renderWidth * renderHeight);
+		savedSeeds.resize(2 * renderWidth * renderHeight);
+		GatherAccumulation(savedColors.data(), savedSeeds.data());
+
+		if (options.reprojection) {
+			savedCounts.resize(renderWidth * renderHeight);
+			GatherReprojectionState(savedCounts.data(), nullptr);
+		}
+	}
+
 	if (calculateNewLoad) {
 		// Define how to split the workload
 		computingUnitsPerfIndex.resize(computingUnits.size(), 1.f);
@@ -328,11 +1530,31 @@ void RayTracingConfig::UpdateDeviceWorkload(bool calculateNewLoad) {
 			computingUnitsPerfIndex[i] = computingUnits[i]->GetPerformance();
 	}
 
+	AssignWorkload(0, renderWidth * renderHeight);
+
+	if (savedSample > 0) {
+		// The compact accumulation is converted with the sample counts:
+		// restore them first
+		currentSample = savedSample;
+		if (options.reprojection) {
+			const std::vector<float> noDepths(renderWidth * renderHeight, 0.f);
+			ScatterReprojectionState(savedCounts.data(), noDepths.data());
+		}
+
+		ScatterAccumulation(savedColors.data(), savedSeeds.data());
+	} else
+		RestartAccumulation();
+}
+
+void RayTracingConfig::AssignWorkload(const unsigned int rangeOffset, const unsigned int rangeAmount) {
+	workRangeOffset = rangeOffset;
+	workRangeAmount = rangeAmount;
+
 	double totalPerformance = 0.0;
 	for (size_t i = 0; i < computingUnits.size(); ++i)
 		totalPerformance += computingUnitsPerfIndex[i]; // sum up all the portions
 
-	const unsigned int totalWorkload = width * height;  // total data size
+	const unsigned int totalWorkload = rangeAmount;  // total data size
 
 	// Set the workload for each computing unit
 	unsigned int workOffset = 0;
@@ -356,10 +1578,162 @@ void RayTracingConfig::UpdateDeviceWorkload(bool calculateNewLoad) {
 			}
 		}
 
-		computingUnits[i]->SetWorkLoad(workOffset, workAmount, width, height, pixels);
+		// The frame buffer rows go from the bottom of the image
+		computingUnits[i]->SetCropWindow(width, height, cropX, height - cropY - renderHeight);
+		computingUnits[i]->SetWorkLoad(rangeOffset + workOffset, workAmount, renderWidth, renderHeight,
+			IsCropping() ? cropPixels : pixels);
+		computingUnits[i]->GetMetrics().performanceShare = computingUnitsPerfIndex[i] / totalPerformance;
 
 		workOffset += workAmount;
 	}
+}
+
+void RayTracingConfig::GatherAccumulation(Vec *accumulation, unsigned int *seeds) {
+	const unsigned int totalWorkload = renderWidth * renderHeight;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		const unsigned int offset = computingUnits[i]->GetWorkOffset();
+		if (offset >= totalWorkload)
+			continue;
+
+		const size_t count = std::min<size_t>(computingUnits[i]->GetWorkAmount(), totalWorkload - offset);
+		computingUnits[i]->ReadAccumulation(&accumulation[offset], seeds ? &seeds[2 * offset] : nullptr, count,
+			currentSample);
+	}
+}
+
+void RayTracingConfig::ScatterAccumulation(const Vec *accumulation, const unsigned int *seeds) {
+	const unsigned int totalWorkload = renderWidth * renderHeight;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		const unsigned int offset = computingUnits[i]->GetWorkOffset();
+		if (offset >= totalWorkload)
+			continue;
+
+		const size_t count = std::min<size_t>(computingUnits[i]->GetWorkAmount(), totalWorkload - offset);
+		computingUnits[i]->WriteAccumulation(&accumulation[offset], &seeds[2 * offset], count, currentSample);
+	}
+}
+
+void RayTracingConfig::GatherReprojectionState(float *sampleCounts, FirstHit *firstHits) {
+	const unsigned int totalWorkload = renderWidth * renderHeight;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		const unsigned int offset = computingUnits[i]->GetWorkOffset();
+		if (offset >= totalWorkload)
+			continue;
+
+		const size_t count = std::min<size_t>(computingUnits[i]->GetWorkAmount(), totalWorkload - offset);
+		computingUnits[i]->ReadReprojectionState(&sampleCounts[offset], firstHits ? &firstHits[offset] : nullptr, count);
+	}
+}
 
+void RayTracingConfig::ScatterReprojectionState(const float *sampleCounts, const float *expectedDepths) {
+	const unsigned int totalWorkload = renderWidth * renderHeight;
+
+	for (size_t i = 0; i < computingUnits.size(); ++i) {
+		const unsigned int offset = computingUnits[i]->GetWorkOffset();
+		if (offset >= totalWorkload)
+			continue;
+
+		const size_t count = std::min<size_t>(computingUnits[i]->GetWorkAmount(), totalWorkload - offset);
+		computingUnits[i]->WriteReprojectionState(&sampleCounts[offset], &expectedDepths[offset], count);
+	}
+}
+
+void RayTracingConfig::RestartAccumulation() {
 	currentSample = 0;
+
+	if (options.reprojection) {
+		for (size_t i = 0; i < computingUnits.size(); ++i)
+			computingUnits[i]->ClearReprojectionState();
+	}
+}
+
+void RayTracingConfig::ReprojectHistory() {
+	const size_t pixelCount = width * height;
+
+	std::vector<Vec> colors(pixelCount);
+	std::vector<unsigned int> seeds(2 * pixelCount);
+	std::vector<float> counts(pixelCount);
+	std::vector<FirstHit> firstHits(pixelCount);
+	GatherAccumulation(colors.data(), seeds.data());
+	GatherReprojectionState(counts.data(), firstHits.data());
+
+	UpdateCamera();
+
+	std::vector<Vec> newColors;
+	std::vector<float> newCounts;
+	std::vector<float> expectedDepths;
+	ReprojectAccumulation(*camera, width, height, options.reprojectionMaxHistory,
+		colors, counts, firstHits, &newColors, &newCounts, &expectedDepths);
+
+	ScatterReprojectionState(newCounts.data(), expectedDepths.data());
+	ScatterAccumulation(newColors.data(), seeds.data());
+}
+
+CheckpointKey RayTracingConfig::GetCheckpointKey() const {
+	CheckpointKey key = MakeCheckpointKey(spheres, sphereCount, camera, renderWidth, renderHeight);
+
+	// The accumulation of a crop window is only valid for the same window of the same frame
+	if (IsCropping()) {
+		const unsigned int window[4] = { width, height, cropX, cropY };
+		key.sceneHash = HashBytes(window, sizeof(window), key.sceneHash);
+	}
+
+	// The instanced geometry is part of the scene as well
+	if (!instances.empty()) {
+		key.sceneHash = HashBytes(prototypeSpheres.data(), sizeof(Sphere) * prototypeSpheres.size(), key.sceneHash);
+		key.sceneHash = HashBytes(instances.data(), sizeof(Instance) * instances.size(), key.sceneHash);
+	}
+
+	// The mesh table holds the materials, the mapped files the geometry: an
+	// edit can move vertices or reorder triangles within the same bounds
+	if (!meshes.empty()) {
+		key.sceneHash = HashBytes(meshes.data(), sizeof(Mesh) * meshes.size(), key.sceneHash);
+		key.sceneHash = HashBytes(&meshGeometryHash, sizeof(meshGeometryHash), key.sceneHash);
+	}
+
+	return key;
+}
+
+void RayTracingConfig::ResumeFromCheckpoint() {
+	CheckpointData data;
+	if (!LoadCheckpoint(options.checkpointFile, GetCheckpointKey(), &data))
+		return;
+
+	currentSample = data.currentSample;
+
+	// Every pixel of a checkpoint has the same number of samples. The counts
+	// go first, the compact accumulation is converted with them.
+	if (options.reprojection) {
+		const std::vector<float> counts(renderWidth * renderHeight, static_cast<float>(currentSample));
+		const std::vector<float> noDepths(renderWidth * renderHeight, 0.f);
+		ScatterReprojectionState(counts.data(), noDepths.data());
+	}
+
+	ScatterAccumulation(data.colors.data(), data.seeds.data());
+
+	std::cerr << "Resumed from checkpoint " << options.checkpointFile << " at pass " << currentSample << std::endl;
+}
+
+void RayTracingConfig::CheckCheckpoint() {
+	if (!checkpointWriter || (currentSample == 0) || isInteracting)
+		return;
+
+	auto t = std::chrono::system_clock::now();
+	double d = std::chrono::duration_cast<std::chrono::duration<double>>(t - timeLastCheckpoint).count();
+	if (d < options.checkpointInterval)
+		return;
+
+	// The device to host copy happens here, the file is written by the writer thread
+	CheckpointData *data = new CheckpointData();
+	data->key = GetCheckpointKey();
+	data->currentSample = currentSample;
+	data->colors.resize(renderWidth * renderHeight);
+	data->seeds.resize(2 * renderWidth * renderHeight);
+	GatherAccumulation(data->colors.data(), data->seeds.data());
+
+	checkpointWriter->Submit(data);
+	timeLastCheckpoint = t;
 }
\ No newline at end of file
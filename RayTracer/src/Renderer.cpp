@@ -0,0 +1,63 @@
+#include <stdexcept>
+#include <algorithm>
+
+#include "Renderer.hpp"
+#include "RayTracingConfig.hpp"
+
+
+static RenderOptions LibraryOptions(const RenderOptions& options) {
+	RenderOptions libraryOptions = options;
+	libraryOptions.tiledOutput.clear();
+	libraryOptions.animationFile.clear();
+	libraryOptions.convergenceReport.clear();
+
+	return libraryOptions;
+}
+
+Renderer::Renderer(const SceneData& scene, const unsigned int w, const unsigned int h,
+	const RendererSettings& settings) {
+	if ((w == 0) || (h == 0))
+		throw std::runtime_error("Invalid image size");
+
+	config = new RayTracingConfig(scene, w, h, settings.useCPUs, settings.useGPUs,
+		settings.forceGPUWorkSize, LibraryOptions(settings.options));
+}
+
+Renderer::~Renderer() {
+	delete config;
+}
+
+unsigned int Renderer::GetWidth() const {
+	return config->width;
+}
+
+unsigned int Renderer::GetHeight() const {
+	return config->height;
+}
+
+unsigned int Renderer::GetSampleCount() const {
+	return config->currentSample;
+}
+
+void Renderer::SetCamera(const Vec& orig, const Vec& target) {
+	config->camera->orig = orig;
+	config->camera->target = target;
+	config->ReInit(false);
+}
+
+void Renderer::SetSpheres(const std::vector<Sphere>& spheres) {
+	if (spheres.size() != config->sphereCount)
+		throw std::runtime_error("The sphere count can not change");
+
+	std::copy(spheres.begin(), spheres.end(), config->spheres);
+	config->ReInitScene();
+}
+
+void Renderer::Reset() {
+	config->ReInitScene();
+}
+
+unsigned int Renderer::Render(const RenderBudget& budget, unsigned int *pixels, Vec *colors,
+	const RenderProgressCallback& progress) {
+	return config->RenderProgressive(budget.samples, budget.seconds, pixels, colors, progress);
+}
@@ -0,0 +1,63 @@
+#include <cmath>
+#include <algorithm>
+
+#include "Reprojection.hpp"
+
+
+void ReprojectAccumulation(const Camera& newCamera,
+	const unsigned int width, const unsigned int height,
+	const float maxHistory,
+	const std::vector<Vec>& colors, const std::vector<float>& sampleCounts,
+	const std::vector<FirstHit>& firstHits,
+	std::vector<Vec> *newColors, std::vector<float> *newSampleCounts,
+	std::vector<float> *expectedDepths) {
+
+	const size_t pixelCount = width * height;
+	newColors->assign(pixelCount, Vec());
+	newSampleCounts->assign(pixelCount, 0.f);
+	expectedDepths->assign(pixelCount, 0.f);
+
+	// Inverse of GeneratePrimaryRay(): rdir = x * kcx + y * kcy + dir, with
+	// x, y and dir orthogonal and dir normalized
+	Vec camX = newCamera.x;
+	Vec camY = newCamera.y;
+	const float invX2 = 1.f / camX.dot(camX);
+	const float invY2 = 1.f / camY.dot(camY);
+
+	for (size_t i = 0; i < pixelCount; ++i) {
+		const FirstHit& hit = firstHits[i];
+		if ((hit.depth <= 0.f) || (sampleCounts[i] <= 0.f))
+			continue;
+
+		const Vec d = hit.p - newCamera.orig;
+		const float s = d.dot(newCamera.dir);
+		if (s <= 0.f)
+			continue;
+
+		const float kcx = d.dot(camX) * invX2 / s;
+		const float kcy = d.dot(camY) * invY2 / s;
+
+		// GeneratePrimaryRay() puts the pixel centers at integer coordinates:
+		// the nearest one is the target
+		const float fx = std::floor((kcx + .5f) * width + .5f);
+		const float fy = std::floor((kcy + .5f) * height + .5f);
+		if ((fx < 0.f) || (fy < 0.f) || (fx >= width) || (fy >= height))
+			continue;
+
+		const size_t target = static_cast<size_t>(fy) * width + static_cast<size_t>(fx);
+
+		// Primary rays start 0.1 * rdir away from the camera origin
+		const Vec rdir = camX * kcx + camY * kcy + newCamera.dir;
+		const float depth = std::sqrt(d.dot(d)) - 0.1f * std::sqrt(rdir.dot(rdir));
+		if (depth <= 0.f)
+			continue;
+
+		// Keep the nearest surface
+		if (((*expectedDepths)[target] > 0.f) && ((*expectedDepths)[target] <= depth))
+			continue;
+
+		(*newColors)[target] = colors[i];
+		(*newSampleCounts)[target] = std::min(sampleCounts[i], maxHistory);
+		(*expectedDepths)[target] = depth;
+	}
+}
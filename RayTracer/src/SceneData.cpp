@@ -0,0 +1,140 @@
+#include <cstdio>
+#include <cstring>
+
+#include "SceneData.hpp"
+
+
+static bool ReadMaterial(const int material, Refl *refl, const char *what, const unsigned int i) {
+	switch (material) {
+	case 0:
+		*refl = DIFFuse;
+		return true;
+	case 1:
+		*refl = SPECular;
+		return true;
+	case 2:
+		*refl = REFRactive;
+		return true;
+	default:
+		fprintf(stderr, "Failed to parse material type for %s #%d: %d\n", what, i, material);
+		return false;
+	}
+}
+
+static bool ReadSphere(FILE *f, Sphere *s, const unsigned int i) {
+	int material;
+	int k = fscanf(f, "sphere %f  %f %f %f  %f %f %f  %f %f %f  %d\n",
+		&s->rad,
+		&s->p.x, &s->p.y, &s->p.z,
+		&s->e.x, &s->e.y, &s->e.z,
+		&s->c.x, &s->c.y, &s->c.z,
+		&material);
+
+	if (k != 11) {
+		fprintf(stderr, "Failed to read sphere #%d: %d\n", i, k);
+		return false;
+	}
+
+	return ReadMaterial(material, &s->refl, "sphere", i);
+}
+
+static bool ReadScene(FILE *f, const std::string& fileName, SceneData *scene) {
+	/* Read the camera position */
+	int c = fscanf(f, "camera %f %f %f  %f %f %f\n",
+		&scene->cameraOrig.x, &scene->cameraOrig.y, &scene->cameraOrig.z,
+		&scene->cameraTarget.x, &scene->cameraTarget.y, &scene->cameraTarget.z);
+	if (c != 6) {
+		fprintf(stderr, "Failed to read 6 camera parameters: %d\n", c);
+		return false;
+	}
+
+	/* Read the sphere count */
+	unsigned int sphereCount;
+	c = fscanf(f, "size %u\n", &sphereCount);
+	if (c != 1) {
+		fprintf(stderr, "Failed to read sphere count: %d\n", c);
+		return false;
+	}
+
+	/* Read all spheres */
+	scene->spheres.resize(sphereCount);
+	for (unsigned int i = 0; i < sphereCount; i++) {
+		if (!ReadSphere(f, &scene->spheres[i], i))
+			return false;
+	}
+
+	/* Optional prototype groups, their instances and triangle meshes:
+	 *   prototype <sphere count>, followed by the spheres in prototype space
+	 *   instance <prototype index> <translate x y z> <scale>
+	 *   mesh <OBJ file, relative to the scene file> <color r g b> <material> */
+	char keyword[32];
+	while (fscanf(f, "%31s", keyword) == 1) {
+		if (strcmp(keyword, "prototype") == 0) {
+			unsigned int count;
+			if ((fscanf(f, "%u\n", &count) != 1) || (count == 0)) {
+				fprintf(stderr, "Failed to read the sphere count of prototype #%d\n", (int)scene->prototypes.size());
+				return false;
+			}
+
+			ScenePrototype proto;
+			proto.spheres.resize(count);
+			for (unsigned int i = 0; i < count; i++) {
+				if (!ReadSphere(f, &proto.spheres[i], i))
+					return false;
+			}
+
+			scene->prototypes.push_back(proto);
+		} else if (strcmp(keyword, "instance") == 0) {
+			SceneInstance inst;
+			c = fscanf(f, "%u  %f %f %f  %f\n", &inst.prototype,
+				&inst.translate.x, &inst.translate.y, &inst.translate.z, &inst.scale);
+			if (c != 5) {
+				fprintf(stderr, "Failed to read instance #%d: %d\n", (int)scene->instances.size(), c);
+				return false;
+			}
+
+			scene->instances.push_back(inst);
+		} else if (strcmp(keyword, "mesh") == 0) {
+			char meshFileName[1024];
+			SceneMesh mesh;
+			int material;
+			c = fscanf(f, "%1023s  %f %f %f  %d\n", meshFileName,
+				&mesh.c.x, &mesh.c.y, &mesh.c.z, &material);
+			if (c != 5) {
+				fprintf(stderr, "Failed to read mesh #%d: %d\n", (int)scene->meshes.size(), c);
+				return false;
+			}
+			if (!ReadMaterial(material, &mesh.refl, "mesh", static_cast<unsigned int>(scene->meshes.size())))
+				return false;
+
+			std::string path = meshFileName;
+			const size_t slash = fileName.find_last_of("/\\");
+			if ((slash != std::string::npos) && (path[0] != '/') && (path[0] != '\\') && (path.find(':') == std::string::npos))
+				path = fileName.substr(0, slash + 1) + path;
+			mesh.objFileName = path;
+
+			scene->meshes.push_back(mesh);
+		} else {
+			fprintf(stderr, "Unknown scene keyword: %s\n", keyword);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ReadSceneFile(const std::string& fileName, SceneData *scene) {
+	fprintf(stderr, "Reading scene: %s\n", fileName.c_str());
+
+	FILE *f = fopen(fileName.c_str(), "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	*scene = SceneData();
+	const bool result = ReadScene(f, fileName, scene);
+	fclose(f);
+
+	return result;
+}
@@ -0,0 +1,94 @@
+#include <cstdio>
+#include <cstdlib>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <exception>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+#include "ThreadAffinity.hpp"
+
+
+bool GetNumaNodeCpus(const unsigned int node, std::vector<unsigned int> *cpus) {
+	cpus->clear();
+
+#if defined(__linux__)
+	// The list looks like "0-7,16-23"
+	std::ifstream file("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+	if (!file)
+		return false;
+
+	std::string list;
+	std::getline(file, list);
+
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ',')) {
+		if (range.empty())
+			continue;
+
+		const size_t dash = range.find('-');
+		const unsigned int first = atoi(range.substr(0, dash).c_str());
+		const unsigned int last = (dash == std::string::npos) ? first : atoi(range.substr(dash + 1).c_str());
+
+		for (unsigned int cpu = first; cpu <= last; ++cpu)
+			cpus->push_back(cpu);
+	}
+#endif
+
+	return !cpus->empty();
+}
+
+bool PinCurrentThread(const std::vector<unsigned int>& cpus) {
+	if (cpus.empty())
+		return false;
+
+#if defined(__linux__)
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (size_t i = 0; i < cpus.size(); ++i)
+		CPU_SET(cpus[i], &set);
+
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#elif defined(_WIN32)
+	DWORD_PTR mask = 0;
+	for (size_t i = 0; i < cpus.size(); ++i) {
+		if (cpus[i] < sizeof(DWORD_PTR) * 8)
+			mask |= (DWORD_PTR)1 << cpus[i];
+	}
+
+	return (mask != 0) && (SetThreadAffinityMask(GetCurrentThread(), mask) != 0);
+#else
+	return false;
+#endif
+}
+
+void RunPinned(const std::vector<unsigned int>& cpus, const std::function<void()>& func) {
+	if (cpus.empty()) {
+		func();
+		return;
+	}
+
+	// Exceptions are forwarded to the caller
+	std::exception_ptr error;
+	std::thread worker([&cpus, &func, &error]() {
+		PinCurrentThread(cpus);
+		try {
+			func();
+		} catch (...) {
+			error = std::current_exception();
+		}
+	});
+	worker.join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
@@ -0,0 +1,536 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+
+#include <vector>
+#include <algorithm>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+
+#include "TriangleMesh.hpp"
+
+
+static const char kMeshMagic[4] = { 'R', 'T', 'M', 'S' };
+static const uint32_t kMeshVersion = 1;
+
+struct MeshFileHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t vertexCount;
+	uint32_t triangleCount;
+	uint32_t nodeCount;
+	float boundMin[3];
+	float quantScale[3];
+	uint32_t reserved;
+};
+
+// The index array starts on a 4 byte boundary
+static size_t GetVertexBytes(const uint32_t vertexCount) {
+	return (sizeof(uint16_t) * 3 * vertexCount + 3) & ~static_cast<size_t>(3);
+}
+
+static size_t GetIndexOffset(const MeshFileHeader& header) {
+	return sizeof(MeshFileHeader) + GetVertexBytes(header.vertexCount);
+}
+
+static size_t GetNodeOffset(const MeshFileHeader& header) {
+	return GetIndexOffset(header) + sizeof(uint32_t) * 3 * header.triangleCount;
+}
+
+static size_t GetFileSize(const MeshFileHeader& header) {
+	return GetNodeOffset(header) + sizeof(MeshBVHNode) * header.nodeCount;
+}
+
+
+//------------------------------------------------------------------------------
+// MappedMesh
+
+MappedMesh::MappedMesh() {
+}
+
+MappedMesh::~MappedMesh() {
+	Close();
+}
+
+bool MappedMesh::Open(const std::string& fileName) {
+	Close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER size;
+	GetFileSizeEx(file, &size);
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (!mapping) {
+		CloseHandle(file);
+		return false;
+	}
+
+	fileHandle = file;
+	mappingHandle = mapping;
+	dataSize = static_cast<size_t>(size.QuadPart);
+	data = static_cast<const unsigned char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	const int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		close(fd);
+		return false;
+	}
+
+	dataSize = static_cast<size_t>(st.st_size);
+	void *mapping = (dataSize > 0) ? mmap(NULL, dataSize, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+
+	data = (mapping == MAP_FAILED) ? nullptr : static_cast<const unsigned char *>(mapping);
+#endif
+
+	if (!data) {
+		Close();
+		return false;
+	}
+
+	const MeshFileHeader *header = reinterpret_cast<const MeshFileHeader *>(data);
+	if ((dataSize < sizeof(MeshFileHeader)) ||
+		(memcmp(header->magic, kMeshMagic, sizeof(kMeshMagic)) != 0) ||
+		(header->version != kMeshVersion) ||
+		(dataSize != GetFileSize(*header)) ||
+		(header->triangleCount == 0) || (header->nodeCount == 0)) {
+		fprintf(stderr, "Invalid mesh file: %s\n", fileName.c_str());
+		Close();
+		return false;
+	}
+
+	return true;
+}
+
+void MappedMesh::Close() {
+#ifdef _WIN32
+	if (data)
+		UnmapViewOfFile(data);
+	if (mappingHandle)
+		CloseHandle(mappingHandle);
+	if (fileHandle)
+		CloseHandle(fileHandle);
+
+	mappingHandle = nullptr;
+	fileHandle = nullptr;
+#else
+	if (data)
+		munmap(const_cast<unsigned char *>(data), dataSize);
+#endif
+
+	data = nullptr;
+	dataSize = 0;
+}
+
+unsigned int MappedMesh::GetVertexCount() const {
+	return reinterpret_cast<const MeshFileHeader *>(data)->vertexCount;
+}
+
+unsigned int MappedMesh::GetTriangleCount() const {
+	return reinterpret_cast<const MeshFileHeader *>(data)->triangleCount;
+}
+
+unsigned int MappedMesh::GetNodeCount() const {
+	return reinterpret_cast<const MeshFileHeader *>(data)->nodeCount;
+}
+
+Vec MappedMesh::GetBoundMin() const {
+	const MeshFileHeader *header = reinterpret_cast<const MeshFileHeader *>(data);
+	return Vec(header->boundMin[0], header->boundMin[1], header->boundMin[2]);
+}
+
+Vec MappedMesh::GetQuantScale() const {
+	const MeshFileHeader *header = reinterpret_cast<const MeshFileHeader *>(data);
+	return Vec(header->quantScale[0], header->quantScale[1], header->quantScale[2]);
+}
+
+const uint16_t *MappedMesh::GetVertices() const {
+	return reinterpret_cast<const uint16_t *>(data + sizeof(MeshFileHeader));
+}
+
+const uint32_t *MappedMesh::GetIndices() const {
+	return reinterpret_cast<const uint32_t *>(data + GetIndexOffset(*reinterpret_cast<const MeshFileHeader *>(data)));
+}
+
+const MeshBVHNode *MappedMesh::GetNodes() const {
+	return reinterpret_cast<const MeshBVHNode *>(data + GetNodeOffset(*reinterpret_cast<const MeshFileHeader *>(data)));
+}
+
+size_t MappedMesh::GetDeviceSize() const {
+	return sizeof(uint16_t) * 3 * GetVertexCount() + sizeof(uint32_t) * 3 * GetTriangleCount() +
+		sizeof(MeshBVHNode) * GetNodeCount();
+}
+
+
+//------------------------------------------------------------------------------
+// BVH construction (binned SAH over the triangle centroids)
+
+namespace {
+
+const unsigned int kBinCount = 16;
+const unsigned int kMinLeafSize = 4;	// Smaller nodes are never split
+const unsigned int kMaxLeafSize = 8;
+const unsigned int kMaxDepth = 48;	// The kernel traversal stack holds 64 nodes
+
+struct Bounds {
+	float bmin[3];
+	float bmax[3];
+
+	Bounds() {
+		for (int i = 0; i < 3; ++i) {
+			bmin[i] = 1e30f;
+			bmax[i] = -1e30f;
+		}
+	}
+
+	void Grow(const float *lo, const float *hi) {
+		for (int i = 0; i < 3; ++i) {
+			bmin[i] = std::min(bmin[i], lo[i]);
+			bmax[i] = std::max(bmax[i], hi[i]);
+		}
+	}
+
+	float Area() const {
+		const float dx = std::max(0.f, bmax[0] - bmin[0]);
+		const float dy = std::max(0.f, bmax[1] - bmin[1]);
+		const float dz = std::max(0.f, bmax[2] - bmin[2]);
+		return dx * dy + dy * dz + dz * dx;
+	}
+};
+
+class BVHBuilder {
+
+public:
+	BVHBuilder(const std::vector<BVHPrimitive>& buildTriangles, const float *boxPadding) :
+		order(buildTriangles.size()), triangles(buildTriangles) {
+		for (size_t i = 0; i < order.size(); ++i)
+			order[i] = static_cast<uint32_t>(i);
+		for (int i = 0; i < 3; ++i)
+			padding[i] = boxPadding[i];
+
+		nodes.resize(1);
+		Build(0, 0, static_cast<unsigned int>(order.size()), 0);
+	}
+
+	std::vector<uint32_t> order;	// triangles in leaf order
+	std::vector<MeshBVHNode> nodes;
+
+private:
+	void Build(const size_t nodeIndex, const unsigned int first, const unsigned int count, const unsigned int depth) {
+		Bounds bounds, centroidBounds;
+		for (unsigned int i = first; i < first + count; ++i) {
+			const BVHPrimitive& tri = triangles[order[i]];
+			bounds.Grow(tri.bmin, tri.bmax);
+			centroidBounds.Grow(tri.centroid, tri.centroid);
+		}
+
+		// Boxes are padded by a quantization step against rounding in the kernel
+		for (int i = 0; i < 3; ++i) {
+			nodes[nodeIndex].bmin[i] = bounds.bmin[i] - padding[i];
+			nodes[nodeIndex].bmax[i] = bounds.bmax[i] + padding[i];
+		}
+		nodes[nodeIndex].leftFirst = first;
+		nodes[nodeIndex].count = count;
+
+		if ((count <= kMinLeafSize) || (depth >= kMaxDepth))
+			return;
+
+		int axis = 0;
+		for (int i = 1; i < 3; ++i) {
+			if (centroidBounds.bmax[i] - centroidBounds.bmin[i] > centroidBounds.bmax[axis] - centroidBounds.bmin[axis])
+				axis = i;
+		}
+
+		const float cmin = centroidBounds.bmin[axis];
+		const float extent = centroidBounds.bmax[axis] - cmin;
+		if (extent <= 0.f)
+			return;
+
+		auto binIndex = [&](const BVHPrimitive& tri) {
+			const unsigned int b = static_cast<unsigned int>((tri.centroid[axis] - cmin) * kBinCount / extent);
+			return std::min(b, kBinCount - 1);
+		};
+
+		Bounds binBounds[kBinCount];
+		unsigned int binCounts[kBinCount] = { 0 };
+		for (unsigned int i = first; i < first + count; ++i) {
+			const BVHPrimitive& tri = triangles[order[i]];
+			const unsigned int b = binIndex(tri);
+			binBounds[b].Grow(tri.bmin, tri.bmax);
+			++binCounts[b];
+		}
+
+		// Cost of the split before bin s, swept from both sides
+		float rightCost[kBinCount] = { 0.f };
+		Bounds acc;
+		unsigned int n = 0;
+		for (unsigned int s = kBinCount - 1; s > 0; --s) {
+			acc.Grow(binBounds[s].bmin, binBounds[s].bmax);
+			n += binCounts[s];
+			rightCost[s] = (n > 0) ? acc.Area() * n : -1.f;
+		}
+
+		unsigned int bestSplit = 0;
+		float bestCost = 1e30f;
+		acc = Bounds();
+		n = 0;
+		for (unsigned int s = 1; s < kBinCount; ++s) {
+			acc.Grow(binBounds[s - 1].bmin, binBounds[s - 1].bmax);
+			n += binCounts[s - 1];
+			if ((n == 0) || (rightCost[s] < 0.f))
+				continue;
+
+			const float cost = acc.Area() * n + rightCost[s];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestSplit = s;
+			}
+		}
+
+		if (bestSplit == 0)
+			return;
+
+		// Traversal and intersection costs of 1
+		const float area = bounds.Area();
+		const float splitCost = 1.f + ((area > 0.f) ? bestCost / area : 0.f);
+		if ((splitCost >= count) && (count <= kMaxLeafSize))
+			return;
+
+		auto middle = std::partition(order.begin() + first, order.begin() + first + count,
+			[&](const uint32_t i) { return binIndex(triangles[i]) < bestSplit; });
+		const unsigned int leftCount = static_cast<unsigned int>(middle - (order.begin() + first));
+
+		const size_t leftIndex = nodes.size();
+		nodes.resize(leftIndex + 2);
+		nodes[nodeIndex].leftFirst = static_cast<unsigned int>(leftIndex);
+		nodes[nodeIndex].count = 0;
+
+		Build(leftIndex, first, leftCount, depth + 1);
+		Build(leftIndex + 1, first + leftCount, count - leftCount, depth + 1);
+	}
+
+	const std::vector<BVHPrimitive>& triangles;
+	float padding[3];
+};
+
+}
+
+void BuildBVH(const std::vector<BVHPrimitive>& primitives, const float *padding,
+	std::vector<MeshBVHNode> *nodes, std::vector<uint32_t> *order) {
+	BVHBuilder bvh(primitives, padding);
+	nodes->swap(bvh.nodes);
+	order->swap(bvh.order);
+}
+
+
+//------------------------------------------------------------------------------
+// OBJ conversion
+
+static bool ReadObj(const std::string& fileName, std::vector<float> *positions, std::vector<uint32_t> *indices) {
+	FILE *f = fopen(fileName.c_str(), "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open mesh file: %s\n", fileName.c_str());
+		return false;
+	}
+
+	char line[4096];
+	unsigned int lineNumber = 0;
+	std::vector<uint32_t> face;
+	while (fgets(line, sizeof(line), f)) {
+		++lineNumber;
+
+		if ((line[0] == 'v') && ((line[1] == ' ') || (line[1] == '\t'))) {
+			float x, y, z;
+			if (sscanf(line + 2, "%f %f %f", &x, &y, &z) != 3) {
+				fprintf(stderr, "Failed to read vertex at line %u of %s\n", lineNumber, fileName.c_str());
+				fclose(f);
+				return false;
+			}
+
+			positions->push_back(x);
+			positions->push_back(y);
+			positions->push_back(z);
+		} else if ((line[0] == 'f') && ((line[1] == ' ') || (line[1] == '\t'))) {
+			// Vertex index of each "v", "v/vt", "v//vn" or "v/vt/vn" entry
+			face.clear();
+			const long vertexCount = static_cast<long>(positions->size() / 3);
+			char *p = line + 2;
+			while (true) {
+				char *end;
+				long index = strtol(p, &end, 10);
+				if (end == p)
+					break;
+
+				index = (index < 0) ? (vertexCount + index) : (index - 1);
+				if ((index < 0) || (index >= vertexCount)) {
+					fprintf(stderr, "Invalid vertex index at line %u of %s\n", lineNumber, fileName.c_str());
+					fclose(f);
+					return false;
+				}
+				face.push_back(static_cast<uint32_t>(index));
+
+				p = end;
+				while (*p && (*p != ' ') && (*p != '\t'))
+					++p;
+			}
+
+			for (size_t i = 2; i < face.size(); ++i) {
+				indices->push_back(face[0]);
+				indices->push_back(face[i - 1]);
+				indices->push_back(face[i]);
+			}
+		}
+	}
+
+	fclose(f);
+
+	return true;
+}
+
+bool ConvertObjToMesh(const std::string& objFileName, const std::string& meshFileName) {
+	fprintf(stderr, "Converting mesh: %s\n", objFileName.c_str());
+
+	std::vector<float> positions;
+	std::vector<uint32_t> indices;
+	if (!ReadObj(objFileName, &positions, &indices))
+		return false;
+
+	const uint32_t vertexCount = static_cast<uint32_t>(positions.size() / 3);
+	const uint32_t triangleCount = static_cast<uint32_t>(indices.size() / 3);
+	if (triangleCount == 0) {
+		fprintf(stderr, "No triangle in mesh file: %s\n", objFileName.c_str());
+		return false;
+	}
+
+	MeshFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kMeshMagic, sizeof(kMeshMagic));
+	header.version = kMeshVersion;
+	header.vertexCount = vertexCount;
+	header.triangleCount = triangleCount;
+
+	// Quantize the vertices over the bounding box
+	float bmax[3];
+	for (int k = 0; k < 3; ++k) {
+		header.boundMin[k] = 1e30f;
+		bmax[k] = -1e30f;
+	}
+	for (uint32_t i = 0; i < vertexCount; ++i) {
+		for (int k = 0; k < 3; ++k) {
+			header.boundMin[k] = std::min(header.boundMin[k], positions[3 * i + k]);
+			bmax[k] = std::max(bmax[k], positions[3 * i + k]);
+		}
+	}
+	for (int k = 0; k < 3; ++k)
+		header.quantScale[k] = (bmax[k] - header.boundMin[k]) / 65535.f;
+
+	std::vector<uint16_t> vertices(3 * vertexCount);
+	std::vector<float> dequantized(3 * vertexCount);
+	for (uint32_t i = 0; i < 3 * vertexCount; ++i) {
+		const int k = i % 3;
+		const float q = (header.quantScale[k] > 0.f) ? ((positions[i] - header.boundMin[k]) / header.quantScale[k]) : 0.f;
+		vertices[i] = static_cast<uint16_t>(std::min(65535.f, std::max(0.f, std::floor(q + .5f))));
+
+		// The BVH bounds the triangles the kernel will see
+		dequantized[i] = header.boundMin[k] + vertices[i] * header.quantScale[k];
+	}
+
+	std::vector<BVHPrimitive> buildTriangles(triangleCount);
+	for (uint32_t t = 0; t < triangleCount; ++t) {
+		BVHPrimitive& tri = buildTriangles[t];
+		for (int k = 0; k < 3; ++k) {
+			const float a = dequantized[3 * indices[3 * t] + k];
+			const float b = dequantized[3 * indices[3 * t + 1] + k];
+			const float c = dequantized[3 * indices[3 * t + 2] + k];
+			tri.bmin[k] = std::min(a, std::min(b, c));
+			tri.bmax[k] = std::max(a, std::max(b, c));
+			tri.centroid[k] = (a + b + c) / 3.f;
+		}
+	}
+
+	std::vector<MeshBVHNode> nodes;
+	std::vector<uint32_t> order;
+	BuildBVH(buildTriangles, header.quantScale, &nodes, &order);
+	header.nodeCount = static_cast<uint32_t>(nodes.size());
+
+	std::vector<uint32_t> sortedIndices(3 * triangleCount);
+	for (uint32_t t = 0; t < triangleCount; ++t) {
+		for (int k = 0; k < 3; ++k)
+			sortedIndices[3 * t + k] = indices[3 * order[t] + k];
+	}
+
+	FILE *f = fopen(meshFileName.c_str(), "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open mesh file: %s\n", meshFileName.c_str());
+		return false;
+	}
+
+	const uint16_t zero = 0;
+	bool ok = (fwrite(&header, sizeof(header), 1, f) == 1) &&
+		(fwrite(vertices.data(), sizeof(uint16_t), vertices.size(), f) == vertices.size()) &&
+		(((vertexCount % 2) == 0) || (fwrite(&zero, sizeof(zero), 1, f) == 1)) &&
+		(fwrite(sortedIndices.data(), sizeof(uint32_t), sortedIndices.size(), f) == sortedIndices.size()) &&
+		(fwrite(nodes.data(), sizeof(MeshBVHNode), nodes.size(), f) == nodes.size());
+	ok = (fclose(f) == 0) && ok;
+
+	if (!ok) {
+		fprintf(stderr, "Failed to write mesh file: %s\n", meshFileName.c_str());
+		remove(meshFileName.c_str());
+	}
+
+	return ok;
+}
+
+bool LoadObjMesh(const std::string& objFileName, MappedMesh *mesh) {
+	const std::string meshFileName = objFileName + ".rtmesh";
+
+	struct stat objStat, meshStat;
+	const bool hasObj = (stat(objFileName.c_str(), &objStat) == 0);
+	const bool hasMesh = (stat(meshFileName.c_str(), &meshStat) == 0);
+	if (!hasObj && !hasMesh) {
+		fprintf(stderr, "Failed to open mesh file: %s\n", objFileName.c_str());
+		return false;
+	}
+
+	bool converted = false;
+	if (!hasMesh || (hasObj && (meshStat.st_mtime < objStat.st_mtime))) {
+		if (!ConvertObjToMesh(objFileName, meshFileName))
+			return false;
+		converted = true;
+	}
+
+	if (!mesh->Open(meshFileName)) {
+		// Written by another version
+		if (converted || !hasObj || !ConvertObjToMesh(objFileName, meshFileName) || !mesh->Open(meshFileName))
+			return false;
+	}
+
+	const double triangles = mesh->GetTriangleCount();
+	fprintf(stderr, "Mesh %s: %u triangles, %u vertices, %u BVH nodes, %.1f bytes/triangle "
+		"(vertices %.1f, indices %.1f, BVH %.1f)\n",
+		objFileName.c_str(), mesh->GetTriangleCount(), mesh->GetVertexCount(), mesh->GetNodeCount(),
+		mesh->GetDeviceSize() / triangles,
+		sizeof(uint16_t) * 3 * mesh->GetVertexCount() / triangles,
+		sizeof(uint32_t) * 3.0,
+		sizeof(MeshBVHNode) * mesh->GetNodeCount() / triangles);
+
+	return true;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Quality and throughput of the compact accumulation against the float one:
+# runs Tool/convergence.sh with each format and prints, per scene, the
+# samples per pixel reached, the samples per second and the final relative
+# MSE of both, and their ratios.
+#
+# Usage: Tool/accumulation.sh <RayTracer binary> [report prefix] [extra options]
+#
+# The reports are written to <prefix>_float.json and <prefix>_compact.json
+# (prefix "accumulation" by default). WIDTH, HEIGHT, USE_CPU, USE_GPU and
+# REFERENCE_SPP are passed to convergence.sh; large frames show the memory
+# bandwidth savings best. The rounding error of the compact sums grows with
+# the samples per pixel: pass --convergence-times long enough to reach 10000
+# samples or more, with a REFERENCE_SPP above that.
+
+set -e
+
+BINARY=$1
+PREFIX=${2:-accumulation}
+[ $# -ge 2 ] && shift 2 || shift $#
+
+TOOL=$(cd "$(dirname "$0")" && pwd)
+
+for FORMAT in float compact; do
+	"$TOOL/convergence.sh" "$BINARY" "${PREFIX}_$FORMAT.json" --accumulation "$FORMAT" "$@"
+done
+
+# One "scene samples samples_per_second relmse" line per scene of a report
+summary() {
+	awk -F': ' '
+		/^  "scene"/ { gsub(/[",]/, "", $2); scene = $2 }
+		/^  "samples"/ { gsub(/,/, "", $2); spp = $2 }
+		/^  "samples_per_second"/ { gsub(/,/, "", $2); sps = $2 }
+		/^  "relmse"/ { print scene, spp, sps, $2 }
+	' "$1"
+}
+
+summary "${PREFIX}_float.json" > "${PREFIX}_float.txt"
+summary "${PREFIX}_compact.json" > "${PREFIX}_compact.txt"
+
+printf "%-32s %12s %14s %14s %8s %14s %14s %8s\n" scene spp "float spp/s" "compact spp/s" speedup \
+	"float relMSE" "compact relMSE" ratio
+paste -d ' ' "${PREFIX}_float.txt" "${PREFIX}_compact.txt" | awk '{
+	n = split($1, path, "/")
+	printf "%-32s %12s %14.4g %14.4g %8.3f %14.4g %14.4g %8.3f\n", path[n], $2 "/" $6, $3, $7,
+		($3 > 0) ? $7 / $3 : 0, $4, $8, ($4 > 0) ? $8 / $4 : 0
+}'
+
+rm -f "${PREFIX}_float.txt" "${PREFIX}_compact.txt"
@@ -0,0 +1,62 @@
+#!/bin/sh
+# Time-to-quality run over all the scenes: renders each Scene/*.scn for a
+# fixed time and writes the error against its reference image at each
+# checkpoint, and the time to reach each error threshold, as one JSON array.
+#
+# Usage: Tool/convergence.sh <RayTracer binary> [report.json] [extra options]
+#
+# The references are Scene/reference/<scene>_<width>x<height>.pfm. The
+# missing ones are rendered first with --tiled at REFERENCE_SPP samples.
+
+set -e
+
+BINARY=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+REPORT=${2:-convergence.json}
+[ $# -ge 2 ] && shift 2 || shift $#
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WIDTH=${WIDTH:-400}
+HEIGHT=${HEIGHT:-300}
+USE_CPU=${USE_CPU:-1}
+USE_GPU=${USE_GPU:-1}
+REFERENCE_SPP=${REFERENCE_SPP:-16384}
+
+case "$REPORT" in
+/*) ;;
+*) REPORT=$(pwd)/$REPORT ;;
+esac
+
+# The kernel is loaded from ../RayTracer/kernel
+mkdir -p "$ROOT/Generated" "$ROOT/Scene/reference"
+cd "$ROOT/Generated"
+
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+for SCENE in "$ROOT"/Scene/*.scn; do
+	NAME=$(basename "$SCENE" .scn)
+	REFERENCE="$ROOT/Scene/reference/${NAME}_${WIDTH}x${HEIGHT}.pfm"
+
+	if [ ! -f "$REFERENCE" ]; then
+		echo "Rendering the reference of $NAME" >&2
+		"$BINARY" "$USE_CPU" "$USE_GPU" 0 "$WIDTH" "$HEIGHT" "$SCENE" \
+			--tiled "$REFERENCE" --tile-spp "$REFERENCE_SPP"
+	fi
+
+	echo "Measuring $NAME" >&2
+	"$BINARY" "$USE_CPU" "$USE_GPU" 0 "$WIDTH" "$HEIGHT" "$SCENE" \
+		--convergence "$TMP/$NAME.json" --reference "$REFERENCE" "$@"
+done
+
+{
+	echo "["
+	FIRST=1
+	for RESULT in "$TMP"/*.json; do
+		[ $FIRST -eq 1 ] || echo ","
+		FIRST=0
+		cat "$RESULT"
+	done
+	echo "]"
+} > "$REPORT"
+
+echo "Report written to $REPORT" >&2
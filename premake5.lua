@@ -43,6 +43,26 @@ workspace "RayTracingParallel"
 
         files {"RayTracer/**.cpp", "RayTracer/**.hpp","RayTracer/**.cl"}
 
+    -- The rendering library (see Renderer.hpp), without the GLUT front end
+
+    project "RayTracerLib"
+
+        kind "StaticLib"
+        includedirs "RayTracer/include"
+
+        files {"RayTracer/**.cpp", "RayTracer/**.hpp","RayTracer/**.cl"}
+        removefiles {"RayTracer/src/LauncherMain.cpp", "RayTracer/src/DisplayProcedure.cpp", "RayTracer/src/PixelBufferRing.cpp",
+            "RayTracer/include/DisplayProcedure.hpp", "RayTracer/include/PixelBufferRing.hpp"}
+
+    -- Microbenchmarks of the host vector math
+
+    project "VecBench"
+
+        kind "ConsoleApp"
+        includedirs "RayTracer/include"
+
+        files {"Benchmark/**.cpp", "RayTracer/src/Sphere.cpp", "RayTracer/src/Ray.cpp"}
+
 
 
 